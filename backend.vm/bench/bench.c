@@ -0,0 +1,999 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "koflvm.h"
+#include "bytecode.h"
+#include "chunk.h"
+#include "heap.h"
+#include "scheduler.h"
+#include "stack.h"
+#include "table.h"
+#include "value.h"
+#include "verifier.h"
+#include "vm.h"
+
+/**
+ * Micro benchmarks of every subsystem of the runtime and macro
+ * benchmarks of the programs of bench/corpus, written to stdout as
+ * one JSON document:
+ *
+ *   {"benchmarks": [{"name": "table/get_hit", "iterations": 100000,
+ *                    "ns_per_op": 12.3, "bytes_per_op": 0.0}, ...]}
+ *
+ * bytes_per_op counts the bytes handed out by the vm heap, so the
+ * structures allocated with malloc, like the tables, report 0. The
+ * opcode benchmarks time a pattern that pushes the operands of the
+ * opcode and pops its result, "opcode/CONST_POP" is the cost of the
+ * pattern alone. Every opcode has one, the run fails when an opcode
+ * of the OPCODES table is missing. SPAWN, AWAIT and YIELD run in a
+ * fiber and have no "opcode_jit/" entry.
+ *
+ * "isolates/<program>_x<threads>" runs one shared chunk of the
+ * program in an isolate per thread, its ns_per_op is the wall time
+ * of a run of all of them. "fibers/<program>_w<workers>" runs the
+ * program as BENCH_MACRO_RUNS fibers of a scheduler, each one in a
+ * fresh vm, its ns_per_op is the wall time per fiber.
+ *
+ * The programs of bench/fibers are assembled by hand, koflc doesn't
+ * emit OP_SPAWN, OP_AWAIT or OP_YIELD:
+ *
+ *   leaf     yields 8 times between two sums, then sets global 0
+ *   fail     divides by zero with OP_DIV_I32
+ *   spawner  spawns 4 leaves, awaits them, then spawns a fail and
+ *            awaits it, the results of the awaits set global 0
+ *   ping     awaits fiber 1
+ *   pong     awaits fiber 0
+ *
+ * "fibers/spawn_await_w<workers>" spawns a spawner in a fresh
+ * scheduler, "fibers/deadlock_w<workers>" a ping and a pong, that
+ * await each other and are failed once the workers are idle. They
+ * check the status of every fiber and fail otherwise, its ns_per_op
+ * is the wall time of a run of the scheduler.
+ *
+ * The corpus programs are compiled with `koflc <name>.kofl <name>.kbc`
+ * and must be rebuilt when the bytecode version changes.
+ *
+ * usage: koflvm_bench [--jit-check] [filter], runs the benchmarks
+ * whose name contains filter. With --jit-check the jit benchmarks
+ * run every chunk in the interpreter too and compare, like koflvm
+ * --jit-check. The exit status is a failure when any benchmark
+ * failed, so ctest runs them as the differential tests of the jit
+ */
+
+#ifndef KOFLVM_BENCH_CORPUS
+#define KOFLVM_BENCH_CORPUS "bench/corpus"
+#endif
+
+#ifndef KOFLVM_BENCH_FIBERS
+#define KOFLVM_BENCH_FIBERS "bench/fibers"
+#endif
+
+#define BENCH_TABLE_KEYS 100000
+#define BENCH_OPCODE_PATTERNS 4096
+#define BENCH_OPCODE_RUNS 64
+#define BENCH_FIBER_OPCODE_RUNS 8
+#define BENCH_MACRO_RUNS 200
+#define BENCH_ISOLATE_THREADS 4
+#define BENCH_FIBER_PROGRAM_RUNS 50
+#define BENCH_FIBER_PROGRAM_FIBERS 6
+
+typedef struct {
+  const char *filter;
+  int count;
+  bool jit_check;
+  int failures;
+} BenchContext;
+
+// the benchmarks only write to it, so the loops aren't optimized away
+static volatile uint64_t bench_sink;
+
+static double BenchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static bool BenchSelected(BenchContext *context, const char *name) {
+  return context->filter == NULL || strstr(name, context->filter) != NULL;
+}
+
+static void BenchReport(BenchContext *context, const char *name, size_t iterations, double ns, size_t bytes) {
+  printf("%s\n    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.3f, \"bytes_per_op\": %.3f}",
+         context->count == 0 ? "" : ",", name, iterations, ns / (double) iterations,
+         (double) bytes / (double) iterations);
+  fflush(stdout);
+
+  context->count++;
+}
+
+static void BenchFail(BenchContext *context, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+
+  context->failures++;
+}
+
+// bench functions>
+static void BenchStack(BenchContext *context) {
+  if (!BenchSelected(context, "stack/push_pop")) return;
+
+  Stack *stack = StackCreate(16);
+  size_t count = 1000000;
+
+  double start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    StackPush(stack, INT_VALUE(i));
+    bench_sink += StackPop(stack);
+  }
+  BenchReport(context, "stack/push_pop", count, BenchNow() - start, 0);
+
+  StackDispose(stack);
+}
+
+static string_t **BenchKeys(const char *prefix, size_t count) {
+  string_t **keys = malloc(count * sizeof(string_t *));
+
+  for (size_t i = 0; i < count; i++) {
+    char *values = malloc(32);
+    int length = snprintf(values, 32, "%s_%zu", prefix, i);
+
+    keys[i] = StringCreate(NULL, values, length, StringHash(values, length));
+  }
+
+  return keys;
+}
+
+static void BenchKeysDispose(string_t **keys, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    free(keys[i]->values);
+    free(keys[i]);
+  }
+
+  free(keys);
+}
+
+static void BenchTable(BenchContext *context) {
+  if (!BenchSelected(context, "table/")) return;
+
+  size_t count = BENCH_TABLE_KEYS;
+  string_t **keys = BenchKeys("key", count);
+  string_t **misses = BenchKeys("miss", count);
+  Table *table = table_create(0);
+  Value value;
+
+  double start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    table_set(table, OBJ_VALUE(keys[i]), INT_VALUE(i));
+  }
+  BenchReport(context, "table/set", count, BenchNow() - start, 0);
+
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    bench_sink += table_get(table, OBJ_VALUE(keys[i]), &value);
+  }
+  BenchReport(context, "table/get_hit", count, BenchNow() - start, 0);
+
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    bench_sink += table_get(table, OBJ_VALUE(misses[i]), &value);
+  }
+  BenchReport(context, "table/get_miss", count, BenchNow() - start, 0);
+
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    bench_sink += table_remove(table, OBJ_VALUE(keys[i]));
+  }
+  BenchReport(context, "table/remove", count, BenchNow() - start, 0);
+
+  table_dispose(table);
+  BenchKeysDispose(keys, count);
+  BenchKeysDispose(misses, count);
+}
+
+static void BenchValue(BenchContext *context) {
+  if (!BenchSelected(context, "value/")) return;
+
+  Heap *heap = HeapCreate(0);
+  ValueArray *array = ValueArrayCreate(heap, 0, 0);
+  size_t count = 1000000;
+
+  size_t allocated = heap->allocated_total;
+  double start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    ValueArrayWrite(array, i % 2 == 0 ? INT_VALUE(i) : NUM_VALUE((double) i));
+  }
+  BenchReport(context, "value/array_write", count, BenchNow() - start, heap->allocated_total - allocated);
+
+  double sum = 0;
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    sum += ValueToNumber(array->values[i]);
+  }
+  BenchReport(context, "value/to_number", count, BenchNow() - start, 0);
+  bench_sink += (uint64_t) sum;
+
+  ValueArrayDispose(array);
+  HeapDispose(heap);
+}
+
+/**
+ * Concatenates @param count strings of 64 chars one after the other,
+ * the result grows as a rope once it's past the inline strings
+ */
+static void BenchConcat(BenchContext *context, size_t count) {
+  char name[64];
+  snprintf(name, sizeof(name), "string/concat_chain_%zu", count);
+  if (!BenchSelected(context, name)) return;
+
+  Vm *vm = VmCreate((Flags) {0});
+  // the partial results aren't roots, nothing is collected
+  vm->next_gc = SIZE_MAX;
+
+  char piece_values[64];
+  memset(piece_values, 'k', sizeof(piece_values));
+  Object *piece = (Object *) VmCopyString(vm, piece_values, sizeof(piece_values));
+  Object *result = piece;
+
+  size_t allocated = vm->heap->allocated_total;
+  double start = BenchNow();
+  for (size_t i = 1; i < count; i++) {
+    result = VmConcat(vm, result, piece);
+  }
+  double end = BenchNow();
+
+  bench_sink += StringLength(result);
+  BenchReport(context, name, count - 1, end - start, vm->heap->allocated_total - allocated);
+
+  VmDispose(vm);
+}
+
+/**
+ * Builds a chunk that sets @param global to its only constant,
+ * @param string, concatenated to itself. The result of a short
+ * string is a copy, so the constant is only referenced by the chunk
+ */
+static Chunk *BenchStringChunk(Vm *vm, const char *string, const char *global) {
+  Chunk *chunk = ChunkCreate(NULL, 0, 16);
+  if (chunk == NULL) return NULL;
+
+  string_t *value = VmCopyString(vm, string, strlen(string));
+  string_t *name = VmCopyString(vm, global, strlen(global));
+
+  bool written = value != NULL && name != NULL &&
+      ChunkWriteConst(chunk, OBJ_VALUE(value)) == 0 &&
+      ChunkWriteGlobal(chunk, OBJ_VALUE(name)) == 0 &&
+      ChunkWriteIndexed(chunk, OP_CONST, 0, 1) &&
+      ChunkWriteIndexed(chunk, OP_CONST, 0, 1) &&
+      ChunkWrite(chunk, OP_CONCAT, 1) &&
+      ChunkWriteIndexed(chunk, OP_SET_GLOBAL_SLOT, 0, 1) &&
+      ChunkWrite(chunk, OP_RET, 1);
+
+  if (!written) {
+    ChunkDispose(chunk);
+    return NULL;
+  }
+
+  return chunk;
+}
+
+/**
+ * Runs a chunk, another one, then the first again in one vm that
+ * collects on every allocation. The strings the first run wrote into
+ * the constants of the first chunk must survive the run of the other
+ */
+static void BenchEvalOtherChunk(BenchContext *context) {
+  const char *name = "gc/eval_other_chunk";
+  if (!BenchSelected(context, name)) return;
+
+  const char *string = "only first";
+  Vm *vm = VmCreate((Flags) {.gc_stress = true});
+
+  // the constants aren't roots until the chunk runs
+  vm->gc_stress = false;
+  Chunk *first = BenchStringChunk(vm, string, "first");
+  vm->gc_stress = true;
+
+  bool ok = first != NULL && VmEval(vm, first) == kResultOK;
+
+  vm->gc_stress = false;
+  Chunk *other = BenchStringChunk(vm, "the second", "other");
+  vm->gc_stress = true;
+
+  size_t count = 1000;
+  size_t allocated = vm->heap->allocated_total;
+  double start = BenchNow();
+  for (size_t i = 0; i < count && ok; i++) {
+    ok = other != NULL && VmEval(vm, other) == kResultOK;
+
+    string_t *interned = table_find_string(vm->strings, string, strlen(string), StringHash(string, strlen(string)));
+    ok = ok && interned != NULL && first->consts->values[0] == OBJ_VALUE(interned);
+
+    ok = ok && VmEval(vm, first) == kResultOK;
+  }
+  double end = BenchNow();
+
+  // the first chunk is linked last, its global is at slot 0
+  string_t *result = ok ? VmFlatten(vm, vm->global_values->values[0]) : NULL;
+  if (result == NULL || result->length != 2 * strlen(string) ||
+      strncmp(result->values, string, strlen(string)) != 0 ||
+      strncmp(result->values + strlen(string), string, strlen(string)) != 0) {
+    BenchFail(context, "%s: the constant of the first chunk was collected\n", name);
+  } else {
+    BenchReport(context, name, count, end - start, vm->heap->allocated_total - allocated);
+  }
+
+  if (first != NULL) ChunkDispose(first);
+  if (other != NULL) ChunkDispose(other);
+  VmDispose(vm);
+}
+
+// the indexes of the strings in bench_strings are the ones of their constants
+typedef enum {
+  kBenchName,
+  kBenchString,
+  kBenchOtherString,
+  kBenchTask,
+  kBenchInt,
+  kBenchOtherInt,
+  kBenchDouble,
+  kBenchOtherDouble,
+  kBenchConstCount
+} BenchConst;
+
+// the slot of the only global, named by kBenchName
+#define BENCH_SLOT 0
+
+// the task the fibers of the opcode benchmarks spawn, it returns at once
+#define BENCH_TASK "bench_task"
+
+/**
+ * The strings of the opcode benchmarks, the chunks read them from a
+ * pool laid out like the one of a bytecode file, so every vm that
+ * runs a chunk loads its own copy
+ */
+static const char *bench_strings[] = {"bench_global", "kofl", "vm", BENCH_TASK};
+static uint8_t bench_pool[128];
+static uint32_t bench_pool_size;
+
+static void BenchWriteU32(uint8_t *bytes, uint32_t value) {
+  for (int byte = 0; byte < 4; byte++) {
+    bytes[byte] = (uint8_t) (value >> (8 * byte));
+  }
+}
+
+/**
+ * The instructions of an opcode benchmark, the pattern starts with
+ * the operands the opcode needs and leaves the stack as it was
+ */
+typedef struct {
+  const char *name;
+  int count;
+  instruction_t steps[5];
+} OpcodeBench;
+
+#define CONST_STEP(index) {OP_CONST, index}
+#define STEP(op) {op, 0}
+#define INT_BINARY_BENCH(op) {#op + 3, 4, {CONST_STEP(kBenchInt), CONST_STEP(kBenchOtherInt), STEP(op), STEP(OP_POP)}}
+#define DOUBLE_BINARY_BENCH(op) \
+    {#op + 3, 4, {CONST_STEP(kBenchDouble), CONST_STEP(kBenchOtherDouble), STEP(op), STEP(OP_POP)}}
+
+/**
+ * Every opcode but OP_RET, that ends every chunk, is run by one of
+ * the patterns, see BenchOpcodeCoverage. The _QUICK variants are
+ * written as is, the first run rewrites the ones that don't match
+ * their operands. OP_SPAWN, OP_AWAIT and OP_YIELD run in a fiber,
+ * see BenchOpcodeFiber
+ */
+static const OpcodeBench opcode_benches[] = {
+    {"CONST_POP", 2, {CONST_STEP(kBenchInt), STEP(OP_POP)}},
+    {"CONST_WIDE16", 2, {{OP_CONST_WIDE16, kBenchInt}, STEP(OP_POP)}},
+    {"CONST_WIDE24", 2, {{OP_CONST_WIDE24, kBenchInt}, STEP(OP_POP)}},
+    {"TRUE", 2, {STEP(OP_TRUE), STEP(OP_POP)}},
+    {"FALSE", 2, {STEP(OP_FALSE), STEP(OP_POP)}},
+    {"NOT", 3, {STEP(OP_TRUE), STEP(OP_NOT), STEP(OP_POP)}},
+    {"NEGATE", 3, {CONST_STEP(kBenchDouble), STEP(OP_NEGATE), STEP(OP_POP)}},
+    {"SUM", 4, {CONST_STEP(kBenchInt), CONST_STEP(kBenchDouble), STEP(OP_SUM), STEP(OP_POP)}},
+    {"SUB", 4, {CONST_STEP(kBenchInt), CONST_STEP(kBenchDouble), STEP(OP_SUB), STEP(OP_POP)}},
+    {"MULT", 4, {CONST_STEP(kBenchInt), CONST_STEP(kBenchDouble), STEP(OP_MULT), STEP(OP_POP)}},
+    DOUBLE_BINARY_BENCH(OP_DIV),
+    INT_BINARY_BENCH(OP_SUM_I32),
+    INT_BINARY_BENCH(OP_SUB_I32),
+    INT_BINARY_BENCH(OP_MULT_I32),
+    INT_BINARY_BENCH(OP_DIV_I32),
+    {"NEGATE_I32", 3, {CONST_STEP(kBenchInt), STEP(OP_NEGATE_I32), STEP(OP_POP)}},
+    INT_BINARY_BENCH(OP_LESS_I32),
+    INT_BINARY_BENCH(OP_LESS_EQUAL_I32),
+    INT_BINARY_BENCH(OP_GREATER_I32),
+    INT_BINARY_BENCH(OP_GREATER_EQUAL_I32),
+    INT_BINARY_BENCH(OP_EQUAL_I32),
+    INT_BINARY_BENCH(OP_NOT_EQUAL_I32),
+    {"I32_TO_F64", 3, {CONST_STEP(kBenchInt), STEP(OP_I32_TO_F64), STEP(OP_POP)}},
+    DOUBLE_BINARY_BENCH(OP_SUM_F64),
+    DOUBLE_BINARY_BENCH(OP_SUB_F64),
+    DOUBLE_BINARY_BENCH(OP_MULT_F64),
+    DOUBLE_BINARY_BENCH(OP_DIV_F64),
+    {"NEGATE_F64", 3, {CONST_STEP(kBenchDouble), STEP(OP_NEGATE_F64), STEP(OP_POP)}},
+    INT_BINARY_BENCH(OP_SUM_QUICK_I32),
+    DOUBLE_BINARY_BENCH(OP_SUM_QUICK_F64),
+    INT_BINARY_BENCH(OP_SUB_QUICK_I32),
+    DOUBLE_BINARY_BENCH(OP_SUB_QUICK_F64),
+    INT_BINARY_BENCH(OP_MULT_QUICK_I32),
+    DOUBLE_BINARY_BENCH(OP_MULT_QUICK_F64),
+    INT_BINARY_BENCH(OP_DIV_QUICK_I32),
+    DOUBLE_BINARY_BENCH(OP_DIV_QUICK_F64),
+    {"NEGATE_QUICK_I32", 3, {CONST_STEP(kBenchInt), STEP(OP_NEGATE_QUICK_I32), STEP(OP_POP)}},
+    {"NEGATE_QUICK_F64", 3, {CONST_STEP(kBenchDouble), STEP(OP_NEGATE_QUICK_F64), STEP(OP_POP)}},
+    {"CONST_SUM_I32", 3, {CONST_STEP(kBenchInt), {OP_CONST_SUM_I32, kBenchOtherInt}, STEP(OP_POP)}},
+    {"CONST_SUM_F64", 3, {CONST_STEP(kBenchDouble), {OP_CONST_SUM_F64, kBenchOtherDouble}, STEP(OP_POP)}},
+    {"GET_GLOBAL_SLOT_SUM_I32", 3, {CONST_STEP(kBenchInt), {OP_GET_GLOBAL_SLOT_SUM_I32, BENCH_SLOT}, STEP(OP_POP)}},
+    // the global holds an int, the pattern sets it to a double first
+    {"GET_GLOBAL_SLOT_SUM_F64", 5, {CONST_STEP(kBenchDouble), {OP_SET_GLOBAL_SLOT, BENCH_SLOT},
+                                    CONST_STEP(kBenchOtherDouble), {OP_GET_GLOBAL_SLOT_SUM_F64, BENCH_SLOT},
+                                    STEP(OP_POP)}},
+    // the operands are the constant, then the slot
+    {"CONST_SET_GLOBAL_SLOT", 1, {{OP_CONST_SET_GLOBAL_SLOT, kBenchInt | BENCH_SLOT << 8}}},
+    {"CONCAT", 4, {CONST_STEP(kBenchString), CONST_STEP(kBenchOtherString), STEP(OP_CONCAT), STEP(OP_POP)}},
+    {"SET_GLOBAL_SLOT", 2, {CONST_STEP(kBenchInt), {OP_SET_GLOBAL_SLOT, BENCH_SLOT}}},
+    {"SET_GLOBAL_SLOT_WIDE16", 2, {CONST_STEP(kBenchInt), {OP_SET_GLOBAL_SLOT_WIDE16, BENCH_SLOT}}},
+    {"SET_GLOBAL_SLOT_WIDE24", 2, {CONST_STEP(kBenchInt), {OP_SET_GLOBAL_SLOT_WIDE24, BENCH_SLOT}}},
+    {"GET_GLOBAL_SLOT", 2, {{OP_GET_GLOBAL_SLOT, BENCH_SLOT}, STEP(OP_POP)}},
+    {"GET_GLOBAL_SLOT_WIDE16", 2, {{OP_GET_GLOBAL_SLOT_WIDE16, BENCH_SLOT}, STEP(OP_POP)}},
+    {"GET_GLOBAL_SLOT_WIDE24", 2, {{OP_GET_GLOBAL_SLOT_WIDE24, BENCH_SLOT}, STEP(OP_POP)}},
+    {"STORE_GLOBAL", 3, {CONST_STEP(kBenchName), CONST_STEP(kBenchInt), STEP(OP_STORE_GLOBAL)}},
+    {"ACCESS_GLOBAL", 3, {CONST_STEP(kBenchName), STEP(OP_ACCESS_GLOBAL), STEP(OP_POP)}},
+    {"ACCESS_GLOBAL_QUICK", 3, {CONST_STEP(kBenchName), STEP(OP_ACCESS_GLOBAL_QUICK), STEP(OP_POP)}},
+    {"SPAWN", 2, {{OP_SPAWN, kBenchTask}, STEP(OP_POP)}},
+    {"AWAIT", 3, {{OP_SPAWN, kBenchTask}, STEP(OP_AWAIT), STEP(OP_POP)}},
+    {"YIELD", 1, {STEP(OP_YIELD)}},
+};
+
+/**
+ * Fails for every opcode of the OPCODES table that no pattern runs,
+ * so a new opcode gets a benchmark and a jit check
+ */
+static void BenchOpcodeCoverage(BenchContext *context) {
+  for (int op = 0; op < OP_COUNT; op++) {
+    bool covered = op == OP_RET;
+
+    for (size_t i = 0; i < sizeof(opcode_benches) / sizeof(opcode_benches[0]) && !covered; i++) {
+      for (int step = 0; step < opcode_benches[i].count && !covered; step++) {
+        covered = opcode_benches[i].steps[step].op == (Opcode) op;
+      }
+    }
+
+    if (!covered) BenchFail(context, "opcode/%s: no benchmark runs it\n", OpcodeName((Opcode) op));
+  }
+}
+
+static bool BenchWriteConsts(Chunk *chunk) {
+  size_t count = sizeof(bench_strings) / sizeof(bench_strings[0]);
+
+  if (bench_pool_size == 0) {
+    bench_pool_size = (uint32_t) (count * sizeof(uint32_t));
+
+    for (size_t i = 0; i < count; i++) {
+      uint32_t length = (uint32_t) strlen(bench_strings[i]);
+
+      BenchWriteU32(bench_pool + i * sizeof(uint32_t), bench_pool_size);
+      BenchWriteU32(bench_pool + bench_pool_size, length);
+      memcpy(bench_pool + bench_pool_size + sizeof(uint32_t), bench_strings[i], length + 1);
+      bench_pool_size += sizeof(uint32_t) + length + 1;
+    }
+  }
+
+  chunk->strings = bench_pool;
+  chunk->strings_size = bench_pool_size;
+  chunk->string_count = (uint32_t) count;
+
+  Value consts[kBenchConstCount] = {
+      [kBenchName] = STRING_REF_VALUE(kBenchName),
+      [kBenchString] = STRING_REF_VALUE(kBenchString),
+      [kBenchOtherString] = STRING_REF_VALUE(kBenchOtherString),
+      [kBenchTask] = STRING_REF_VALUE(kBenchTask),
+      [kBenchInt] = INT_VALUE(7),
+      [kBenchOtherInt] = INT_VALUE(3),
+      [kBenchDouble] = NUM_VALUE(1.5),
+      [kBenchOtherDouble] = NUM_VALUE(0.5),
+  };
+
+  for (int i = 0; i < kBenchConstCount; i++) {
+    if (ChunkWriteConst(chunk, consts[i]) < 0) return false;
+  }
+
+  return ChunkWriteGlobal(chunk, STRING_REF_VALUE(kBenchName)) == BENCH_SLOT;
+}
+
+/**
+ * Builds a chunk that sets the global and then runs the pattern of
+ * @param bench BENCH_OPCODE_PATTERNS times. With @param keep, the
+ * result the pattern pops is written to the global instead, so the
+ * jit check compares it
+ */
+static Chunk *BenchOpcodeChunk(const OpcodeBench *bench, bool keep) {
+  Chunk *chunk = ChunkCreate(NULL, 0, 64);
+  if (chunk == NULL) return NULL;
+
+  bool written = BenchWriteConsts(chunk) &&
+      ChunkWriteIndexed(chunk, OP_CONST, kBenchInt, 1) &&
+      ChunkWriteIndexed(chunk, OP_SET_GLOBAL_SLOT, BENCH_SLOT, 1);
+
+  for (int pattern = 0; pattern < BENCH_OPCODE_PATTERNS && written; pattern++) {
+    for (int i = 0; i < bench->count && written; i++) {
+      instruction_t step = bench->steps[i];
+      if (keep && step.op == OP_POP) step = (instruction_t) {OP_SET_GLOBAL_SLOT, BENCH_SLOT};
+
+      // the operand bytes are little endian, like the _WIDE ones
+      written = ChunkWrite(chunk, step.op, 2);
+      for (int byte = 0; byte < OpcodeOperands(step.op) && written; byte++) {
+        written = ChunkWrite(chunk, (uint8_t) (step.operand >> (8 * byte)), 2);
+      }
+    }
+  }
+
+  if (!written || !ChunkWrite(chunk, OP_RET, 3)) {
+    ChunkDispose(chunk);
+    return NULL;
+  }
+
+  return chunk;
+}
+
+static bool BenchInFiber(const OpcodeBench *bench) {
+  for (int i = 0; i < bench->count; i++) {
+    Opcode op = bench->steps[i].op;
+    if (op == OP_SPAWN || op == OP_AWAIT || op == OP_YIELD) return true;
+  }
+
+  return false;
+}
+
+/**
+ * Runs the chunk of @param bench as a fiber of a scheduler with one
+ * worker, BENCH_FIBER_OPCODE_RUNS times: out of a fiber OP_SPAWN and
+ * OP_AWAIT fail and OP_YIELD does nothing. The jit has no templates
+ * for them, they only run in the interpreter
+ */
+static void BenchOpcodeFiber(BenchContext *context, const char *name, const OpcodeBench *bench) {
+  Chunk *chunk = BenchOpcodeChunk(bench, false);
+  Chunk *task = ChunkCreate(NULL, 0, 1);
+  Scheduler *scheduler = SchedulerCreate((Flags) {0}, 1);
+  int offset;
+
+  bool ok = chunk != NULL && task != NULL && scheduler != NULL && ChunkWrite(task, OP_RET, 1) &&
+      ChunkVerify(chunk, &offset) == kVerifyOK && ChunkVerify(task, &offset) == kVerifyOK &&
+      SchedulerRegister(scheduler, bench->name, chunk) && SchedulerRegister(scheduler, BENCH_TASK, task);
+
+  double elapsed = 0;
+  for (int run = 0; run < BENCH_FIBER_OPCODE_RUNS && ok; run++) {
+    int32_t id;
+    InterpretResult result;
+    ok = SchedulerSpawn(scheduler, bench->name, strlen(bench->name), &id) == kResultOK;
+
+    double start = BenchNow();
+    if (ok) SchedulerRun(scheduler);
+    elapsed += BenchNow() - start;
+
+    ok = ok && SchedulerResult(scheduler, id, &result) && result == kResultOK;
+  }
+
+  if (ok) {
+    BenchReport(context, name, (size_t) BENCH_OPCODE_PATTERNS * BENCH_FIBER_OPCODE_RUNS, elapsed, 0);
+  } else {
+    BenchFail(context, "%s: the fiber failed\n", name);
+  }
+
+  // the fibers run views of the chunks
+  if (scheduler != NULL) SchedulerDispose(scheduler);
+  if (chunk != NULL) ChunkDispose(chunk);
+  if (task != NULL) ChunkDispose(task);
+}
+
+static void BenchOpcode(BenchContext *context, const OpcodeBench *bench, bool jit) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s/%s", jit ? "opcode_jit" : "opcode", bench->name);
+  if (!BenchSelected(context, name)) return;
+
+  if (BenchInFiber(bench)) {
+    if (!jit) BenchOpcodeFiber(context, name, bench);
+    return;
+  }
+
+  Vm *vm = VmCreate((Flags) {.jit = jit, .jit_threshold = 1, .jit_check = jit && context->jit_check});
+  Chunk *chunk = BenchOpcodeChunk(bench, jit && context->jit_check);
+  if (chunk == NULL) {
+    BenchFail(context, "%s: out of memory\n", name);
+    VmDispose(vm);
+    return;
+  }
+
+  // the first run verifies, links and compiles the chunk
+  if (VmEval(vm, chunk) != kResultOK) {
+    BenchFail(context, "%s: the chunk failed\n", name);
+  } else {
+    size_t allocated = vm->heap->allocated_total;
+    double start = BenchNow();
+    for (int run = 0; run < BENCH_OPCODE_RUNS; run++) {
+      VmEval(vm, chunk);
+    }
+    double end = BenchNow();
+
+    BenchReport(context, name, (size_t) BENCH_OPCODE_PATTERNS * BENCH_OPCODE_RUNS, end - start,
+                vm->heap->allocated_total - allocated);
+  }
+
+  ChunkDispose(chunk);
+  VmDispose(vm);
+}
+
+/**
+ * Runs the ACCESS_GLOBAL pattern again and again in a profiled vm.
+ * The slots don't move between the runs of one chunk, so after the
+ * first run only the quickened instructions run, the inline caches
+ * must never miss
+ */
+static void BenchGlobalCache(BenchContext *context) {
+  const char *name = "global_cache/eval_again";
+  if (!BenchSelected(context, name)) return;
+
+  static const OpcodeBench access = {"ACCESS_GLOBAL", 3, {CONST_STEP(kBenchName), STEP(OP_ACCESS_GLOBAL), STEP(OP_POP)}};
+
+  Vm *vm = VmCreate((Flags) {.profile = true, .profile_hz = PROFILE_DEFAULT_HZ});
+  Chunk *chunk = BenchOpcodeChunk(&access, false);
+  if (chunk == NULL) {
+    BenchFail(context, "%s: out of memory\n", name);
+    VmDispose(vm);
+    return;
+  }
+
+  // the first run quickens every instruction
+  if (VmEval(vm, chunk) != kResultOK) {
+    BenchFail(context, "%s: the chunk failed\n", name);
+  } else {
+    uint64_t generic = vm->profiler->counts[OP_ACCESS_GLOBAL];
+    uint64_t quick = vm->profiler->counts[OP_ACCESS_GLOBAL_QUICK];
+
+    bool ok = true;
+    double start = BenchNow();
+    for (int run = 0; run < BENCH_OPCODE_RUNS && ok; run++) {
+      ok = VmEval(vm, chunk) == kResultOK;
+    }
+    double end = BenchNow();
+
+    if (!ok || vm->profiler->counts[OP_ACCESS_GLOBAL] != generic ||
+        vm->profiler->counts[OP_ACCESS_GLOBAL_QUICK] - quick != (uint64_t) BENCH_OPCODE_PATTERNS * BENCH_OPCODE_RUNS) {
+      BenchFail(context, "%s: the inline caches missed\n", name);
+    } else {
+      BenchReport(context, name, (size_t) BENCH_OPCODE_PATTERNS * BENCH_OPCODE_RUNS, end - start, 0);
+    }
+  }
+
+  ChunkDispose(chunk);
+  VmDispose(vm);
+}
+
+typedef struct {
+  KoflChunk *chunk;
+  KoflStatus status;
+} BenchIsolate;
+
+static void *BenchIsolateRun(void *argument) {
+  BenchIsolate *bench = argument;
+  KoflIsolate *isolate = KoflIsolateCreate(NULL);
+
+  bench->status = isolate == NULL ? kKoflOutOfMemory : kKoflOK;
+  for (int run = 0; run < BENCH_MACRO_RUNS && bench->status == kKoflOK; run++) {
+    bench->status = KoflIsolateEval(isolate, bench->chunk);
+  }
+
+  if (isolate != NULL) KoflIsolateDispose(isolate);
+
+  return NULL;
+}
+
+static void BenchIsolates(BenchContext *context, const char *path, const char *program, int threads) {
+  char name[256];
+  snprintf(name, sizeof(name), "isolates/%s_x%d", program, threads);
+  if (!BenchSelected(context, name)) return;
+
+  KoflChunk *chunk;
+  KoflStatus status = KoflChunkLoad(path, &chunk);
+  if (status != kKoflOK) {
+    BenchFail(context, "%s: can't load %s: %s\n", name, path, KoflStatusName(status));
+    return;
+  }
+
+  pthread_t ids[BENCH_ISOLATE_THREADS];
+  BenchIsolate benches[BENCH_ISOLATE_THREADS];
+  int started = 0;
+
+  double start = BenchNow();
+  for (; started < threads; started++) {
+    benches[started] = (BenchIsolate) {.chunk = chunk, .status = kKoflOK};
+    if (pthread_create(&ids[started], NULL, BenchIsolateRun, &benches[started]) != 0) break;
+  }
+
+  bool failed = started < threads;
+  for (int i = 0; i < started; i++) {
+    pthread_join(ids[i], NULL);
+    failed |= benches[i].status != kKoflOK;
+  }
+  double end = BenchNow();
+
+  if (failed) {
+    BenchFail(context, "%s: an isolate failed\n", name);
+  } else {
+    BenchReport(context, name, BENCH_MACRO_RUNS, end - start, 0);
+  }
+
+  KoflChunkRelease(chunk);
+}
+
+static void BenchFibers(BenchContext *context, const char *path, const char *program, int workers) {
+  char name[256];
+  snprintf(name, sizeof(name), "fibers/%s_w%d", program, workers);
+  if (!BenchSelected(context, name)) return;
+
+  KoflChunk *chunk;
+  KoflStatus status = KoflChunkLoad(path, &chunk);
+  if (status != kKoflOK) {
+    BenchFail(context, "%s: can't load %s: %s\n", name, path, KoflStatusName(status));
+    return;
+  }
+
+  KoflScheduler *scheduler = KoflSchedulerCreate(workers, NULL);
+  if (scheduler == NULL || KoflSchedulerRegister(scheduler, program, chunk) != kKoflOK) {
+    BenchFail(context, "%s: can't create the scheduler\n", name);
+    if (scheduler != NULL) KoflSchedulerDispose(scheduler);
+    KoflChunkRelease(chunk);
+    return;
+  }
+
+  bool failed = false;
+  int32_t fibers[BENCH_MACRO_RUNS];
+
+  double start = BenchNow();
+  for (int run = 0; run < BENCH_MACRO_RUNS && !failed; run++) {
+    failed = KoflSchedulerSpawn(scheduler, program, &fibers[run]) != kKoflOK;
+  }
+
+  KoflSchedulerRun(scheduler);
+  double end = BenchNow();
+
+  for (int run = 0; run < BENCH_MACRO_RUNS && !failed; run++) {
+    failed = KoflSchedulerFiberStatus(scheduler, fibers[run]) != kKoflOK;
+  }
+
+  if (failed) {
+    BenchFail(context, "%s: a fiber failed\n", name);
+  } else {
+    BenchReport(context, name, BENCH_MACRO_RUNS, end - start, 0);
+  }
+
+  KoflSchedulerDispose(scheduler);
+  KoflChunkRelease(chunk);
+}
+
+static void BenchCorpusProgram(BenchContext *context, const char *path, const char *program) {
+  char name[256];
+  snprintf(name, sizeof(name), "load/%s", program);
+
+  if (BenchSelected(context, name)) {
+    size_t count = 1000;
+    double start = BenchNow();
+    for (size_t i = 0; i < count; i++) {
+      Chunk *chunk;
+      if (BytecodeLoad(NULL, path, &chunk) != kBytecodeOK) {
+        BenchFail(context, "%s: can't load %s\n", name, path);
+        return;
+      }
+      ChunkDispose(chunk);
+    }
+    BenchReport(context, name, count, BenchNow() - start, 0);
+  }
+
+  for (int jit = 0; jit <= 1; jit++) {
+    snprintf(name, sizeof(name), "%s/%s", jit ? "macro_jit" : "macro", program);
+    if (!BenchSelected(context, name)) continue;
+
+    Vm *vm = VmCreate((Flags) {.jit = jit, .jit_threshold = 1, .jit_check = jit && context->jit_check});
+    Chunk *chunk;
+    if (BytecodeLoad(vm->heap, path, &chunk) != kBytecodeOK) {
+      BenchFail(context, "%s: can't load %s\n", name, path);
+      VmDispose(vm);
+      return;
+    }
+
+    if (VmEval(vm, chunk) != kResultOK) {
+      BenchFail(context, "%s: the program failed\n", name);
+    } else {
+      size_t allocated = vm->heap->allocated_total;
+      double start = BenchNow();
+      for (int run = 0; run < BENCH_MACRO_RUNS; run++) {
+        VmEval(vm, chunk);
+      }
+      double end = BenchNow();
+
+      BenchReport(context, name, BENCH_MACRO_RUNS, end - start, vm->heap->allocated_total - allocated);
+    }
+
+    ChunkDispose(chunk);
+    VmDispose(vm);
+  }
+
+  BenchIsolates(context, path, program, 1);
+  BenchIsolates(context, path, program, BENCH_ISOLATE_THREADS);
+  BenchFibers(context, path, program, 1);
+  BenchFibers(context, path, program, BENCH_ISOLATE_THREADS);
+}
+
+static int BenchCorpusFilter(const struct dirent *entry) {
+  size_t length = strlen(entry->d_name);
+
+  return length > 4 && strcmp(entry->d_name + length - 4, ".kbc") == 0;
+}
+
+static void BenchCorpus(BenchContext *context) {
+  struct dirent **entries;
+  int count = scandir(KOFLVM_BENCH_CORPUS, &entries, BenchCorpusFilter, alphasort);
+  if (count < 0) {
+    BenchFail(context, "can't open the corpus at %s\n", KOFLVM_BENCH_CORPUS);
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const char *file = entries[i]->d_name;
+    char path[1024];
+    char program[256];
+    snprintf(path, sizeof(path), "%s/%s", KOFLVM_BENCH_CORPUS, file);
+    snprintf(program, sizeof(program), "%.*s", (int) (strlen(file) - 4), file);
+
+    BenchCorpusProgram(context, path, program);
+    free(entries[i]);
+  }
+
+  free(entries);
+}
+
+static const char *fiber_program_tasks[] = {"leaf", "fail", "spawner", "ping", "pong"};
+
+typedef struct {
+  const char *name;
+  // spawned in order, so the first fibers get the ids 0, 1...
+  const char *spawned[2];
+  int spawned_count;
+  // the status of each fiber, by id
+  KoflStatus statuses[BENCH_FIBER_PROGRAM_FIBERS];
+  int fiber_count;
+} FiberProgramBench;
+
+static const FiberProgramBench fiber_program_benches[] = {
+    // the spawner, the 4 leaves it awaits, then the failed child
+    {"spawn_await", {"spawner"}, 1, {kKoflOK, kKoflOK, kKoflOK, kKoflOK, kKoflOK, kKoflError}, 6},
+    {"deadlock", {"ping", "pong"}, 2, {kKoflError, kKoflError}, 2},
+};
+
+// runs the bench in a fresh scheduler, false when a fiber ended with another status
+static bool BenchFiberProgramRun(BenchContext *context, const char *name, const FiberProgramBench *bench,
+                                 KoflChunk **chunks, int workers) {
+  KoflScheduler *scheduler = KoflSchedulerCreate(workers, NULL);
+  if (scheduler == NULL) {
+    BenchFail(context, "%s: can't create the scheduler\n", name);
+    return false;
+  }
+
+  bool failed = false;
+  for (int i = 0; i < (int) (sizeof(fiber_program_tasks) / sizeof(fiber_program_tasks[0])) && !failed; i++) {
+    failed = KoflSchedulerRegister(scheduler, fiber_program_tasks[i], chunks[i]) != kKoflOK;
+  }
+
+  for (int i = 0; i < bench->spawned_count && !failed; i++) {
+    int32_t id;
+    failed = KoflSchedulerSpawn(scheduler, bench->spawned[i], &id) != kKoflOK || id != i;
+  }
+
+  if (failed) {
+    BenchFail(context, "%s: can't spawn the fibers\n", name);
+    KoflSchedulerDispose(scheduler);
+    return false;
+  }
+
+  KoflSchedulerRun(scheduler);
+
+  for (int32_t id = 0; id < bench->fiber_count; id++) {
+    KoflStatus status = KoflSchedulerFiberStatus(scheduler, id);
+    if (status != bench->statuses[id]) {
+      BenchFail(context, "%s: fiber %d is %s, expected %s\n", name, id, KoflStatusName(status),
+                KoflStatusName(bench->statuses[id]));
+      failed = true;
+    }
+  }
+
+  KoflSchedulerDispose(scheduler);
+
+  return !failed;
+}
+
+static void BenchFiberPrograms(BenchContext *context) {
+  size_t count = sizeof(fiber_program_tasks) / sizeof(fiber_program_tasks[0]);
+  KoflChunk *chunks[sizeof(fiber_program_tasks) / sizeof(fiber_program_tasks[0])];
+  size_t loaded = 0;
+
+  for (; loaded < count; loaded++) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.kbc", KOFLVM_BENCH_FIBERS, fiber_program_tasks[loaded]);
+
+    KoflStatus status = KoflChunkLoad(path, &chunks[loaded]);
+    if (status != kKoflOK) {
+      BenchFail(context, "fibers: can't load %s: %s\n", path, KoflStatusName(status));
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(fiber_program_benches) / sizeof(fiber_program_benches[0]) && loaded == count; i++) {
+    const FiberProgramBench *bench = &fiber_program_benches[i];
+
+    for (int workers = 1; workers <= BENCH_ISOLATE_THREADS; workers *= BENCH_ISOLATE_THREADS) {
+      char name[256];
+      snprintf(name, sizeof(name), "fibers/%s_w%d", bench->name, workers);
+      if (!BenchSelected(context, name)) continue;
+
+      bool ok = true;
+      double start = BenchNow();
+      for (int run = 0; run < BENCH_FIBER_PROGRAM_RUNS && ok; run++) {
+        ok = BenchFiberProgramRun(context, name, bench, chunks, workers);
+      }
+      double end = BenchNow();
+
+      if (ok) BenchReport(context, name, BENCH_FIBER_PROGRAM_RUNS, end - start, 0);
+    }
+  }
+
+  for (size_t i = 0; i < loaded; i++) {
+    KoflChunkRelease(chunks[i]);
+  }
+}
+
+int main(int argc, char **argv) {
+  bool jit_check = argc > 1 && strcmp(argv[1], "--jit-check") == 0;
+  int filter = jit_check ? 2 : 1;
+
+  BenchContext context = {
+      .filter = argc > filter ? argv[filter] : NULL,
+      .count = 0,
+      .jit_check = jit_check,
+      .failures = 0,
+  };
+
+  printf("{\n  \"benchmarks\": [");
+
+  BenchStack(&context);
+  BenchTable(&context);
+  BenchValue(&context);
+  BenchConcat(&context, 16);
+  BenchConcat(&context, 256);
+  BenchConcat(&context, 4096);
+  BenchEvalOtherChunk(&context);
+
+  BenchOpcodeCoverage(&context);
+  for (size_t i = 0; i < sizeof(opcode_benches) / sizeof(opcode_benches[0]); i++) {
+    BenchOpcode(&context, &opcode_benches[i], false);
+    BenchOpcode(&context, &opcode_benches[i], true);
+  }
+
+  BenchGlobalCache(&context);
+  BenchCorpus(&context);
+  BenchFiberPrograms(&context);
+
+  printf("\n  ]\n}\n");
+
+  return context.failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "utils.h"
+#include "legacy_table.h"
+
+/**
+ * Will refill the table when its gets 75% full
+ *
+ * Its 75% 'cause the table never gets full, so
+ * can never collide on every element
+ */
+#define LEGACY_TABLE_MAX_LOAD 0.75
+
+LegacyTable *legacy_table_create(size_t capacity) {
+    LegacyTable *table = malloc(sizeof(LegacyTable));
+
+    table->capacity = capacity;
+    table->count = 0;
+    table->nodes = ALLOCATE(legacy_table_node_t, capacity);
+
+    for (int i = 0; i < capacity; i++) {
+        table->nodes[i].key = NULL;
+        table->nodes[i].value = NIL_VALUE;
+    }
+
+    return table;
+}
+
+/**
+ * Implementation details:
+ *   - Its returns the node when the found value
+ *   has NULL key or is @var key, keys are interned
+ *   so they are compared by pointer, and the probe
+ *   starts at the hash cached on the string
+
+ *   - If the found value kas a different key
+ *   than @var key then this will start probing
+ *   the next element on the @var nodes
+ *   array, if not found, then will search the
+ *   next
+ *
+ * @param nodes the target node array
+ * @param capacity the capacity of nodes
+ * @param key the string key
+ * @return the table node
+ */
+legacy_table_node_t *legacy_table_find_entry(legacy_table_node_t *nodes, size_t capacity, string_t *key) {
+    uint32_t index = key->hash % capacity;
+    legacy_table_node_t *tombstone = NULL;
+
+    while (true) {
+        legacy_table_node_t *node = &nodes[index];
+
+        // return the tombstone if has one,
+        // to reduce wasting space in the array
+        // on table set
+        if (node->key == NULL) {
+            if (IS_NIL(node->value)) {
+                return tombstone != NULL ? tombstone : node;
+            } else {
+                if (tombstone == NULL) {
+                    tombstone = node;
+                }
+            }
+        } else if (node->key == key) {
+            return node;
+        }
+
+        index = (index + 1) % capacity;
+    }
+}
+
+void legacy_table_adjust(LegacyTable *table, size_t capacity) {
+    legacy_table_node_t *nodes = ALLOCATE(legacy_table_node_t, capacity);
+
+    for (int i = 0; i < capacity; i++) {
+        nodes[i].key = NULL;
+        nodes[i].value = NIL_VALUE;
+    }
+
+    // to mitigate collisions, this re build the node array
+    table->count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        legacy_table_node_t *node = &table->nodes[i];
+        if (node->key == NULL) continue;
+
+        legacy_table_node_t *dest = legacy_table_find_entry(nodes, capacity, node->key);
+
+        dest->key = node->key;
+        dest->value = node->value;
+
+        table->count++;
+    }
+
+    free(table->nodes);
+    table->nodes = nodes;
+    table->capacity = capacity;
+}
+
+/**
+ * @param table the target table
+ * @param key the string key
+ * @param value where the found value is written
+ * @return if the key was found
+ */
+bool legacy_table_get(LegacyTable *table, string_t *key, Value *value) {
+    if (table->count == 0) return false;
+
+    legacy_table_node_t *node = legacy_table_find_entry(table->nodes, table->capacity, key);
+    if (node->key == NULL) return false;
+
+    *value = node->value;
+
+    return true;
+}
+
+/**
+ * @param table the target table
+ * @param key the string key
+ * @return if the operation was successful
+ */
+bool legacy_table_remove(LegacyTable *table, string_t *key) {
+    if (table->count == 0) return false;
+
+    legacy_table_node_t *node = legacy_table_find_entry(table->nodes, table->capacity, key);
+    if (node->key == NULL) return false;
+
+    node->key = NULL;
+    node->value = TRUE_VALUE;
+
+    return true;
+}
+
+/**
+ * @param table the target table
+ * @param key the string key
+ * @param length the string key length
+ * @param value the value
+ * @return if the node is new
+ */
+bool legacy_table_set(LegacyTable *table, string_t* key, Value value) {
+    if (table->count + 1 > (table->capacity + 1) * LEGACY_TABLE_MAX_LOAD) { // NOLINT(cppcoreguidelines-narrowing-conversions)
+        legacy_table_adjust(table, GROW_CAPACITY(table->capacity));
+    }
+
+    legacy_table_node_t *node = legacy_table_find_entry(table->nodes, table->capacity, key);
+
+    bool is_new = node->key == NULL;
+    if (is_new && IS_NIL(node->value)) {
+        table->count++;
+    }
+
+    node->key = key;
+    node->value = value;
+
+    return is_new;
+}
+
+/**
+ * Looks up a key by its contents instead of its identity,
+ * it's what the string interning uses to find the canonical
+ * string before one exists for the given characters
+ *
+ * @param table the target table
+ * @param values the characters of the string
+ * @param length the length of values
+ * @param hash the hash of values
+ * @return the interned key or NULL
+ */
+string_t *legacy_table_find_string(LegacyTable *table, const char *values, size_t length, uint32_t hash) {
+    if (table->count == 0) return NULL;
+
+    uint32_t index = hash % table->capacity;
+
+    while (true) {
+        legacy_table_node_t *node = &table->nodes[index];
+
+        if (node->key == NULL) {
+            // stops on empty nodes, but not on tombstones
+            if (IS_NIL(node->value)) return NULL;
+        } else if (node->key->hash == hash &&
+            node->key->length == length &&
+            memcmp(node->key->values, values, length) == 0) {
+            return node->key;
+        }
+
+        index = (index + 1) % table->capacity;
+    }
+}
+
+void legacy_table_dispose(LegacyTable *table) {
+    free(table->nodes);
+    free(table);
+}
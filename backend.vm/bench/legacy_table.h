@@ -0,0 +1,39 @@
+#ifndef RUNTIME_BENCH_LEGACY_TABLE_H
+#define RUNTIME_BENCH_LEGACY_TABLE_H
+
+/**
+ * The linear probed table that table.c used to be, only
+ * kept so table_bench can compare the two implementations
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "value.h"
+
+typedef struct legacy_table_node {
+    string_t *key;
+    Value value;
+} legacy_table_node_t;
+
+typedef struct legacy_table {
+    int count;
+    size_t capacity;
+    legacy_table_node_t *nodes;
+} LegacyTable;
+
+LegacyTable *legacy_table_create(size_t capacity);
+
+bool legacy_table_set(LegacyTable *table, string_t *key, Value value);
+
+bool legacy_table_remove(LegacyTable *table, string_t *key);
+
+bool legacy_table_get(LegacyTable *table, string_t *key, Value *value);
+
+string_t *legacy_table_find_string(LegacyTable *table, const char *values, size_t length, uint32_t hash);
+
+void legacy_table_dispose(LegacyTable* table);
+
+#endif //RUNTIME_BENCH_LEGACY_TABLE_H
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "table.h"
+#include "legacy_table.h"
+
+/**
+ * Compares the group probed table of table.c against the linear
+ * probed one it replaced (kept in legacy_table.c), both with
+ * interned string keys like the globals and strings tables
+ */
+
+#define BENCH_SIZES_COUNT 4
+
+typedef struct {
+  double insert;
+  double insert_max;
+  double hit;
+  double miss;
+  double remove;
+} BenchResult;
+
+static double BenchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static string_t **BenchKeys(const char *prefix, size_t count) {
+  string_t **keys = malloc(count * sizeof(string_t *));
+
+  for (size_t i = 0; i < count; i++) {
+    char *values = malloc(32);
+    int length = snprintf(values, 32, "%s_%zu", prefix, i);
+
+    keys[i] = StringCreate(NULL, values, length, StringHash(values, length));
+  }
+
+  return keys;
+}
+
+static void BenchKeysDispose(string_t **keys, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    free(keys[i]->values);
+    free(keys[i]);
+  }
+
+  free(keys);
+}
+
+static BenchResult BenchSwiss(string_t **keys, string_t **misses, size_t count, bool incremental) {
+  BenchResult result = {0};
+  Table *table = table_create(0);
+  table_set_incremental(table, incremental);
+
+  double start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    table_set(table, OBJ_VALUE(keys[i]), INT_VALUE(i));
+  }
+  result.insert = (BenchNow() - start) / (double) count;
+
+  Value value;
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    table_get(table, OBJ_VALUE(keys[i]), &value);
+  }
+  result.hit = (BenchNow() - start) / (double) count;
+
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    table_get(table, OBJ_VALUE(misses[i]), &value);
+  }
+  result.miss = (BenchNow() - start) / (double) count;
+
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    table_remove(table, OBJ_VALUE(keys[i]));
+  }
+  result.remove = (BenchNow() - start) / (double) count;
+
+  table_dispose(table);
+
+  // the worst insert is measured apart, timing every
+  // operation would dominate the averages above
+  table = table_create(0);
+  table_set_incremental(table, incremental);
+  for (size_t i = 0; i < count; i++) {
+    double op_start = BenchNow();
+    table_set(table, OBJ_VALUE(keys[i]), INT_VALUE(i));
+    double op_time = BenchNow() - op_start;
+
+    if (op_time > result.insert_max) result.insert_max = op_time;
+  }
+  table_dispose(table);
+
+  return result;
+}
+
+static BenchResult BenchLegacy(string_t **keys, string_t **misses, size_t count) {
+  BenchResult result = {0};
+  LegacyTable *table = legacy_table_create(10);
+
+  double start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    legacy_table_set(table, keys[i], INT_VALUE(i));
+  }
+  result.insert = (BenchNow() - start) / (double) count;
+
+  Value value;
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    legacy_table_get(table, keys[i], &value);
+  }
+  result.hit = (BenchNow() - start) / (double) count;
+
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    legacy_table_get(table, misses[i], &value);
+  }
+  result.miss = (BenchNow() - start) / (double) count;
+
+  start = BenchNow();
+  for (size_t i = 0; i < count; i++) {
+    legacy_table_remove(table, keys[i]);
+  }
+  result.remove = (BenchNow() - start) / (double) count;
+
+  legacy_table_dispose(table);
+
+  // the worst insert is measured apart, timing every
+  // operation would dominate the averages above
+  table = legacy_table_create(10);
+  for (size_t i = 0; i < count; i++) {
+    double op_start = BenchNow();
+    legacy_table_set(table, keys[i], INT_VALUE(i));
+    double op_time = BenchNow() - op_start;
+
+    if (op_time > result.insert_max) result.insert_max = op_time;
+  }
+  legacy_table_dispose(table);
+
+  return result;
+}
+
+static void BenchPrint(const char *name, size_t count, BenchResult result) {
+  printf("%-12s %9zu %10.1f %14.1f %8.1f %8.1f %9.1f\n",
+         name, count, result.insert, result.insert_max, result.hit, result.miss, result.remove);
+}
+
+int main() {
+  size_t sizes[BENCH_SIZES_COUNT] = {16, 1024, 65536, 1 << 20};
+
+  printf("%-12s %9s %10s %14s %8s %8s %9s\n",
+         "table", "keys", "insert", "insert (max)", "hit", "miss", "remove");
+
+  for (int i = 0; i < BENCH_SIZES_COUNT; i++) {
+    size_t count = sizes[i];
+    string_t **keys = BenchKeys("key", count);
+    string_t **misses = BenchKeys("miss", count);
+
+    BenchPrint("swiss", count, BenchSwiss(keys, misses, count, false));
+    BenchPrint("swiss (inc)", count, BenchSwiss(keys, misses, count, true));
+    BenchPrint("legacy", count, BenchLegacy(keys, misses, count));
+
+    BenchKeysDispose(keys, count);
+    BenchKeysDispose(misses, count);
+  }
+
+  printf("\nall times in ns/op\n");
+
+  return EXIT_SUCCESS;
+}
@@ -1,33 +1,254 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "bytecode.h"
 
-Value *ParseValue(const char *bytes, int i) {
-  return NUM_VALUE(10);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BYTECODE_BIG_ENDIAN
+#endif
+
+_Static_assert(sizeof(line_run_t) == 8, "lines are mapped as i32 pairs");
+_Static_assert(sizeof(Value) == 8, "consts are mapped as u64");
+
+typedef struct {
+  uint32_t count;
+  uint32_t offset;
+  uint32_t size;
+} bytecode_section_t;
+
+static inline uint32_t BytecodeReadU32(const uint8_t *bytes) {
+  return (uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+#ifdef BYTECODE_BIG_ENDIAN
+/**
+ * Big endian hosts swap the sections in place, the mapping is
+ * private so the file itself is untouched
+ */
+static void BytecodeSwap32(uint32_t *values, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    values[i] = __builtin_bswap32(values[i]);
+  }
 }
 
-Chunk *ParseChunk(const char *bytes) {
-  char chunk_count = bytes[2];
-  char chunk_capacity = bytes[3];
-  char lines_size = bytes[4];
-  char consts_size = bytes[5];
-  Chunk *chunk = ChunkCreate(chunk_count, chunk_capacity);
+static void BytecodeSwap64(uint64_t *values, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    values[i] = __builtin_bswap64(values[i]);
+  }
+}
+#endif
+
+/**
+ * Checks the header and the section table of @param bytes, every
+ * section must be inside the file, aligned and sized for its count
+ */
+static BytecodeStatus BytecodeReadSections(const uint8_t *bytes, size_t size, bytecode_section_t *sections) {
+  static const uint32_t entry_sizes[kSectionCount] = {
+      [kSectionCode] = sizeof(uint8_t),
+      [kSectionLines] = sizeof(line_run_t),
+      [kSectionConsts] = sizeof(Value),
+      [kSectionGlobals] = sizeof(Value),
+      [kSectionStrings] = sizeof(uint32_t),
+  };
+
+  if (size < BYTECODE_HEADER_SIZE || memcmp(bytes, BYTECODE_MAGIC, 4) != 0) return kBytecodeBadMagic;
+  if (BytecodeReadU32(bytes + 4) != BYTECODE_VERSION) return kBytecodeBadVersion;
+  // unlike the sections, a flag changes how the code is read
+  if ((BytecodeReadU32(bytes + 12) & ~BYTECODE_FLAGS) != 0) return kBytecodeBadVersion;
+
+  uint32_t section_count = BytecodeReadU32(bytes + 8);
+  if ((size - BYTECODE_HEADER_SIZE) / BYTECODE_SECTION_SIZE < section_count) return kBytecodeCorrupt;
+
+  bool found[kSectionCount] = {false};
 
-  int code_offset = 8 + chunk_count + 1;
+  for (uint32_t i = 0; i < section_count; i++) {
+    const uint8_t *entry = bytes + BYTECODE_HEADER_SIZE + i * BYTECODE_SECTION_SIZE;
+    uint32_t kind = BytecodeReadU32(entry);
 
-  unsigned int code[chunk_capacity];
-  int lines[lines_size];
-  Value *consts[consts_size];
+    // unknown sections are skipped, newer minor changes can add them
+    if (kind == 0 || kind >= kSectionCount) continue;
+    if (found[kind]) return kBytecodeCorrupt;
 
-  for (int i = 8; i < code_offset - 1; ++i) {
-    code[i] = bytes[i];
+    bytecode_section_t section = {
+        .count = BytecodeReadU32(entry + 4),
+        .offset = BytecodeReadU32(entry + 8),
+        .size = BytecodeReadU32(entry + 12),
+    };
+
+    if (section.offset % BYTECODE_ALIGNMENT != 0) return kBytecodeCorrupt;
+    if ((uint64_t) section.offset + section.size > size) return kBytecodeCorrupt;
+    if ((uint64_t) section.count * entry_sizes[kind] > section.size) return kBytecodeCorrupt;
+
+    // only the string pool has data after its entries
+    if (kind != kSectionStrings && section.count * entry_sizes[kind] != section.size) return kBytecodeCorrupt;
+
+    found[kind] = true;
+    sections[kind] = section;
   }
 
-  for (int i = code_offset; i < code_offset + lines_size - 1; ++i) {
-    lines[i] = bytes[i];
+  for (int kind = kSectionCode; kind < kSectionCount; kind++) {
+    if (!found[kind]) return kBytecodeCorrupt;
+  }
+
+  if (sections[kSectionCode].count > INT32_MAX || sections[kSectionLines].count > INT32_MAX) return kBytecodeCorrupt;
+  if (sections[kSectionConsts].count > INT32_MAX || sections[kSectionGlobals].count > INT32_MAX) return kBytecodeCorrupt;
+
+  return kBytecodeOK;
+}
+
+static ValueArray *BytecodeValueArray(Heap *heap, uint8_t *bytes, bytecode_section_t section) {
+  ValueArray *array = HEAP_ALLOCATE(heap, ValueArray, 1);
+  if (array == NULL) return NULL;
+
+  array->heap = heap;
+  array->count = (int) section.count;
+  array->capacity = (int) section.count;
+  array->values = (Value *) (bytes + section.offset);
+
+  return array;
+}
+
+// bytecode functions>
+/**
+ * Maps the file at @param path and points a chunk at its sections,
+ * nothing is copied or decoded, only the constants are scanned for
+ * values a file can't hold, so loading doesn't depend on the size of
+ * the code. The strings are only read when the vm first uses them.
+ *
+ * @param heap where the chunk is allocated
+ * @param chunk receives the chunk, that must be released with ChunkDispose
+ */
+BytecodeStatus BytecodeLoad(Heap *heap, const char *path, Chunk **chunk) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return kBytecodeIOError;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return kBytecodeIOError;
   }
 
-  for (int i = code_offset + lines_size; i < code_offset + lines_size + consts_size - 1; ++i) {
-    consts[i] = ParseValue(bytes, i);
+  if (st.st_size < BYTECODE_HEADER_SIZE) {
+    close(fd);
+    return kBytecodeBadMagic;
   }
 
-  return chunk;
+  size_t size = (size_t) st.st_size;
+
+  // private and writable: the vm resolves the string references
+  // in place, and the pages it doesn't touch stay shared
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED) return kBytecodeIOError;
+
+  uint8_t *bytes = mapping;
+  bytecode_section_t sections[kSectionCount];
+
+  BytecodeStatus status = BytecodeReadSections(bytes, size, sections);
+  if (status != kBytecodeOK) {
+    munmap(mapping, size);
+    return status;
+  }
+
+  Chunk *result = HEAP_ALLOCATE(heap, Chunk, 1);
+  ValueArray *consts = BytecodeValueArray(heap, bytes, sections[kSectionConsts]);
+  ValueArray *globals = BytecodeValueArray(heap, bytes, sections[kSectionGlobals]);
+
+  if (result == NULL || consts == NULL || globals == NULL) {
+    HeapFree(heap, result, sizeof(Chunk));
+    HeapFree(heap, consts, sizeof(ValueArray));
+    HeapFree(heap, globals, sizeof(ValueArray));
+    munmap(mapping, size);
+    return kBytecodeOutOfMemory;
+  }
+
+#ifdef BYTECODE_BIG_ENDIAN
+  BytecodeSwap32((uint32_t *) (bytes + sections[kSectionLines].offset), sections[kSectionLines].count * 2);
+  BytecodeSwap64((uint64_t *) consts->values, sections[kSectionConsts].count);
+  BytecodeSwap64((uint64_t *) globals->values, sections[kSectionGlobals].count);
+#endif
+
+  // a file can't carry object pointers, and the globals are names
+  bool valid = true;
+  for (int i = 0; i < consts->count; i++) valid &= !IS_OBJ(consts->values[i]);
+  for (int i = 0; i < globals->count; i++) valid &= IS_STRING_REF(globals->values[i]);
+
+  // the lines are binary searched, so the runs must be sorted
+  line_run_t *lines = (line_run_t *) (bytes + sections[kSectionLines].offset);
+  for (uint32_t i = 1; i < sections[kSectionLines].count; i++) valid &= lines[i - 1].offset < lines[i].offset;
+
+  if (!valid) {
+    HeapFree(heap, result, sizeof(Chunk));
+    HeapFree(heap, consts, sizeof(ValueArray));
+    HeapFree(heap, globals, sizeof(ValueArray));
+    munmap(mapping, size);
+    return kBytecodeCorrupt;
+  }
+
+  result->heap = heap;
+  result->verified = false;
+  result->max_stack = 0;
+  result->registers = (BytecodeReadU32(bytes + 12) & BYTECODE_FLAG_REGISTERS) != 0;
+  result->global_cache = NULL;
+  result->hotness = 0;
+  result->jit = NULL;
+  result->origin = NULL;
+  result->vm = NULL;
+  result->count = (int) sections[kSectionCode].count;
+  result->capacity = result->count;
+  result->code = bytes + sections[kSectionCode].offset;
+  result->lines = lines;
+  result->line_count = (int) sections[kSectionLines].count;
+  result->line_capacity = result->line_count;
+  result->consts = consts;
+  result->globals = globals;
+  result->mapping = mapping;
+  result->mapping_size = size;
+  result->strings = bytes + sections[kSectionStrings].offset;
+  result->strings_size = sections[kSectionStrings].size;
+  result->string_count = sections[kSectionStrings].count;
+
+  *chunk = result;
+
+  return kBytecodeOK;
+}
+
+/**
+ * Finds the string @param index of the pool of @param chunk, the
+ * pool is checked here instead of at load time
+ *
+ * @param values receives the characters, they are '\0' terminated
+ * @param length receives the length of values
+ * @return false when the index or the entry are out of the pool
+ */
+bool BytecodeString(Chunk *chunk, uint32_t index, const char **values, uint32_t *length) {
+  if (index >= chunk->string_count) return false;
+
+  uint32_t offset = BytecodeReadU32(chunk->strings + index * sizeof(uint32_t));
+  if ((uint64_t) offset + sizeof(uint32_t) > chunk->strings_size) return false;
+
+  uint32_t size = BytecodeReadU32(chunk->strings + offset);
+  uint64_t end = (uint64_t) offset + sizeof(uint32_t) + size;
+  if (end >= chunk->strings_size || chunk->strings[end] != '\0') return false;
+
+  *values = (const char *) chunk->strings + offset + sizeof(uint32_t);
+  *length = size;
+
+  return true;
+}
+
+const char *BytecodeStatusName(BytecodeStatus status) {
+  switch (status) {
+    case kBytecodeOK: return "ok";
+    case kBytecodeIOError: return "could not read the file";
+    case kBytecodeBadMagic: return "not a kofl bytecode file";
+    case kBytecodeBadVersion: return "unsupported bytecode version";
+    case kBytecodeCorrupt: return "corrupt bytecode file";
+    case kBytecodeOutOfMemory: return "out of memory";
+    default: return "unknown error";
+  }
 }
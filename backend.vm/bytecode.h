@@ -1,8 +1,66 @@
 #ifndef RUNTIME_BYTECODE_H
 #define RUNTIME_BYTECODE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "chunk.h"
+#include "heap.h"
+
+/**
+ * Compiled files start with a header and a table of sections, every
+ * field is little endian and every section starts at a multiple of
+ * BYTECODE_ALIGNMENT, so the code, lines, constants and global names
+ * are used in place from the mapping of the file:
+ *
+ *   header   "kofl", u32 version, u32 section count, u32 flags
+ *   sections u32 kind, u32 count, u32 offset, u32 size, each
+ *
+ *   code     the opcode and operand bytes
+ *   lines    i32 offset and i32 line per run of code from
+ *            the same line, sorted by offset
+ *   consts   u64 per constant, a vm value where strings are
+ *            STRING_REF_VALUE(index in the string pool)
+ *   globals  u64 per global slot, the STRING_REF_VALUE of its name
+ *   strings  u32 offset per string, from the start of the section,
+ *            to a u32 length, the characters and a '\0'
+ *
+ * With BYTECODE_FLAG_REGISTERS the code is in the register
+ * instruction set of regvm.h, files with unknown flags are rejected
+ */
+#define BYTECODE_MAGIC "kofl"
+#define BYTECODE_VERSION 4
+#define BYTECODE_ALIGNMENT 8
+
+#define BYTECODE_FLAG_REGISTERS 0x1
+#define BYTECODE_FLAGS BYTECODE_FLAG_REGISTERS
+
+#define BYTECODE_HEADER_SIZE 16
+#define BYTECODE_SECTION_SIZE 16
+
+typedef enum {
+  kSectionCode = 1,
+  kSectionLines,
+  kSectionConsts,
+  kSectionGlobals,
+  kSectionStrings,
+  kSectionCount
+} BytecodeSection;
+
+typedef enum {
+  kBytecodeOK,
+  kBytecodeIOError,
+  kBytecodeBadMagic,
+  kBytecodeBadVersion,
+  kBytecodeCorrupt,
+  kBytecodeOutOfMemory
+} BytecodeStatus;
+
+// bytecode functions>
+BytecodeStatus BytecodeLoad(Heap *heap, const char *path, Chunk **chunk);
+
+bool BytecodeString(Chunk *chunk, uint32_t index, const char **values, uint32_t *length);
 
-Chunk *ParseChunk(const char *bytes);
+const char *BytecodeStatusName(BytecodeStatus status);
 
 #endif //RUNTIME_BYTECODE_H
@@ -1,55 +1,317 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "chunk.h"
+#include "jit.h"
 #include "utils.h"
+#include "vm.h"
 
 // opcode functions>
 Opcode UintToOpcode(unsigned int raw) {
     return (Opcode) raw;
 }
 
+int OpcodeOperands(Opcode op) {
+  switch (op) {
+#define OPCODE_OPERANDS(name, operands, pops, pushes) case name: return operands;
+    OPCODES(OPCODE_OPERANDS)
+#undef OPCODE_OPERANDS
+    default:return -1;
+  }
+}
+
+int OpcodePops(Opcode op) {
+  switch (op) {
+#define OPCODE_POPS(name, operands, pops, pushes) case name: return pops;
+    OPCODES(OPCODE_POPS)
+#undef OPCODE_POPS
+    default:return -1;
+  }
+}
+
+int OpcodePushes(Opcode op) {
+  switch (op) {
+#define OPCODE_PUSHES(name, operands, pops, pushes) case name: return pushes;
+    OPCODES(OPCODE_PUSHES)
+#undef OPCODE_PUSHES
+    default:return -1;
+  }
+}
+
+const char *OpcodeName(Opcode op) {
+  switch (op) {
+    // skips the OP_ prefix
+#define OPCODE_NAME(name, operands, pops, pushes) case name: return #name + 3;
+    OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+    default:return "UNKNOWN";
+  }
+}
+
+/**
+ * @return the opcode the compiler wrote for @param op: the narrow
+ * variant of a _WIDE one and the generic variant of a _QUICK one,
+ * that the vm rewrote it to
+ */
+Opcode OpcodeBase(Opcode op) {
+  switch (op) {
+    case OP_CONST_WIDE16:
+    case OP_CONST_WIDE24: return OP_CONST;
+    case OP_GET_GLOBAL_SLOT_WIDE16:
+    case OP_GET_GLOBAL_SLOT_WIDE24: return OP_GET_GLOBAL_SLOT;
+    case OP_SET_GLOBAL_SLOT_WIDE16:
+    case OP_SET_GLOBAL_SLOT_WIDE24: return OP_SET_GLOBAL_SLOT;
+    case OP_SUM_QUICK_I32:
+    case OP_SUM_QUICK_F64: return OP_SUM;
+    case OP_SUB_QUICK_I32:
+    case OP_SUB_QUICK_F64: return OP_SUB;
+    case OP_MULT_QUICK_I32:
+    case OP_MULT_QUICK_F64: return OP_MULT;
+    case OP_DIV_QUICK_I32:
+    case OP_DIV_QUICK_F64: return OP_DIV;
+    case OP_NEGATE_QUICK_I32:
+    case OP_NEGATE_QUICK_F64: return OP_NEGATE;
+    case OP_ACCESS_GLOBAL_QUICK: return OP_ACCESS_GLOBAL;
+    default: return op;
+  }
+}
+
+/**
+ * Decodes the instruction at @param code, that must be a known
+ * opcode followed by all of its operand bytes
+ *
+ * @param steps receives the opcodes the instruction stands for with
+ * their operands, up to INSTRUCTION_MAX_STEPS
+ * @return the count of steps, 1 unless it's a superinstruction
+ */
+int InstructionExpand(const uint8_t *code, instruction_t *steps) {
+  Opcode op = (Opcode) code[0];
+
+  switch (op) {
+#define SUPERINSTRUCTION_EXPAND(name, first, second) \
+    case name: \
+      steps[0] = (instruction_t) {first, OpcodeOperands(first) > 0 ? code[1] : 0}; \
+      steps[1] = (instruction_t) {second, OpcodeOperands(second) > 0 ? code[1 + OpcodeOperands(first)] : 0}; \
+      return 2;
+    SUPERINSTRUCTIONS(SUPERINSTRUCTION_EXPAND)
+#undef SUPERINSTRUCTION_EXPAND
+    default: {
+      int operands = OpcodeOperands(op);
+
+      steps[0] = (instruction_t) {op, operands > 0 ? OperandRead(code + 1, operands) : 0};
+      return 1;
+    }
+  }
+}
+
 // chunk functions>
-Chunk *ChunkCreate(int count, int capacity) {
-  Chunk *chunk = malloc(sizeof(Chunk));
+/**
+ * @param heap where the chunk and its arrays are allocated
+ * @return the chunk or NULL when @param heap is out of memory
+ */
+Chunk *ChunkCreate(Heap *heap, int count, int capacity) {
+  Chunk *chunk = HEAP_ALLOCATE(heap, Chunk, 1);
+  if (chunk == NULL) return NULL;
 
+  chunk->heap = heap;
+  chunk->verified = false;
+  chunk->max_stack = 0;
+  chunk->registers = false;
+  chunk->global_cache = NULL;
+  chunk->hotness = 0;
+  chunk->jit = NULL;
+  chunk->origin = NULL;
+  chunk->vm = NULL;
+  chunk->mapping = NULL;
+  chunk->mapping_size = 0;
+  chunk->strings = NULL;
+  chunk->strings_size = 0;
+  chunk->string_count = 0;
   chunk->count = count;
   chunk->capacity = capacity;
-  chunk->consts = ValueArrayCreate(0, 0);
-  chunk->code = malloc(capacity * sizeof(Opcode));
-  chunk->lines = malloc(capacity * sizeof(int));
+  chunk->consts = ValueArrayCreate(heap, 0, 0);
+  chunk->globals = ValueArrayCreate(heap, 0, 0);
+  chunk->code = HEAP_ALLOCATE(heap, uint8_t, capacity);
+  chunk->lines = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
+
+  if (chunk->consts == NULL || chunk->globals == NULL || (capacity != 0 && chunk->code == NULL)) {
+    ChunkDispose(chunk);
+    return NULL;
+  }
 
   return chunk;
 }
 
-void ChunkWrite(Chunk *chunk, unsigned int op, int line) {
+static ValueArray *ChunkCopyValues(Heap *heap, ValueArray *values) {
+  ValueArray *copy = ValueArrayCreate(heap, values->count, values->count);
+  if (copy == NULL) return NULL;
+
+  for (int i = 0; i < values->count; i++) {
+    copy->values[i] = values->values[i];
+  }
+
+  return copy;
+}
+
+/**
+ * Creates a view of the verified chunk @param origin, for a vm that
+ * shares it with other vms: the view has its own copy of the code,
+ * that the vm quickens, and of the constants and globals, that the vm
+ * loads its strings into, and reads the lines and the string pool of
+ * @param origin in place. Nothing writes to @param origin, that must
+ * outlive the view
+ *
+ * @param heap where the view and its arrays are allocated
+ * @return the view or NULL when @param heap is out of memory
+ */
+Chunk *ChunkCreateView(Heap *heap, Chunk *origin) {
+  Chunk *view = HEAP_ALLOCATE(heap, Chunk, 1);
+  if (view == NULL) return NULL;
+
+  *view = *origin;
+  view->heap = heap;
+  view->global_cache = NULL;
+  view->hotness = 0;
+  view->jit = NULL;
+  view->origin = origin;
+  view->vm = NULL;
+  view->mapping = NULL;
+  view->mapping_size = 0;
+  view->capacity = origin->count;
+  view->code = HEAP_ALLOCATE(heap, uint8_t, origin->count);
+  view->consts = ChunkCopyValues(heap, origin->consts);
+  view->globals = ChunkCopyValues(heap, origin->globals);
+
+  if (view->code == NULL || view->consts == NULL || view->globals == NULL) {
+    ChunkDispose(view);
+    return NULL;
+  }
+
+  memcpy(view->code, origin->code, origin->count);
+
+  return view;
+}
+
+/**
+ * @return false when the heap of @param chunk is out of memory
+ */
+bool ChunkWrite(Chunk *chunk, uint8_t byte, int line) {
 #ifdef CHUNK_DEBUG
-  printf("chunk_write(chunk = UNKNOWN, op = %d, line = %d)\n", op, line);
+  printf("chunk_write(chunk = UNKNOWN, byte = %d, line = %d)\n", byte, line);
 #endif
 
   if (chunk->capacity < chunk->count + 1) {
-    size_t old_capacity = chunk->capacity;
-    chunk->capacity = GROW_CAPACITY(chunk->capacity);
-    chunk->code = GROW_ARRAY(unsigned int, chunk->code, old_capacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+    int capacity = GROW_CAPACITY(chunk->capacity);
+    uint8_t *code = HEAP_GROW_ARRAY(chunk->heap, uint8_t, chunk->code, chunk->capacity, capacity);
+    if (code == NULL) return false;
+
+    chunk->code = code;
+    chunk->capacity = capacity;
+  }
+
+  bool new_line = chunk->line_count == 0 || chunk->lines[chunk->line_count - 1].line != line;
+
+  if (new_line && chunk->line_capacity < chunk->line_count + 1) {
+    int capacity = GROW_CAPACITY(chunk->line_capacity);
+    line_run_t *lines = HEAP_GROW_ARRAY(chunk->heap, line_run_t, chunk->lines, chunk->line_capacity, capacity);
+    if (lines == NULL) return false;
+
+    chunk->lines = lines;
+    chunk->line_capacity = capacity;
+  }
+
+  if (new_line) {
+    chunk->lines[chunk->line_count].offset = chunk->count;
+    chunk->lines[chunk->line_count].line = line;
+    chunk->line_count++;
+  }
+
+  // the cache is sized after the code, it's rebuilt when used again
+  HEAP_FREE_ARRAY(chunk->heap, global_cache_t, chunk->global_cache, chunk->count);
+  chunk->global_cache = NULL;
+
+  // the native code was translated from the old code
+  JitDispose(chunk->jit);
+  chunk->jit = NULL;
+
+  chunk->code[chunk->count] = byte;
+  chunk->count++;
+  chunk->verified = false;
+
+  return true;
+}
+
+/**
+ * Writes @param op with the @param index operand, using the narrowest
+ * of op, its _WIDE16 or its _WIDE24 variant that fits the index
+ *
+ * @return false when the index doesn't fit 24 bits or the heap of
+ * @param chunk is out of memory
+ */
+bool ChunkWriteIndexed(Chunk *chunk, Opcode op, uint32_t index, int line) {
+  if (index > OPERAND_MAX) return false;
+
+  int width = index <= 0xff ? 1 : index <= 0xffff ? 2 : 3;
+
+  if (!ChunkWrite(chunk, (uint8_t) (op + width - 1), line)) return false;
+
+  for (int i = 0; i < width; i++) {
+    if (!ChunkWrite(chunk, (uint8_t) (index >> (8 * i)), line)) return false;
   }
 
-    chunk->code[chunk->count] = op;
-    chunk->lines[chunk->count] = line;
-    chunk->count++;
+  return true;
 }
 
 int ChunkWriteConst(Chunk *chunk, Value const_) {
 #ifdef VALUE_DEBUG
-  printf("chunk_write_const(chunk = UNKNOWN, const_ = %s)\n", value_to_str(&const_));
+  printf("chunk_write_const(chunk = UNKNOWN, const_ = %s)\n", ValueToStr(const_));
 #endif
 
-  ValueArrayWrite(chunk->consts, const_);
+  if (!ValueArrayWrite(chunk->consts, const_)) return -1;
+  chunk->verified = false;
 
   return chunk->consts->count - 1;
 }
 
+/**
+ * Declares a global slot named @param name
+ *
+ * @return the slot index
+ */
+int ChunkWriteGlobal(Chunk *chunk, Value name) {
+  if (!ValueArrayWrite(chunk->globals, name)) return -1;
+  chunk->verified = false;
+
+  return chunk->globals->count - 1;
+}
+
+/**
+ * Binary searches the run that holds @param offset
+ *
+ * @return the line of the code at offset, or -1 without line runs
+ */
+int ChunkLine(Chunk *chunk, int offset) {
+  int low = 0;
+  int high = chunk->line_count;
+
+  // finds the first run that starts after offset
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+
+    if (chunk->lines[middle].offset <= offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low == 0 ? -1 : chunk->lines[low - 1].line;
+}
+
 char *ChunkDump(Chunk *chunk) {
   char *str = malloc(1100 * sizeof(char));
 
@@ -57,7 +319,7 @@ char *ChunkDump(Chunk *chunk) {
 
   for (size_t i = 0; i < chunk->count; i++) {
     uint32_t code = chunk->code[i];
-    int line = chunk->lines[i];
+    int line = ChunkLine(chunk, (int) i);
 
     sprintf(str, "%s, {code: %d, line: %d}", str, code, line);
   }
@@ -68,8 +330,25 @@ char *ChunkDump(Chunk *chunk) {
 }
 
 void ChunkDispose(Chunk *chunk) {
-  ValueArrayDispose(chunk->consts);
-  free(chunk->lines);
-  free(chunk->code);
-  free(chunk);
+  if (chunk->vm != NULL) VmForgetChunk(chunk->vm, chunk);
+
+  HEAP_FREE_ARRAY(chunk->heap, global_cache_t, chunk->global_cache, chunk->count);
+  JitDispose(chunk->jit);
+
+  if (chunk->mapping != NULL) {
+    // only the array headers are owned, the values are in the mapping
+    HeapFree(chunk->heap, chunk->consts, sizeof(ValueArray));
+    HeapFree(chunk->heap, chunk->globals, sizeof(ValueArray));
+    munmap(chunk->mapping, chunk->mapping_size);
+    HeapFree(chunk->heap, chunk, sizeof(Chunk));
+    return;
+  }
+
+  if (chunk->consts != NULL) ValueArrayDispose(chunk->consts);
+  if (chunk->globals != NULL) ValueArrayDispose(chunk->globals);
+
+  // the lines of a view belong to its origin
+  if (chunk->origin == NULL) HEAP_FREE_ARRAY(chunk->heap, line_run_t, chunk->lines, chunk->line_capacity);
+  HEAP_FREE_ARRAY(chunk->heap, uint8_t, chunk->code, chunk->capacity);
+  HeapFree(chunk->heap, chunk, sizeof(Chunk));
 }
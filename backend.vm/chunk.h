@@ -6,41 +6,230 @@
 #include "heap.h"
 #include "value.h"
 
+/**
+ * Every opcode with the count of operand bytes that follows it
+ * in the code array, and the count of values it pops from and
+ * pushes to the stack. The Opcode enum, the dispatch table
+ * of the vm and the verifier are all generated from it.
+ *
+ * Opcodes and operands are a byte each, the opcodes with an index
+ * operand have _WIDE16 and _WIDE24 variants right after them, with
+ * a 2 or 3 bytes little endian index
+ *
+ * The arithmetic opcodes without a suffix take numbers of any type,
+ * the _I32 and _F64 ones are emitted when the compiler knows the
+ * types of the operands, and read them without any check
+ *
+ * The _QUICK opcodes are never emitted by the compiler, the vm
+ * rewrites a generic instruction to one of them the first time it
+ * runs, after the types it saw. They check those types again and
+ * rewrite the instruction back when they don't match
+ *
+ * The fiber opcodes only run in a fiber of a Scheduler: OP_SPAWN
+ * starts the task named by a string constant and pushes the id of
+ * its fiber, OP_AWAIT pops an id and pushes whether that fiber ran
+ * to the end, OP_YIELD lets the other fibers run. The name of a task
+ * is one of the first 256 constants, OP_SPAWN has no wide variants
+ */
+#define OPCODES(X) \
+    X(OP_RET, 0, 0, 0) \
+    X(OP_CONST, 1, 0, 1) \
+    X(OP_CONST_WIDE16, 2, 0, 1) \
+    X(OP_CONST_WIDE24, 3, 0, 1) \
+    X(OP_NEGATE, 0, 1, 1) \
+    X(OP_SUM, 0, 2, 1) \
+    X(OP_SUB, 0, 2, 1) \
+    X(OP_MULT, 0, 2, 1) \
+    X(OP_DIV, 0, 2, 1) \
+    X(OP_TRUE, 0, 0, 1) \
+    X(OP_FALSE, 0, 0, 1) \
+    X(OP_NOT, 0, 1, 1) \
+    X(OP_CONCAT, 0, 2, 1) \
+    X(OP_POP, 0, 1, 0) \
+    X(OP_STORE_GLOBAL, 0, 2, 0) \
+    X(OP_ACCESS_GLOBAL, 0, 1, 1) \
+    X(OP_GET_GLOBAL_SLOT, 1, 0, 1) \
+    X(OP_GET_GLOBAL_SLOT_WIDE16, 2, 0, 1) \
+    X(OP_GET_GLOBAL_SLOT_WIDE24, 3, 0, 1) \
+    X(OP_SET_GLOBAL_SLOT, 1, 1, 0) \
+    X(OP_SET_GLOBAL_SLOT_WIDE16, 2, 1, 0) \
+    X(OP_SET_GLOBAL_SLOT_WIDE24, 3, 1, 0) \
+    X(OP_SUM_I32, 0, 2, 1) \
+    X(OP_SUB_I32, 0, 2, 1) \
+    X(OP_MULT_I32, 0, 2, 1) \
+    X(OP_DIV_I32, 0, 2, 1) \
+    X(OP_NEGATE_I32, 0, 1, 1) \
+    X(OP_LESS_I32, 0, 2, 1) \
+    X(OP_LESS_EQUAL_I32, 0, 2, 1) \
+    X(OP_GREATER_I32, 0, 2, 1) \
+    X(OP_GREATER_EQUAL_I32, 0, 2, 1) \
+    X(OP_EQUAL_I32, 0, 2, 1) \
+    X(OP_NOT_EQUAL_I32, 0, 2, 1) \
+    X(OP_I32_TO_F64, 0, 1, 1) \
+    X(OP_SUM_F64, 0, 2, 1) \
+    X(OP_SUB_F64, 0, 2, 1) \
+    X(OP_MULT_F64, 0, 2, 1) \
+    X(OP_DIV_F64, 0, 2, 1) \
+    X(OP_NEGATE_F64, 0, 1, 1) \
+    X(OP_SUM_QUICK_I32, 0, 2, 1) \
+    X(OP_SUM_QUICK_F64, 0, 2, 1) \
+    X(OP_SUB_QUICK_I32, 0, 2, 1) \
+    X(OP_SUB_QUICK_F64, 0, 2, 1) \
+    X(OP_MULT_QUICK_I32, 0, 2, 1) \
+    X(OP_MULT_QUICK_F64, 0, 2, 1) \
+    X(OP_DIV_QUICK_I32, 0, 2, 1) \
+    X(OP_DIV_QUICK_F64, 0, 2, 1) \
+    X(OP_NEGATE_QUICK_I32, 0, 1, 1) \
+    X(OP_NEGATE_QUICK_F64, 0, 1, 1) \
+    X(OP_ACCESS_GLOBAL_QUICK, 0, 1, 1) \
+    X(OP_CONST_SUM_I32, 1, 1, 1) \
+    X(OP_CONST_SUM_F64, 1, 1, 1) \
+    X(OP_GET_GLOBAL_SLOT_SUM_I32, 1, 1, 1) \
+    X(OP_GET_GLOBAL_SLOT_SUM_F64, 1, 1, 1) \
+    X(OP_CONST_SET_GLOBAL_SLOT, 2, 0, 0) \
+    X(OP_SPAWN, 1, 0, 1) \
+    X(OP_AWAIT, 0, 1, 1) \
+    X(OP_YIELD, 0, 0, 0)
+
+/**
+ * Superinstructions run a sequence that the compiler emits often
+ * with a single dispatch, each one is listed with the two opcodes
+ * it stands for. Their operand bytes are the narrow operands of
+ * those opcodes, in order
+ */
+#define SUPERINSTRUCTIONS(X) \
+    X(OP_CONST_SUM_I32, OP_CONST, OP_SUM_I32) \
+    X(OP_CONST_SUM_F64, OP_CONST, OP_SUM_F64) \
+    X(OP_GET_GLOBAL_SLOT_SUM_I32, OP_GET_GLOBAL_SLOT, OP_SUM_I32) \
+    X(OP_GET_GLOBAL_SLOT_SUM_F64, OP_GET_GLOBAL_SLOT, OP_SUM_F64) \
+    X(OP_CONST_SET_GLOBAL_SLOT, OP_CONST, OP_SET_GLOBAL_SLOT)
+
+// the most opcodes an instruction stands for
+#define INSTRUCTION_MAX_STEPS 2
+
+// the biggest index a _WIDE24 operand holds
+#define OPERAND_MAX 0xffffff
+
 typedef enum {
-    OP_RET,
-    OP_CONST,
-    OP_NEGATE,
-    OP_SUM,
-    OP_SUB,
-    OP_MULT,
-    OP_DIV,
-    OP_TRUE,
-    OP_FALSE,
-    OP_NOT,
-    OP_CONCAT,
-    OP_POP,
-    OP_STORE_GLOBAL,
-    OP_ACCESS_GLOBAL
+#define OPCODE_ENUM(name, operands, pops, pushes) name,
+    OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
+    OP_COUNT
 } Opcode;
 
-typedef struct {
+/**
+ * The lines are only read by errors and traces, so instead of a line
+ * per code byte, the chunk keeps a run per line change: the code from
+ * offset to the offset of the next run comes from that line
+ */
+typedef struct line_run {
+  int32_t offset;
+  int32_t line;
+} line_run_t;
+
+/**
+ * The slot an OP_ACCESS_GLOBAL_QUICK found for @a name the last
+ * time it ran, until VmLinkGlobals renumbers the slots
+ */
+typedef struct global_cache {
+  Value name;
+  int32_t slot;
+} global_cache_t;
+
+typedef struct instruction {
+  Opcode op;
+  uint32_t operand;
+} instruction_t;
+
+typedef struct chunk {
+  Heap *heap;
   int count;
   int capacity;
-  int *lines;
-  unsigned int *code;
+  uint8_t *code;
+  // sorted by offset
+  line_run_t *lines;
+  int line_count;
+  int line_capacity;
   ValueArray *consts;
+  // names of the global slots, indexed by slot
+  ValueArray *globals;
+
+  // set by ChunkVerify, the vm only runs verified chunks
+  bool verified;
+  int max_stack;
+  // the code is in the register instruction set of regvm.h, and
+  // max_stack is the count of registers
+  bool registers;
+
+  // indexed by code offset, allocated the first time an
+  // OP_ACCESS_GLOBAL is quickened
+  global_cache_t *global_cache;
+
+  // count of VmEval calls, the vm compiles the chunk with the jit
+  // of jit.h when it reaches the threshold
+  int hotness;
+  struct jit_code *jit;
+
+  // set on the views of ChunkCreateView, the chunk they read the
+  // lines and the string pool of
+  const struct chunk *origin;
+
+  // the vm whose strings the consts and globals hold, which keeps
+  // the chunk as a root until ChunkDispose
+  struct vm *vm;
+
+  // set when the chunk was loaded from a file: the arrays point
+  // into the private mapping of it, which only the vm writes to,
+  // when it replaces the string references by the strings
+  void *mapping;
+  size_t mapping_size;
+  const uint8_t *strings;
+  uint32_t strings_size;
+  uint32_t string_count;
 } Chunk;
 
 // opcode functions>
 Opcode UintToOpcode(unsigned int raw);
 
+/**
+ * @param width the count of operand bytes, 1 to 3
+ * @return the little endian operand at @param code
+ */
+static inline uint32_t OperandRead(const uint8_t *code, int width) {
+  uint32_t operand = code[0];
+  if (width > 1) operand |= (uint32_t) code[1] << 8;
+  if (width > 2) operand |= (uint32_t) code[2] << 16;
+
+  return operand;
+}
+
+int OpcodeOperands(Opcode op);
+
+int OpcodePops(Opcode op);
+
+int OpcodePushes(Opcode op);
+
+const char *OpcodeName(Opcode op);
+
+Opcode OpcodeBase(Opcode op);
+
+int InstructionExpand(const uint8_t *code, instruction_t *steps);
+
 // chunk functions>
-Chunk *ChunkCreate(int count, int capacity);
+Chunk *ChunkCreate(Heap *heap, int count, int capacity);
+
+Chunk *ChunkCreateView(Heap *heap, Chunk *origin);
 
-void ChunkWrite(Chunk *chunk, unsigned int, int line);
+bool ChunkWrite(Chunk *chunk, uint8_t byte, int line);
+
+bool ChunkWriteIndexed(Chunk *chunk, Opcode op, uint32_t index, int line);
 
 int ChunkWriteConst(Chunk *chunk, Value const_);
 
+int ChunkWriteGlobal(Chunk *chunk, Value name);
+
+int ChunkLine(Chunk *chunk, int offset);
+
 char *ChunkDump(Chunk *chunk);
 
 void ChunkDispose(Chunk *chunk);
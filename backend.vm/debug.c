@@ -1,5 +1,237 @@
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "bytecode.h"
 #include "debug.h"
+#include "regvm.h"
+
+// trace_writer functions>
+TraceWriter *TraceWriterCreate(FILE *out) {
+  TraceWriter *writer = malloc(sizeof(TraceWriter));
+
+  writer->out = out;
+  writer->length = 0;
+
+  return writer;
+}
+
+void TraceWrite(TraceWriter *writer, const char *format, ...) {
+  va_list args;
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    size_t available = TRACE_BUFFER_SIZE - writer->length;
+
+    va_start(args, format);
+    int written = vsnprintf(writer->buffer + writer->length, available, format, args);
+    va_end(args);
+
+    if (written < 0) return;
+
+    if ((size_t) written < available) {
+      writer->length += written;
+      return;
+    }
+
+    // the line didn't fit, flush what we have and
+    // retry once with the whole buffer available
+    TraceFlush(writer);
+  }
+}
+
+void TraceWriteValue(TraceWriter *writer, Value value) {
+  if (IS_STRING_REF(value)) {
+    TraceWrite(writer, "<string %u>", AS_STRING_REF(value));
+    return;
+  }
+
+  switch (ValueGetType(value)) {
+    case V_TYPE_NIL:TraceWrite(writer, "nil");
+      break;
+    case V_TYPE_BOOL:TraceWrite(writer, "%s", AS_BOOL(value) ? "true" : "false");
+      break;
+    case V_TYPE_DOUBLE:TraceWrite(writer, "%g", AS_DOUBLE(value));
+      break;
+    case V_TYPE_INT:TraceWrite(writer, "%d", AS_INT(value));
+      break;
+    case V_TYPE_STR:TraceWrite(writer, "%s", AS_CSTR(value));
+      break;
+    case V_TYPE_OBJ:
+      // tracing doesn't flatten, it would allocate on the vm heap
+      if (IS_ROPE(value) && AS_ROPE(value)->flat != NULL) {
+        TraceWrite(writer, "%s", AS_ROPE(value)->flat->values);
+      } else if (IS_ROPE(value)) {
+        TraceWrite(writer, "<rope of %zu chars>", AS_ROPE(value)->length);
+      } else {
+        TraceWrite(writer, "OBJECT");
+      }
+      break;
+  }
+}
+
+void TraceInstruction(TraceWriter *writer, Chunk *chunk, uint8_t *pc, Value *stack_start, Value *sp) {
+  TraceWrite(writer, "=>> ");
+
+  for (Value *slot = stack_start; slot < sp; slot++) {
+    TraceWrite(writer, "[ '");
+    TraceWriteValue(writer, *slot);
+    TraceWrite(writer, "' ]");
+  }
+
+  TraceWrite(writer, "\n");
+
+  ChunkDisassembleInstruction(writer, chunk, (int) (pc - chunk->code));
+}
+
+void TraceFlush(TraceWriter *writer) {
+  if (writer->length == 0) return;
+
+  fwrite(writer->buffer, sizeof(char), writer->length, writer->out);
+  fflush(writer->out);
+
+  writer->length = 0;
+}
+
+void TraceWriterDispose(TraceWriter *writer) {
+  TraceFlush(writer);
+  free(writer);
+}
+
+/**
+ * Writes the @param index operand of @param op, followed by the
+ * constant or the global name it points to
+ */
+static void TraceWriteOperand(TraceWriter *writer, Chunk *chunk, Opcode op, uint32_t index) {
+  ValueArray *operand_values = NULL;
+
+  TraceWrite(writer, " %u", index);
+
+  switch (op) {
+    case OP_CONST:
+    case OP_CONST_WIDE16:
+    case OP_CONST_WIDE24:
+    case OP_SPAWN:operand_values = chunk->consts;
+      break;
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT_WIDE16:
+    case OP_GET_GLOBAL_SLOT_WIDE24:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_WIDE16:
+    case OP_SET_GLOBAL_SLOT_WIDE24:operand_values = chunk->globals;
+      break;
+    default:break;
+  }
+
+  if (operand_values != NULL && index < (uint32_t) operand_values->count) {
+    Value value = operand_values->values[index];
+    const char *chars;
+    uint32_t length;
+
+    TraceWrite(writer, " '");
+    if (IS_STRING_REF(value) && BytecodeString(chunk, AS_STRING_REF(value), &chars, &length)) {
+      TraceWrite(writer, "%.*s", (int) length, chars);
+    } else {
+      TraceWriteValue(writer, value);
+    }
+    TraceWrite(writer, "'");
+  }
+}
+
+/**
+ * Writes the B or C @param operand of a register instruction, as a
+ * register or as the constant it points to
+ */
+static void TraceWriteRegisterOperand(TraceWriter *writer, Chunk *chunk, uint8_t operand) {
+  if (operand & REG_CONST_BIT) {
+    TraceWrite(writer, " k");
+    TraceWriteOperand(writer, chunk, OP_CONST, operand & ~REG_CONST_BIT);
+  } else {
+    TraceWrite(writer, " r%d", operand);
+  }
+}
+
+/**
+ * ChunkDisassembleInstruction for the register instruction set,
+ * writes "offset line NAME A B C" with the K operand in place of
+ * the missing ones
+ */
+static int ChunkDisassembleRegisterInstruction(TraceWriter *writer, Chunk *chunk, int offset) {
+  RegOpcode op = (RegOpcode) chunk->code[offset];
+  RegFormat format = RegOpcodeFormat(op);
+  int operands = RegFormatOperands(format);
+
+  TraceWrite(writer, "%04d %4d %s", offset, ChunkLine(chunk, offset), RegOpcodeName(op));
+
+  if (operands > 0 && offset + operands < chunk->count) {
+    reg_instruction_t instruction;
+    RegInstructionDecode(chunk->code + offset, &instruction);
+
+    if (format == kRegFormatKB) {
+      TraceWriteOperand(writer, chunk, RegOpcodeStackOpcode(op), instruction.k);
+    } else {
+      TraceWrite(writer, " r%d", instruction.a);
+    }
+
+    switch (format) {
+      case kRegFormatAB:
+      case kRegFormatKB:
+        TraceWriteRegisterOperand(writer, chunk, instruction.b);
+        break;
+      case kRegFormatABC:
+        TraceWriteRegisterOperand(writer, chunk, instruction.b);
+        TraceWriteRegisterOperand(writer, chunk, instruction.c);
+        break;
+      case kRegFormatAK:
+        TraceWriteOperand(writer, chunk, RegOpcodeStackOpcode(op), instruction.k);
+        break;
+      default:
+        break;
+    }
+  }
+
+  TraceWrite(writer, "\n");
+
+  return offset + 1 + operands;
+}
+
+// disassemble functions>
+/**
+ * Writes the instruction at @param offset as "offset line NAME operands"
+ *
+ * @return the offset of the next instruction
+ */
+int ChunkDisassembleInstruction(TraceWriter *writer, Chunk *chunk, int offset) {
+  if (chunk->registers) return ChunkDisassembleRegisterInstruction(writer, chunk, offset);
+
+  Opcode op = UintToOpcode(chunk->code[offset]);
+  int operands = OpcodeOperands(op);
+
+  TraceWrite(writer, "%04d %4d %s", offset, ChunkLine(chunk, offset), OpcodeName(op));
+
+  if (operands > 0 && offset + operands < chunk->count) {
+    instruction_t steps[INSTRUCTION_MAX_STEPS];
+    int step_count = InstructionExpand(chunk->code + offset, steps);
+
+    // superinstructions have an operand per opcode they stand for
+    for (int step = 0; step < step_count; step++) {
+      if (OpcodeOperands(steps[step].op) > 0) {
+        TraceWriteOperand(writer, chunk, steps[step].op, steps[step].operand);
+      }
+    }
+  }
+
+  TraceWrite(writer, "\n");
+
+  return offset + 1 + (operands < 0 ? 0 : operands);
+}
 
 void ChunkDisassemble(Chunk *chunk) {
+  TraceWriter *writer = TraceWriterCreate(stdout);
+
+  TraceWrite(writer, "== chunk ==\n");
+
+  for (int offset = 0; offset < chunk->count;) {
+    offset = ChunkDisassembleInstruction(writer, chunk, offset);
+  }
 
+  TraceWriterDispose(writer);
 }
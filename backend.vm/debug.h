@@ -1,8 +1,39 @@
 #ifndef RUNTIME_DEBUG_H
 #define RUNTIME_DEBUG_H
 
+#include <stdio.h>
+
 #include "chunk.h"
 
+#define TRACE_BUFFER_SIZE 8192
+
+/**
+ * Buffered writer used by the trace mode and the disassembler,
+ * the output is only handed to stdio when the buffer fills up
+ * or on @a TraceFlush, so tracing doesn't pay one syscall per line
+ */
+typedef struct {
+  FILE *out;
+  size_t length;
+  char buffer[TRACE_BUFFER_SIZE];
+} TraceWriter;
+
+// trace_writer functions>
+TraceWriter *TraceWriterCreate(FILE *out);
+
+void TraceWrite(TraceWriter *writer, const char *format, ...);
+
+void TraceWriteValue(TraceWriter *writer, Value value);
+
+void TraceInstruction(TraceWriter *writer, Chunk *chunk, uint8_t *pc, Value *stack_start, Value *sp);
+
+void TraceFlush(TraceWriter *writer);
+
+void TraceWriterDispose(TraceWriter *writer);
+
+// disassemble functions>
+int ChunkDisassembleInstruction(TraceWriter *writer, Chunk *chunk, int offset);
+
 void ChunkDisassemble(Chunk *chunk);
 
 #endif //RUNTIME_DEBUG_H
@@ -0,0 +1,161 @@
+#include "gc.h"
+#include "utils.h"
+
+// gc functions>
+void GcMarkValue(Vm *vm, Value value) {
+  if (IS_OBJ(value)) GcMarkObject(vm, AS_OBJ(value));
+}
+
+/**
+ * Strings don't reference other objects and are done once marked,
+ * the other objects are pushed to the gray stack and traced later,
+ * so deep ropes don't recurse
+ */
+void GcMarkObject(Vm *vm, Object *object) {
+  if (object == NULL || object->marked) return;
+
+  object->marked = true;
+
+  if (object->type == OBJ_T_STR) return;
+
+  if (vm->gray_count >= vm->gray_capacity) {
+    int capacity = GROW_CAPACITY(vm->gray_capacity);
+
+    vm->gray_stack = GROW_ARRAY(Object *, vm->gray_stack, vm->gray_capacity, capacity);
+    vm->gray_capacity = capacity;
+  }
+
+  vm->gray_stack[vm->gray_count++] = object;
+}
+
+static void GcBlackenObject(Vm *vm, Object *object) {
+  switch (object->type) {
+    case OBJ_T_STR:
+      break;
+    case OBJ_T_ROPE: {
+      rope_t *rope = (rope_t *) object;
+
+      GcMarkObject(vm, rope->left);
+      GcMarkObject(vm, rope->right);
+      GcMarkObject(vm, (Object *) rope->flat);
+      break;
+    }
+  }
+}
+
+static void GcTraceReferences(Vm *vm) {
+  while (vm->gray_count > 0) {
+    GcBlackenObject(vm, vm->gray_stack[--vm->gray_count]);
+  }
+}
+
+static void GcMarkArray(Vm *vm, ValueArray *array) {
+  if (array == NULL) return;
+
+  for (int i = 0; i < array->count; i++) {
+    GcMarkValue(vm, array->values[i]);
+  }
+}
+
+static void GcMarkChunk(Vm *vm, Chunk *chunk) {
+  GcMarkArray(vm, chunk->consts);
+  GcMarkArray(vm, chunk->globals);
+
+  // the cached names are only compared, but a freed one could
+  // be reallocated for another name
+  if (chunk->global_cache != NULL) {
+    for (int i = 0; i < chunk->count; i++) {
+      GcMarkValue(vm, chunk->global_cache[i].name);
+    }
+  }
+}
+
+/**
+ * The roots are the live part of the stack, the global values
+ * and their names, and the constants and caches of every chunk the
+ * vm ran, the views it keeps for the shared chunks included: VmEval
+ * writes strings into them that the next runs read
+ */
+static void GcMarkRoots(Vm *vm) {
+  for (int i = 0; i < vm->stack->top; i++) {
+    GcMarkValue(vm, vm->stack->values[i]);
+  }
+
+  GcMarkArray(vm, vm->global_values);
+
+  Value name, slot;
+  for (size_t cursor = 0; table_next(vm->globals, &cursor, &name, &slot);) {
+    GcMarkValue(vm, name);
+  }
+
+  for (int i = 0; i < vm->chunk_count; i++) {
+    GcMarkChunk(vm, vm->chunks[i]);
+  }
+}
+
+/**
+ * Frees the unmarked objects of vm->objects and clears the
+ * mark of the surviving ones for the next collection
+ */
+static void GcSweep(Vm *vm) {
+  Object **link = &vm->objects;
+
+  while (*link != NULL) {
+    Object *object = *link;
+
+    if (object->marked) {
+      object->marked = false;
+      link = &object->next;
+    } else {
+      *link = object->next;
+      GcFreeObject(vm, object);
+    }
+  }
+}
+
+/**
+ * Collects every object of vm->objects that isn't reachable from
+ * the roots, the caller must have written the stack top back to
+ * vm->stack before calling it
+ */
+void GcCollect(Vm *vm) {
+  GcMarkRoots(vm);
+  GcTraceReferences(vm);
+
+  // vm->strings holds its keys weakly, an unreachable string
+  // must leave the intern table before it's freed
+  table_remove_unmarked(vm->strings);
+
+  GcSweep(vm);
+
+  // the strings of the chunks aren't on vm->objects, so the sweep
+  // doesn't clear their marks, but every string is interned
+  Value key, ignored;
+  for (size_t cursor = 0; table_next(vm->strings, &cursor, &key, &ignored);) {
+    AS_OBJ(key)->marked = false;
+  }
+
+  size_t next_gc = vm->heap->allocated * GC_HEAP_GROW_FACTOR;
+  vm->next_gc = next_gc < GC_INITIAL_THRESHOLD ? GC_INITIAL_THRESHOLD : next_gc;
+}
+
+/**
+ * Called before allocating an object, collects when the heap grew
+ * past vm->next_gc or on every allocation in the stress mode
+ */
+void GcMaybeCollect(Vm *vm) {
+  if (vm->gc_stress || vm->heap->allocated > vm->next_gc) {
+    GcCollect(vm);
+  }
+}
+
+void GcFreeObject(Vm *vm, Object *object) {
+  switch (object->type) {
+    case OBJ_T_STR:
+      StringDispose(vm->heap, (string_t *) object);
+      break;
+    case OBJ_T_ROPE:
+      HEAP_FREE_ARRAY(vm->heap, rope_t, object, 1);
+      break;
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef RUNTIME_GC_H
+#define RUNTIME_GC_H
+
+#include <stddef.h>
+
+#include "vm.h"
+#include "object.h"
+#include "value.h"
+
+/**
+ * The first collection happens after GC_INITIAL_THRESHOLD bytes
+ * are allocated on the vm heap, then every time the heap grows
+ * GC_HEAP_GROW_FACTOR times what survived the previous one
+ */
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+
+// gc functions>
+void GcMarkValue(Vm *vm, Value value);
+
+void GcMarkObject(Vm *vm, Object *object);
+
+void GcCollect(Vm *vm);
+
+void GcMaybeCollect(Vm *vm);
+
+void GcFreeObject(Vm *vm, Object *object);
+
+#endif //RUNTIME_GC_H
@@ -1,60 +1,244 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "heap.h"
 
-// heap functions>
-Heap *HeapCreate(size_t size) {
-  Heap *heap = malloc(sizeof(Heap));
-  heap->capacity = size;
+#define HEAP_ALIGN(size) (((size) + HEAP_ALIGNMENT - 1) & ~((size_t) HEAP_ALIGNMENT - 1))
+
+#define HEAP_PAGE_HEADER HEAP_ALIGN(sizeof(heap_page_t))
+#define HEAP_LARGE_HEADER HEAP_ALIGN(sizeof(heap_large_t))
+
+/**
+ * 16 byte steps up to 128, then 4 classes per power of two,
+ * so a block never wastes more than 25% of its size
+ */
+static const size_t heap_class_sizes[HEAP_SIZE_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+};
+
+static inline int HeapFloorLog2(size_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - __builtin_clzll((unsigned long long) value);
+#else
+  int log = 0;
+  while (value >>= 1) log++;
+  return log;
+#endif
+}
 
-  mem_info_t *root = malloc(size * sizeof(mem_info_t));
+/**
+ * @param size a size between 1 and HEAP_SMALL_MAX
+ * @return the index of the smallest class that fits size
+ */
+static inline int HeapSizeClass(size_t size) {
+  if (size <= 128) return size == 0 ? 0 : (int) ((size + 15) / 16) - 1;
 
-  root->next = NULL;
-  root->size = size;
-  root->is_free = 1;
+  size_t rest = size - 1;
+  int log = HeapFloorLog2(rest);
 
-  heap->root = root;
+  return 8 + (log - 7) * 4 + (int) ((rest >> (log - 2)) & 3);
+}
 
-  return heap;
+static bool HeapReserve(Heap *heap, size_t size) {
+  if (heap->limit != 0 && heap->reserved + size > heap->limit) return false;
+
+  heap->reserved += size;
+
+  return true;
+}
+
+static heap_page_t *HeapPageCreate(Heap *heap) {
+  if (!HeapReserve(heap, HEAP_PAGE_SIZE)) return NULL;
+
+  heap_page_t *page = malloc(HEAP_PAGE_SIZE);
+  if (page == NULL) {
+    heap->reserved -= HEAP_PAGE_SIZE;
+    return NULL;
+  }
+
+  page->bump = (char *) page + HEAP_PAGE_HEADER;
+  page->end = (char *) page + HEAP_PAGE_SIZE;
+  page->next = heap->pages;
+  heap->pages = page;
+
+  return page;
+}
+
+static void *HeapAllocSmall(Heap *heap, int size_class) {
+  size_t size = heap_class_sizes[size_class];
+  heap_block_t *block = heap->free_lists[size_class];
+
+  if (block != NULL) {
+    heap->free_lists[size_class] = block->next;
+    return block;
+  }
+
+  heap_page_t *page = heap->pages;
+  if (page == NULL || page->bump + size > page->end) {
+    page = HeapPageCreate(heap);
+    if (page == NULL) return NULL;
+  }
+
+  void *ptr = page->bump;
+  page->bump += size;
+
+  return ptr;
+}
+
+static void *HeapAllocLarge(Heap *heap, size_t size) {
+  size_t total = HEAP_LARGE_HEADER + size;
+  if (!HeapReserve(heap, total)) return NULL;
+
+  heap_large_t *large = malloc(total);
+  if (large == NULL) {
+    heap->reserved -= total;
+    return NULL;
+  }
+
+  large->size = size;
+  large->prev = NULL;
+  large->next = heap->large;
+  if (heap->large != NULL) heap->large->prev = large;
+  heap->large = large;
+
+  return (char *) large + HEAP_LARGE_HEADER;
 }
 
-mem_info_t *HeapBlockAlloc(Heap *heap, size_t rem) {
-  mem_info_t *new_block = heap->root;
-  ++new_block;
+// heap functions>
+/**
+ * @param limit max bytes the heap can take from the system, 0 for no limit
+ */
+Heap *HeapCreate(size_t limit) {
+  Heap *heap = malloc(sizeof(Heap));
+
+  heap->limit = limit;
+  heap->reserved = 0;
+  heap->allocated = 0;
+  heap->allocated_total = 0;
+  heap->pages = NULL;
+  heap->large = NULL;
 
-  new_block->is_free = 1;
-  new_block->size = rem - sizeof(mem_info_t);
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    heap->free_lists[i] = NULL;
+  }
 
-  return new_block;
+  return heap;
 }
 
+/**
+ * A NULL @param heap allocates straight from the system, for
+ * the data that isn't owned by a vm
+ *
+ * @return the allocated block or NULL when the memory limit was reached
+ */
 void *HeapAlloc(Heap *heap, size_t size) {
-  mem_info_t *ptr = NULL;
-  mem_info_t *block = heap->root;
+  if (heap == NULL) return malloc(size);
 
-  do {
-    if (block->is_free && block->size >= size) {
-      ptr = (block++);
+  void *ptr = size <= HEAP_SMALL_MAX
+      ? HeapAllocSmall(heap, HeapSizeClass(size))
+      : HeapAllocLarge(heap, size);
 
-      block->size = size;
-      block->is_free = 0;
+  if (ptr != NULL) {
+    heap->allocated += size;
+    heap->allocated_total += size;
+  }
 
-      if (block->next != NULL) {
-        block->next = HeapBlockAlloc(heap, (block - 1)->size - size);
-      }
-      break;
-    }
-  } while (block != NULL);
+  return ptr;
+}
+
+/**
+ * Blocks that still fit their size class are kept in place
+ *
+ * @return the resized block, NULL if @param new_size is 0 or the memory limit was reached,
+ * in that case @param ptr is still valid
+ */
+void *HeapRealloc(Heap *heap, void *ptr, size_t old_size, size_t new_size) {
+  if (heap == NULL) {
+    if (new_size != 0) return realloc(ptr, new_size);
+
+    free(ptr);
+    return NULL;
+  }
+
+  if (new_size == 0) {
+    HeapFree(heap, ptr, old_size);
+    return NULL;
+  }
+
+  if (ptr == NULL) return HeapAlloc(heap, new_size);
+
+  if (old_size <= HEAP_SMALL_MAX && new_size <= HEAP_SMALL_MAX &&
+      HeapSizeClass(old_size) == HeapSizeClass(new_size)) {
+    heap->allocated += new_size;
+    heap->allocated -= old_size;
+    if (new_size > old_size) heap->allocated_total += new_size - old_size;
 
     return ptr;
+  }
+
+  void *resized = HeapAlloc(heap, new_size);
+  if (resized == NULL) return NULL;
+
+  memcpy(resized, ptr, old_size < new_size ? old_size : new_size);
+  HeapFree(heap, ptr, old_size);
+
+  return resized;
 }
 
-bool *HeapFree(Heap *heap, void *ptr) {
-    return false;
+/**
+ * @param size the size the block was allocated with
+ * @return if the block was freed
+ */
+bool HeapFree(Heap *heap, void *ptr, size_t size) {
+  if (ptr == NULL) return false;
+
+  if (heap == NULL) {
+    free(ptr);
+    return true;
+  }
+
+  heap->allocated -= size;
+
+  if (size <= HEAP_SMALL_MAX) {
+    int size_class = HeapSizeClass(size);
+    heap_block_t *block = ptr;
+
+    block->next = heap->free_lists[size_class];
+    heap->free_lists[size_class] = block;
+
+    return true;
+  }
+
+  heap_large_t *large = (heap_large_t *) ((char *) ptr - HEAP_LARGE_HEADER);
+
+  if (large->prev != NULL) large->prev->next = large->next;
+  else heap->large = large->next;
+  if (large->next != NULL) large->next->prev = large->prev;
+
+  heap->reserved -= HEAP_LARGE_HEADER + large->size;
+  free(large);
+
+  return true;
 }
 
 void HeapDispose(Heap *heap) {
-  free(heap->root);
-  free(heap->end);
+  heap_page_t *page = heap->pages;
+  while (page != NULL) {
+    heap_page_t *next = page->next;
+    free(page);
+    page = next;
+  }
+
+  heap_large_t *large = heap->large;
+  while (large != NULL) {
+    heap_large_t *next = large->next;
+    free(large);
+    large = next;
+  }
+
   free(heap);
 }
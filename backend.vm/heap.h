@@ -5,24 +5,66 @@
 #include <stddef.h>
 #include <stdbool.h>
 
-typedef struct mem_info {
-    struct mem_info *next;
+/**
+ * Small blocks are served from HEAP_PAGE_SIZE pages, rounded up
+ * to one of the HEAP_SIZE_CLASSES sizes, freed blocks are kept
+ * on a free list per size class and reused before bumping the
+ * page again. Blocks above HEAP_SMALL_MAX are large objects and
+ * get their own system allocation.
+ */
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define HEAP_SMALL_MAX 2048
+#define HEAP_SIZE_CLASSES 24
+#define HEAP_ALIGNMENT 16
+
+typedef struct heap_block {
+    struct heap_block *next;
+} heap_block_t;
+
+typedef struct heap_page {
+    struct heap_page *next;
+    char *bump;
+    char *end;
+} heap_page_t;
+
+typedef struct heap_large {
+    struct heap_large *prev;
+    struct heap_large *next;
     size_t size;
-    _Bool is_free;
-} mem_info_t;
+} heap_large_t;
 
 typedef struct heap {
-    mem_info_t *root;
-    size_t capacity;
-    char *end;
+    // max bytes taken from the system, 0 for no limit
+    size_t limit;
+    // bytes taken from the system, by pages and large objects
+    size_t reserved;
+    // bytes handed out and not freed yet
+    size_t allocated;
+    // bytes handed out since the heap was created, freed or not,
+    // for the allocation rates
+    size_t allocated_total;
+    // the first page is the one being bump allocated
+    heap_page_t *pages;
+    heap_large_t *large;
+    heap_block_t *free_lists[HEAP_SIZE_CLASSES];
 } Heap;
 
+#define HEAP_ALLOCATE(heap, type, count) \
+    (type*) HeapAlloc(heap, sizeof(type) * (count))
+#define HEAP_GROW_ARRAY(heap, type, ptr, old_count, new_count) \
+    (type*) HeapRealloc(heap, ptr, sizeof(type) * (old_count), \
+        sizeof(type) * (new_count))
+#define HEAP_FREE_ARRAY(heap, type, ptr, count) \
+    HeapFree(heap, ptr, sizeof(type) * (count))
+
 // heap functions>
-Heap *HeapCreate(size_t size);
+Heap *HeapCreate(size_t limit);
 
 void *HeapAlloc(Heap *heap, size_t size);
 
-bool *HeapFree(Heap *heap, void *ptr);
+void *HeapRealloc(Heap *heap, void *ptr, size_t old_size, size_t new_size);
+
+bool HeapFree(Heap *heap, void *ptr, size_t size);
 
 void HeapDispose(Heap *heap);
 
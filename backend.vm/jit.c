@@ -0,0 +1,592 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+
+#ifdef JIT_SUPPORTED
+
+// the x86-64 registers, by their encoding
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+
+#define XMM0 0
+#define XMM1 1
+
+// the registers the native code keeps for the whole chunk
+#define REG_SP RBX
+#define REG_CONSTS R12
+#define REG_GLOBALS R13
+#define REG_FRAME R14
+
+// the high 32 bits of the values, as compared by IS_INT
+#define JIT_TAG_MASK ((uint32_t) ((VALUE_SIGN_BIT | VALUE_QNAN | VALUE_TAG_MASK) >> 32))
+#define JIT_TAG_INT ((uint32_t) (VALUE_TAGGED(VALUE_TAG_INT, 0) >> 32))
+
+// the condition codes of jcc and setcc
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_L 0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G 0xf
+
+typedef struct {
+  uint8_t *bytes;
+  size_t count;
+  size_t capacity;
+  bool failed;
+} JitBuffer;
+
+// emit functions>
+static void JitEmit(JitBuffer *buffer, const uint8_t *bytes, size_t count) {
+  if (buffer->failed) return;
+
+  if (buffer->count + count > buffer->capacity) {
+    size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+    while (capacity < buffer->count + count) capacity *= 2;
+
+    uint8_t *grown = realloc(buffer->bytes, capacity);
+    if (grown == NULL) {
+      buffer->failed = true;
+      return;
+    }
+
+    buffer->bytes = grown;
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->bytes + buffer->count, bytes, count);
+  buffer->count += count;
+}
+
+#define EMIT(buffer, ...) \
+    do { \
+      const uint8_t emitted[] = {__VA_ARGS__}; \
+      JitEmit(buffer, emitted, sizeof(emitted)); \
+    } while (0)
+
+static void JitEmitU32(JitBuffer *buffer, uint32_t value) {
+  EMIT(buffer, value, value >> 8, value >> 16, value >> 24);
+}
+
+static void JitEmitU64(JitBuffer *buffer, uint64_t value) {
+  JitEmitU32(buffer, (uint32_t) value);
+  JitEmitU32(buffer, (uint32_t) (value >> 32));
+}
+
+/**
+ * Emits @param opcode with a [@param base + @param disp] memory
+ * operand and the @param reg register operand, always with a 32 bit
+ * displacement, so r12 and r13 need no special case but the SIB byte
+ *
+ * @param prefix a mandatory prefix, that goes before the REX one, or 0
+ * @param wide sets REX.W, for the 64 bit operations
+ */
+static void JitEmitMemory(JitBuffer *buffer, uint8_t prefix, bool wide, const uint8_t *opcode, size_t opcode_count,
+                          int reg, int base, int32_t disp) {
+  uint8_t rex = 0x40 | (wide ? 0x8 : 0) | (reg & 0x8 ? 0x4 : 0) | (base & 0x8 ? 0x1 : 0);
+
+  if (prefix != 0) EMIT(buffer, prefix);
+  if (rex != 0x40) EMIT(buffer, rex);
+  JitEmit(buffer, opcode, opcode_count);
+  EMIT(buffer, 0x80 | (reg & 0x7) << 3 | (base & 0x7));
+  if ((base & 0x7) == 0x4) EMIT(buffer, 0x24);
+  JitEmitU32(buffer, (uint32_t) disp);
+}
+
+#define EMIT_MEMORY(buffer, prefix, wide, reg, base, disp, ...) \
+    do { \
+      const uint8_t opcode[] = {__VA_ARGS__}; \
+      JitEmitMemory(buffer, prefix, wide, opcode, sizeof(opcode), reg, base, disp); \
+    } while (0)
+
+// mov reg64, [base + disp]
+static void JitLoad(JitBuffer *buffer, int reg, int base, int32_t disp) {
+  EMIT_MEMORY(buffer, 0, true, reg, base, disp, 0x8b);
+}
+
+// mov reg32, [base + disp], the payload of an int
+static void JitLoad32(JitBuffer *buffer, int reg, int base, int32_t disp) {
+  EMIT_MEMORY(buffer, 0, false, reg, base, disp, 0x8b);
+}
+
+// mov [base + disp], reg64
+static void JitStore(JitBuffer *buffer, int reg, int base, int32_t disp) {
+  EMIT_MEMORY(buffer, 0, true, reg, base, disp, 0x89);
+}
+
+// movsd xmm, [base + disp]
+static void JitLoadDouble(JitBuffer *buffer, int xmm, int base, int32_t disp) {
+  EMIT_MEMORY(buffer, 0xf2, false, xmm, base, disp, 0x0f, 0x10);
+}
+
+// movsd [base + disp], xmm
+static void JitStoreDouble(JitBuffer *buffer, int xmm, int base, int32_t disp) {
+  EMIT_MEMORY(buffer, 0xf2, false, xmm, base, disp, 0x0f, 0x11);
+}
+
+// mov reg64, imm64, only used with the low registers
+static void JitLoadImmediate(JitBuffer *buffer, int reg, uint64_t value) {
+  EMIT(buffer, 0x48, 0xb8 + reg);
+  JitEmitU64(buffer, value);
+}
+
+// add or sub rbx, count of value slots
+static void JitMoveStack(JitBuffer *buffer, int slots) {
+  if (slots >= 0) {
+    EMIT(buffer, 0x48, 0x83, 0xc3, (uint8_t) (slots * sizeof(Value)));
+  } else {
+    EMIT(buffer, 0x48, 0x83, 0xeb, (uint8_t) (-slots * sizeof(Value)));
+  }
+}
+
+/**
+ * Emits a jcc, or a jmp when @param cc is negative, to a label that
+ * isn't known yet
+ *
+ * @return the position to give JitPatchJump once the label is reached
+ */
+static size_t JitJump(JitBuffer *buffer, int cc) {
+  if (cc < 0) {
+    EMIT(buffer, 0xe9);
+  } else {
+    EMIT(buffer, 0x0f, 0x80 | cc);
+  }
+
+  JitEmitU32(buffer, 0);
+
+  return buffer->count;
+}
+
+static void JitPatchJump(JitBuffer *buffer, size_t jump) {
+  if (buffer->failed) return;
+
+  uint32_t rel = (uint32_t) (buffer->count - jump);
+  memcpy(buffer->bytes + jump - 4, &rel, sizeof(uint32_t));
+}
+
+/**
+ * Leaves the native code with @param exit, writing the stack top and
+ * @param offset to the frame first
+ */
+static void JitEmitExit(JitBuffer *buffer, JitExit exit, uint32_t offset) {
+  JitStore(buffer, REG_SP, REG_FRAME, offsetof(jit_frame_t, sp));
+  // mov dword [r14 + offset], imm32
+  EMIT_MEMORY(buffer, 0, false, 0, REG_FRAME, offsetof(jit_frame_t, offset), 0xc7);
+  JitEmitU32(buffer, offset);
+  // mov eax, exit
+  EMIT(buffer, 0xb8);
+  JitEmitU32(buffer, exit);
+  // pop r14; pop r13; pop r12; pop rbx; ret
+  EMIT(buffer, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+}
+
+/**
+ * Tags the int in eax, like INT_VALUE, and stores it to the stack
+ * slot at @param disp
+ */
+static void JitStoreInt(JitBuffer *buffer, int32_t disp) {
+  JitLoadImmediate(buffer, RDX, INT_VALUE(0));
+  // mov eax, eax; or rax, rdx
+  EMIT(buffer, 0x89, 0xc0, 0x48, 0x09, 0xd0);
+  JitStore(buffer, RAX, REG_SP, disp);
+}
+
+/**
+ * Reads the stack slot at @param disp into @param xmm like
+ * ValueToNumber: ints are converted, doubles are read as is and
+ * anything else exits with an error at @param offset, like the
+ * generic handlers of the interpreter
+ */
+static void JitLoadNumber(JitBuffer *buffer, int xmm, int32_t disp, uint32_t offset) {
+  JitLoad(buffer, RAX, REG_SP, disp);
+  // mov rdx, rax; shr rdx, 32; and edx, mask; cmp edx, int tag
+  EMIT(buffer, 0x48, 0x89, 0xc2, 0x48, 0xc1, 0xea, 0x20, 0x81, 0xe2);
+  JitEmitU32(buffer, JIT_TAG_MASK);
+  EMIT(buffer, 0x81, 0xfa);
+  JitEmitU32(buffer, JIT_TAG_INT);
+  size_t is_double = JitJump(buffer, CC_NE);
+
+  // cvtsi2sd xmm, eax
+  EMIT(buffer, 0xf2, 0x0f, 0x2a, 0xc0 | xmm << 3);
+  size_t done = JitJump(buffer, -1);
+
+  JitPatchJump(buffer, is_double);
+  // a double has one of the quiet nan bits clear, like IS_DOUBLE:
+  // mov rdx, rax; not rdx; test rdx, rcx
+  JitLoadImmediate(buffer, RCX, VALUE_QNAN);
+  EMIT(buffer, 0x48, 0x89, 0xc2, 0x48, 0xf7, 0xd2, 0x48, 0x85, 0xca);
+  size_t number = JitJump(buffer, CC_NE);
+  JitEmitExit(buffer, kJitExitError, offset);
+  JitPatchJump(buffer, number);
+
+  // movq xmm, rax
+  EMIT(buffer, 0x66, 0x48, 0x0f, 0x6e, 0xc0 | xmm << 3);
+
+  JitPatchJump(buffer, done);
+}
+
+// template functions>
+// the generic and quick arithmetic, on two numbers of any type
+static void JitEmitNumberBinary(JitBuffer *buffer, uint8_t sse_op, uint32_t offset) {
+  JitLoadNumber(buffer, XMM0, -16, offset);
+  JitLoadNumber(buffer, XMM1, -8, offset);
+  // op xmm0, xmm1
+  EMIT(buffer, 0xf2, 0x0f, sse_op, 0xc1);
+  JitStoreDouble(buffer, XMM0, REG_SP, -16);
+  JitMoveStack(buffer, -1);
+}
+
+static void JitEmitDoubleBinary(JitBuffer *buffer, uint8_t sse_op) {
+  JitLoadDouble(buffer, XMM0, REG_SP, -16);
+  EMIT_MEMORY(buffer, 0xf2, false, XMM0, REG_SP, -8, 0x0f, sse_op);
+  JitStoreDouble(buffer, XMM0, REG_SP, -16);
+  JitMoveStack(buffer, -1);
+}
+
+// @param alu_op an "op r/m32, r32" opcode, or 0xaf for imul
+static void JitEmitIntBinary(JitBuffer *buffer, uint8_t alu_op) {
+  JitLoad32(buffer, RAX, REG_SP, -16);
+  JitLoad32(buffer, RCX, REG_SP, -8);
+
+  if (alu_op == 0xaf) {
+    // imul eax, ecx
+    EMIT(buffer, 0x0f, 0xaf, 0xc1);
+  } else {
+    // op eax, ecx
+    EMIT(buffer, alu_op, 0xc8);
+  }
+
+  JitStoreInt(buffer, -16);
+  JitMoveStack(buffer, -1);
+}
+
+static void JitEmitIntCompare(JitBuffer *buffer, int cc) {
+  JitLoad32(buffer, RAX, REG_SP, -16);
+  JitLoad32(buffer, RCX, REG_SP, -8);
+  // cmp eax, ecx; setcc al; movzx eax, al; shl rax, 32
+  EMIT(buffer, 0x39, 0xc8, 0x0f, 0x90 | cc, 0xc0, 0x0f, 0xb6, 0xc0, 0x48, 0xc1, 0xe0, 0x20);
+  // false and true only differ by the low bit of the tag
+  JitLoadImmediate(buffer, RDX, FALSE_VALUE);
+  EMIT(buffer, 0x48, 0x01, 0xd0);
+  JitStore(buffer, RAX, REG_SP, -16);
+  JitMoveStack(buffer, -1);
+}
+
+static void JitEmitIntDiv(JitBuffer *buffer, uint32_t offset) {
+  JitLoad32(buffer, RCX, REG_SP, -8);
+  // test ecx, ecx
+  EMIT(buffer, 0x85, 0xc9);
+  size_t divisor = JitJump(buffer, CC_NE);
+  JitEmitExit(buffer, kJitExitError, offset);
+  JitPatchJump(buffer, divisor);
+
+  JitLoad32(buffer, RAX, REG_SP, -16);
+  // idiv traps on INT32_MIN / -1, IntDiv negates instead
+  EMIT(buffer, 0x83, 0xf9, 0xff);
+  size_t divide = JitJump(buffer, CC_NE);
+  // neg eax
+  EMIT(buffer, 0xf7, 0xd8);
+  size_t done = JitJump(buffer, -1);
+
+  JitPatchJump(buffer, divide);
+  // cdq; idiv ecx
+  EMIT(buffer, 0x99, 0xf7, 0xf9);
+
+  JitPatchJump(buffer, done);
+  JitStoreInt(buffer, -16);
+  JitMoveStack(buffer, -1);
+}
+
+// flips the sign bit of the double in rax and stores it to the top
+static void JitEmitNegateRax(JitBuffer *buffer) {
+  // btc rax, 63
+  EMIT(buffer, 0x48, 0x0f, 0xba, 0xf8, 0x3f);
+  JitStore(buffer, RAX, REG_SP, -8);
+}
+
+static void JitEmitPush(JitBuffer *buffer, int reg) {
+  JitStore(buffer, reg, REG_SP, 0);
+  JitMoveStack(buffer, 1);
+}
+
+/**
+ * Emits the template of @param step, the instruction at @param offset
+ *
+ * @return false when the opcode has no template
+ */
+static bool JitEmitStep(JitBuffer *buffer, instruction_t step, uint32_t offset) {
+  int32_t index = (int32_t) (step.operand * sizeof(Value));
+
+  switch (step.op) {
+    case OP_RET:
+      JitEmitExit(buffer, kJitExitReturn, offset);
+      return true;
+    case OP_CONST:
+    case OP_CONST_WIDE16:
+    case OP_CONST_WIDE24:
+      // the strings were loaded before the native code runs
+      JitLoad(buffer, RAX, REG_CONSTS, index);
+      JitEmitPush(buffer, RAX);
+      return true;
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT_WIDE16:
+    case OP_GET_GLOBAL_SLOT_WIDE24: {
+      JitLoad(buffer, RAX, REG_GLOBALS, index);
+      JitLoadImmediate(buffer, RDX, UNDEFINED_VALUE);
+      // cmp rax, rdx
+      EMIT(buffer, 0x48, 0x39, 0xd0);
+      size_t defined = JitJump(buffer, CC_NE);
+      JitEmitExit(buffer, kJitExitNullPointer, offset);
+      JitPatchJump(buffer, defined);
+
+      JitEmitPush(buffer, RAX);
+      return true;
+    }
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_WIDE16:
+    case OP_SET_GLOBAL_SLOT_WIDE24:
+      JitLoad(buffer, RAX, REG_SP, -8);
+      JitStore(buffer, RAX, REG_GLOBALS, index);
+      JitMoveStack(buffer, -1);
+      return true;
+    case OP_TRUE:
+    case OP_FALSE:
+      JitLoadImmediate(buffer, RAX, step.op == OP_TRUE ? TRUE_VALUE : FALSE_VALUE);
+      JitEmitPush(buffer, RAX);
+      return true;
+    case OP_NOT: {
+      JitLoad(buffer, RAX, REG_SP, -8);
+      JitLoadImmediate(buffer, RDX, TRUE_VALUE);
+      // false and true only differ by the low bit of the tag, like
+      // IS_BOOL: mov rcx, rax; bts rcx, 32; cmp rcx, rdx
+      EMIT(buffer, 0x48, 0x89, 0xc1, 0x48, 0x0f, 0xba, 0xe9, VALUE_TAG_SHIFT, 0x48, 0x39, 0xd1);
+      size_t is_bool = JitJump(buffer, CC_E);
+      JitEmitExit(buffer, kJitExitError, offset);
+      JitPatchJump(buffer, is_bool);
+
+      // cmp rax, rdx; setne al; movzx eax, al; shl rax, 32
+      EMIT(buffer, 0x48, 0x39, 0xd0, 0x0f, 0x95, 0xc0, 0x0f, 0xb6, 0xc0, 0x48, 0xc1, 0xe0, 0x20);
+      JitLoadImmediate(buffer, RDX, FALSE_VALUE);
+      EMIT(buffer, 0x48, 0x01, 0xd0);
+      JitStore(buffer, RAX, REG_SP, -8);
+      return true;
+    }
+    case OP_POP:
+      JitMoveStack(buffer, -1);
+      return true;
+    // the quick variants compute what the generic ops do, only
+    // the interpreter needs their guards
+    case OP_NEGATE:
+    case OP_NEGATE_QUICK_I32:
+    case OP_NEGATE_QUICK_F64:
+      JitLoadNumber(buffer, XMM0, -8, offset);
+      // movq rax, xmm0
+      EMIT(buffer, 0x66, 0x48, 0x0f, 0x7e, 0xc0);
+      JitEmitNegateRax(buffer);
+      return true;
+    case OP_SUM:
+    case OP_SUM_QUICK_I32:
+    case OP_SUM_QUICK_F64:
+      JitEmitNumberBinary(buffer, 0x58, offset);
+      return true;
+    case OP_SUB:
+    case OP_SUB_QUICK_I32:
+    case OP_SUB_QUICK_F64:
+      JitEmitNumberBinary(buffer, 0x5c, offset);
+      return true;
+    case OP_MULT:
+    case OP_MULT_QUICK_I32:
+    case OP_MULT_QUICK_F64:
+      JitEmitNumberBinary(buffer, 0x59, offset);
+      return true;
+    case OP_DIV:
+    case OP_DIV_QUICK_I32:
+    case OP_DIV_QUICK_F64:
+      JitEmitNumberBinary(buffer, 0x5e, offset);
+      return true;
+    case OP_SUM_I32:
+      // add
+      JitEmitIntBinary(buffer, 0x01);
+      return true;
+    case OP_SUB_I32:
+      // sub
+      JitEmitIntBinary(buffer, 0x29);
+      return true;
+    case OP_MULT_I32:
+      JitEmitIntBinary(buffer, 0xaf);
+      return true;
+    case OP_DIV_I32:
+      JitEmitIntDiv(buffer, offset);
+      return true;
+    case OP_NEGATE_I32:
+      JitLoad32(buffer, RAX, REG_SP, -8);
+      // neg eax
+      EMIT(buffer, 0xf7, 0xd8);
+      JitStoreInt(buffer, -8);
+      return true;
+    case OP_LESS_I32:
+      JitEmitIntCompare(buffer, CC_L);
+      return true;
+    case OP_LESS_EQUAL_I32:
+      JitEmitIntCompare(buffer, CC_LE);
+      return true;
+    case OP_GREATER_I32:
+      JitEmitIntCompare(buffer, CC_G);
+      return true;
+    case OP_GREATER_EQUAL_I32:
+      JitEmitIntCompare(buffer, CC_GE);
+      return true;
+    case OP_EQUAL_I32:
+      JitEmitIntCompare(buffer, CC_E);
+      return true;
+    case OP_NOT_EQUAL_I32:
+      JitEmitIntCompare(buffer, CC_NE);
+      return true;
+    case OP_I32_TO_F64:
+      JitLoad32(buffer, RAX, REG_SP, -8);
+      // cvtsi2sd xmm0, eax
+      EMIT(buffer, 0xf2, 0x0f, 0x2a, 0xc0);
+      JitStoreDouble(buffer, XMM0, REG_SP, -8);
+      return true;
+    case OP_SUM_F64:
+      JitEmitDoubleBinary(buffer, 0x58);
+      return true;
+    case OP_SUB_F64:
+      JitEmitDoubleBinary(buffer, 0x5c);
+      return true;
+    case OP_MULT_F64:
+      JitEmitDoubleBinary(buffer, 0x59);
+      return true;
+    case OP_DIV_F64:
+      JitEmitDoubleBinary(buffer, 0x5e);
+      return true;
+    case OP_NEGATE_F64:
+      JitLoad(buffer, RAX, REG_SP, -8);
+      JitEmitNegateRax(buffer);
+      return true;
+    default:
+      // the string and name based opcodes allocate or call into
+      // the tables, they're left to the interpreter
+      return false;
+  }
+}
+
+// jit functions>
+/**
+ * Translates the verified stack @param chunk, the instructions after
+ * the first one without a template aren't translated, the native
+ * code bails out to the interpreter there
+ *
+ * @return the native code, or NULL when it can't be built
+ */
+jit_code_t *JitCompile(Chunk *chunk) {
+  if (!chunk->verified || chunk->registers) return NULL;
+
+  JitBuffer buffer = {NULL, 0, 0, false};
+  int compiled = 0;
+
+  // push rbx; push r12; push r13; push r14; mov r14, rdi
+  EMIT(&buffer, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x49, 0x89, 0xfe);
+  JitLoad(&buffer, REG_SP, REG_FRAME, offsetof(jit_frame_t, sp));
+  JitLoad(&buffer, REG_CONSTS, REG_FRAME, offsetof(jit_frame_t, consts));
+  JitLoad(&buffer, REG_GLOBALS, REG_FRAME, offsetof(jit_frame_t, globals));
+
+  for (int i = 0; i < chunk->count;) {
+    instruction_t steps[INSTRUCTION_MAX_STEPS];
+    int step_count = InstructionExpand(chunk->code + i, steps);
+    size_t start = buffer.count;
+    bool translated = true;
+
+    // a superinstruction is translated as the opcodes it stands for
+    for (int step = 0; step < step_count && translated; step++) {
+      translated = JitEmitStep(&buffer, steps[step], (uint32_t) i);
+    }
+
+    if (!translated) {
+      // no step of the instruction may run before the bailout
+      buffer.count = start;
+      JitEmitExit(&buffer, kJitExitBailout, (uint32_t) i);
+      break;
+    }
+
+    compiled++;
+    if (chunk->code[i] == OP_RET) break;
+
+    i += 1 + OpcodeOperands((Opcode) chunk->code[i]);
+  }
+
+  if (buffer.failed) {
+    free(buffer.bytes);
+    return NULL;
+  }
+
+  jit_code_t *jit = malloc(sizeof(jit_code_t));
+  void *code = mmap(NULL, buffer.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (jit == NULL || code == MAP_FAILED) {
+    free(jit);
+    free(buffer.bytes);
+    if (code != MAP_FAILED) munmap(code, buffer.count);
+    return NULL;
+  }
+
+  memcpy(code, buffer.bytes, buffer.count);
+  free(buffer.bytes);
+
+  // never writable and executable at once
+  if (mprotect(code, buffer.count, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, buffer.count);
+    free(jit);
+    return NULL;
+  }
+
+  jit->code = code;
+  jit->size = buffer.count;
+  jit->compiled = compiled;
+
+  return jit;
+}
+
+JitExit JitRun(jit_code_t *jit, jit_frame_t *frame) {
+  JitExit (*entry)(jit_frame_t *);
+
+  // data to function pointer, the mapping is executable
+  memcpy(&entry, &jit->code, sizeof(entry));
+
+  return entry(frame);
+}
+
+void JitDispose(jit_code_t *jit) {
+  if (jit == NULL) return;
+
+  munmap(jit->code, jit->size);
+  free(jit);
+}
+
+#else
+
+jit_code_t *JitCompile(Chunk *chunk) {
+  (void) chunk;
+  return NULL;
+}
+
+JitExit JitRun(jit_code_t *jit, jit_frame_t *frame) {
+  (void) jit;
+  (void) frame;
+  return kJitExitError;
+}
+
+void JitDispose(jit_code_t *jit) {
+  (void) jit;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef RUNTIME_JIT_H
+#define RUNTIME_JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "value.h"
+
+/**
+ * The baseline jit translates a verified stack chunk to x86-64, one
+ * template per opcode: the value stack stays in Stack.values, with
+ * its top in a register, and the constants and global slots are read
+ * in place. The opcodes that allocate or look names up have no
+ * template, the native code exits before them and the interpreter
+ * runs the rest of the chunk.
+ *
+ * On other hosts JitCompile always fails and the chunks are
+ * interpreted.
+ */
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#endif
+
+typedef enum {
+  kJitExitReturn,
+  // the instruction at offset has no template
+  kJitExitBailout,
+  kJitExitError,
+  kJitExitNullPointer,
+} JitExit;
+
+/**
+ * Passed to the native code, that writes the stack top and the
+ * offset of the instruction it stopped at back
+ */
+typedef struct jit_frame {
+  Value *sp;
+  Value *consts;
+  Value *globals;
+  uint32_t offset;
+} jit_frame_t;
+
+typedef struct jit_code {
+  uint8_t *code;
+  size_t size;
+  // count of opcodes translated before the first bailout
+  int compiled;
+} jit_code_t;
+
+// jit functions>
+jit_code_t *JitCompile(Chunk *chunk);
+
+JitExit JitRun(jit_code_t *jit, jit_frame_t *frame);
+
+void JitDispose(jit_code_t *jit);
+
+#endif //RUNTIME_JIT_H
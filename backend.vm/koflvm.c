@@ -0,0 +1,295 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "koflvm.h"
+#include "bytecode.h"
+#include "scheduler.h"
+#include "verifier.h"
+#include "vm.h"
+
+/**
+ * The chunk is loaded outside of any vm heap and is only read by the
+ * isolates, through the views of VmEvalShared. Every isolate that ran
+ * it holds a reference, so it outlives them
+ */
+struct kofl_chunk {
+  Chunk *chunk;
+  atomic_int references;
+};
+
+// the chunks an isolate or a scheduler holds a reference to
+typedef struct {
+  KoflChunk **chunks;
+  int count;
+  int capacity;
+} KoflChunks;
+
+struct kofl_isolate {
+  Vm *vm;
+  KoflChunks held;
+};
+
+struct kofl_scheduler {
+  Scheduler *scheduler;
+  KoflChunks held;
+};
+
+static KoflStatus KoflStatusOf(InterpretResult result) {
+  switch (result) {
+    case kResultOK: return kKoflOK;
+    case kResultNullPointer: return kKoflNullPointer;
+    case kResultOutOfMemory: return kKoflOutOfMemory;
+    default: return kKoflError;
+  }
+}
+
+static Flags KoflFlagsOf(const KoflIsolateOptions *options) {
+  KoflIsolateOptions defaults = {0};
+  if (options == NULL) options = &defaults;
+
+  return (Flags) {
+      .memory = options->memory,
+      .jit = options->jit,
+      .jit_threshold = options->jit_threshold,
+  };
+}
+
+/**
+ * Takes a reference to @param chunk, unless @param held has one
+ */
+static KoflStatus KoflHold(KoflChunks *held, KoflChunk *chunk) {
+  for (int i = 0; i < held->count; i++) {
+    if (held->chunks[i] == chunk) return kKoflOK;
+  }
+
+  if (held->count >= held->capacity) {
+    int capacity = held->capacity < 8 ? 8 : held->capacity * 2;
+    KoflChunk **chunks = realloc(held->chunks, capacity * sizeof(KoflChunk *));
+    if (chunks == NULL) return kKoflOutOfMemory;
+
+    held->chunks = chunks;
+    held->capacity = capacity;
+  }
+
+  KoflChunkRetain(chunk);
+  held->chunks[held->count++] = chunk;
+
+  return kKoflOK;
+}
+
+static void KoflReleaseAll(KoflChunks *held) {
+  for (int i = 0; i < held->count; i++) {
+    KoflChunkRelease(held->chunks[i]);
+  }
+
+  free(held->chunks);
+}
+
+// api functions>
+int KoflApiVersion(void) {
+  return KOFLVM_API_VERSION;
+}
+
+const char *KoflStatusName(KoflStatus status) {
+  switch (status) {
+    case kKoflOK: return "ok";
+    case kKoflError: return "runtime error";
+    case kKoflNullPointer: return "null pointer";
+    case kKoflOutOfMemory: return "out of memory";
+    case kKoflBadBytecode: return "bad bytecode";
+    case kKoflRejected: return "rejected by the verifier";
+    default: return "unknown";
+  }
+}
+
+/**
+ * Loads and verifies the compiled file at @param path
+ *
+ * @param chunk receives the chunk, with one reference held by the caller
+ */
+KoflStatus KoflChunkLoad(const char *path, KoflChunk **chunk) {
+  Chunk *loaded;
+  BytecodeStatus status = BytecodeLoad(NULL, path, &loaded);
+  if (status == kBytecodeOutOfMemory) return kKoflOutOfMemory;
+  if (status != kBytecodeOK) return kKoflBadBytecode;
+
+  // the only write to the chunk, before it's shared
+  int offset;
+  if (ChunkVerify(loaded, &offset) != kVerifyOK) {
+    ChunkDispose(loaded);
+    return kKoflRejected;
+  }
+
+  KoflChunk *result = malloc(sizeof(KoflChunk));
+  if (result == NULL) {
+    ChunkDispose(loaded);
+    return kKoflOutOfMemory;
+  }
+
+  result->chunk = loaded;
+  atomic_init(&result->references, 1);
+
+  *chunk = result;
+
+  return kKoflOK;
+}
+
+void KoflChunkRetain(KoflChunk *chunk) {
+  atomic_fetch_add_explicit(&chunk->references, 1, memory_order_relaxed);
+}
+
+/**
+ * Drops a reference to @param chunk, it's disposed with the last one
+ */
+void KoflChunkRelease(KoflChunk *chunk) {
+  if (atomic_fetch_sub_explicit(&chunk->references, 1, memory_order_acq_rel) != 1) return;
+
+  ChunkDispose(chunk->chunk);
+  free(chunk);
+}
+
+/**
+ * @param options NULL for an unlimited heap and no jit
+ * @return the isolate or NULL when out of memory
+ */
+KoflIsolate *KoflIsolateCreate(const KoflIsolateOptions *options) {
+  KoflIsolate *isolate = malloc(sizeof(KoflIsolate));
+  if (isolate == NULL) return NULL;
+
+  isolate->vm = VmCreate(KoflFlagsOf(options));
+  isolate->held = (KoflChunks) {NULL, 0, 0};
+
+  if (isolate->vm == NULL) {
+    free(isolate);
+    return NULL;
+  }
+
+  return isolate;
+}
+
+/**
+ * Runs @param chunk in @param isolate, the globals it defines stay in
+ * the isolate for the next chunks
+ */
+KoflStatus KoflIsolateEval(KoflIsolate *isolate, KoflChunk *chunk) {
+  KoflStatus status = KoflHold(&isolate->held, chunk);
+  if (status != kKoflOK) return status;
+
+  return KoflStatusOf(VmEvalShared(isolate->vm, chunk->chunk));
+}
+
+/**
+ * Reads the global @param name of @param isolate
+ *
+ * @return false when it isn't defined
+ */
+bool KoflIsolateGlobal(KoflIsolate *isolate, const char *name, KoflValue *value) {
+  Vm *vm = isolate->vm;
+  size_t length = strlen(name);
+
+  string_t *key = table_find_string(vm->strings, name, length, StringHash(name, length));
+  Value slot;
+  if (key == NULL || !table_get(vm->globals, OBJ_VALUE(key), &slot)) return false;
+
+  Value global = vm->global_values->values[AS_INT(slot)];
+
+  if (IS_UNDEFINED(global)) return false;
+
+  if (IS_NIL(global)) {
+    *value = (KoflValue) {.type = kKoflNil};
+  } else if (IS_BOOL(global)) {
+    *value = (KoflValue) {.type = kKoflBool, .as_bool = AS_BOOL(global)};
+  } else if (IS_INT(global)) {
+    *value = (KoflValue) {.type = kKoflInt, .as_int = AS_INT(global)};
+  } else if (IS_DOUBLE(global)) {
+    *value = (KoflValue) {.type = kKoflDouble, .as_double = AS_DOUBLE(global)};
+  } else if (IS_STR_OR_ROPE(global)) {
+    // the global is a root, so the rope can be flattened
+    string_t *string = VmFlatten(vm, global);
+    if (string == NULL) return false;
+
+    *value = (KoflValue) {.type = kKoflString, .as_string = string->values};
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+void KoflIsolateDispose(KoflIsolate *isolate) {
+  // the views of the chunks go first, they read the lines of them
+  VmDispose(isolate->vm);
+  KoflReleaseAll(&isolate->held);
+  free(isolate);
+}
+
+/**
+ * @param workers the count of threads that run the fibers
+ * @param options the options of the vms of the fibers, NULL for an
+ * unlimited heap and no jit
+ * @return the scheduler or NULL when out of memory
+ */
+KoflScheduler *KoflSchedulerCreate(int workers, const KoflIsolateOptions *options) {
+  KoflScheduler *scheduler = malloc(sizeof(KoflScheduler));
+  if (scheduler == NULL) return NULL;
+
+  scheduler->scheduler = SchedulerCreate(KoflFlagsOf(options), workers);
+  scheduler->held = (KoflChunks) {NULL, 0, 0};
+
+  if (scheduler->scheduler == NULL) {
+    free(scheduler);
+    return NULL;
+  }
+
+  return scheduler;
+}
+
+/**
+ * Makes @param chunk spawnable as @param name, by the embedder and
+ * by the fibers. Not while the scheduler runs
+ *
+ * @return kKoflError when the name is taken
+ */
+KoflStatus KoflSchedulerRegister(KoflScheduler *scheduler, const char *name, KoflChunk *chunk) {
+  KoflStatus status = KoflHold(&scheduler->held, chunk);
+  if (status != kKoflOK) return status;
+
+  return SchedulerRegister(scheduler->scheduler, name, chunk->chunk) ? kKoflOK : kKoflError;
+}
+
+/**
+ * Creates a fiber of the chunk registered as @param name, it runs
+ * with the next KoflSchedulerRun. Not while the scheduler runs
+ *
+ * @param fiber receives the id of the fiber
+ * @return kKoflError when no chunk is registered as @param name
+ */
+KoflStatus KoflSchedulerSpawn(KoflScheduler *scheduler, const char *name, int32_t *fiber) {
+  return KoflStatusOf(SchedulerSpawn(scheduler->scheduler, name, strlen(name), fiber));
+}
+
+/**
+ * Runs the fibers on the worker threads, the calling thread being
+ * one of them, until they are all done
+ */
+void KoflSchedulerRun(KoflScheduler *scheduler) {
+  SchedulerRun(scheduler->scheduler);
+}
+
+/**
+ * @return how the fiber @param fiber ended, kKoflError when it
+ * didn't run yet
+ */
+KoflStatus KoflSchedulerFiberStatus(KoflScheduler *scheduler, int32_t fiber) {
+  InterpretResult result;
+  if (!SchedulerResult(scheduler->scheduler, fiber, &result)) return kKoflError;
+
+  return KoflStatusOf(result);
+}
+
+void KoflSchedulerDispose(KoflScheduler *scheduler) {
+  SchedulerDispose(scheduler->scheduler);
+  KoflReleaseAll(&scheduler->held);
+  free(scheduler);
+}
@@ -0,0 +1,112 @@
+#ifndef KOFLVM_H
+#define KOFLVM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The embedding api of libkoflvm, the only header an embedder
+ * includes. A KoflChunk is a compiled file, loaded and verified once
+ * and never written after, so any number of isolates may run it at
+ * the same time. A KoflIsolate is a vm with its own stack, heap and
+ * globals: an isolate must only be used by one thread at a time, and
+ * isolates share nothing, so each thread can run its own.
+ *
+ * A KoflScheduler runs many chunks at once on a pool of threads, as
+ * fibers: the chunks are registered under a name, and each fiber runs
+ * one in a vm of its own. A fiber spawns others, awaits them and
+ * yields with the OP_SPAWN, OP_AWAIT and OP_YIELD opcodes.
+ *
+ * The api only grows, KOFLVM_API_VERSION is bumped when it does.
+ */
+#define KOFLVM_API_VERSION 2
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KOFLVM_API __attribute__((visibility("default")))
+#else
+#define KOFLVM_API
+#endif
+
+typedef struct kofl_chunk KoflChunk;
+typedef struct kofl_isolate KoflIsolate;
+typedef struct kofl_scheduler KoflScheduler;
+
+typedef enum {
+  kKoflOK,
+  kKoflError,
+  kKoflNullPointer,
+  kKoflOutOfMemory,
+  // the file can't be read or isn't compiled bytecode of this version
+  kKoflBadBytecode,
+  // the verifier rejected the code
+  kKoflRejected,
+} KoflStatus;
+
+typedef struct {
+  // max bytes of the isolate heap, 0 for no limit
+  size_t memory;
+  // compile the chunks run jit_threshold times to native code
+  bool jit;
+  int jit_threshold;
+} KoflIsolateOptions;
+
+typedef enum {
+  kKoflNil,
+  kKoflBool,
+  kKoflInt,
+  kKoflDouble,
+  kKoflString,
+} KoflType;
+
+typedef struct {
+  KoflType type;
+  union {
+    bool as_bool;
+    int32_t as_int;
+    double as_double;
+    // owned by the isolate, valid until it runs again
+    const char *as_string;
+  };
+} KoflValue;
+
+// api functions>
+KOFLVM_API int KoflApiVersion(void);
+
+KOFLVM_API const char *KoflStatusName(KoflStatus status);
+
+KOFLVM_API KoflStatus KoflChunkLoad(const char *path, KoflChunk **chunk);
+
+KOFLVM_API void KoflChunkRetain(KoflChunk *chunk);
+
+KOFLVM_API void KoflChunkRelease(KoflChunk *chunk);
+
+KOFLVM_API KoflIsolate *KoflIsolateCreate(const KoflIsolateOptions *options);
+
+KOFLVM_API KoflStatus KoflIsolateEval(KoflIsolate *isolate, KoflChunk *chunk);
+
+KOFLVM_API bool KoflIsolateGlobal(KoflIsolate *isolate, const char *name, KoflValue *value);
+
+KOFLVM_API void KoflIsolateDispose(KoflIsolate *isolate);
+
+KOFLVM_API KoflScheduler *KoflSchedulerCreate(int workers, const KoflIsolateOptions *options);
+
+KOFLVM_API KoflStatus KoflSchedulerRegister(KoflScheduler *scheduler, const char *name, KoflChunk *chunk);
+
+KOFLVM_API KoflStatus KoflSchedulerSpawn(KoflScheduler *scheduler, const char *name, int32_t *fiber);
+
+KOFLVM_API void KoflSchedulerRun(KoflScheduler *scheduler);
+
+KOFLVM_API KoflStatus KoflSchedulerFiberStatus(KoflScheduler *scheduler, int32_t fiber);
+
+KOFLVM_API void KoflSchedulerDispose(KoflScheduler *scheduler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //KOFLVM_H
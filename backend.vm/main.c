@@ -6,9 +6,10 @@
 #include "vm.h"
 #include "bytecode.h"
 #include "debug.h"
+#include "verifier.h"
 
 int PrintHelp() {
-  printf("Usage: koflvm <file> [--verbose] [--memory <memory>]\n");
+  printf("Usage: koflvm <file> [--verbose] [--trace] [--disassemble] [--memory <megabytes>] [--gc-stress] [--jit] [--jit-threshold <evals>] [--jit-check] [--profile] [--profile-hz <rate>] [--profile-folded <path>] [--profile-generate <path>]\n");
 
   return EXIT_FAILURE;
 }
@@ -25,6 +26,14 @@ char *GetArg(char *arg_name, int argc, char **argv) {
   return NULL;
 }
 
+bool HasArg(char *arg_name, int argc, char **argv) {
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(arg_name, argv[i]) == 0) return true;
+  }
+
+  return false;
+}
+
 char *GetArgOr(char *arg_name, char *def, int argc, char **argv) {
   char *arg = GetArg(arg_name, argc, argv);
 
@@ -33,23 +42,6 @@ char *GetArgOr(char *arg_name, char *def, int argc, char **argv) {
   return arg;
 }
 
-char *ReadFile(char *file_path) {
-  FILE *file = fopen(file_path, "rb");
-
-  if (file == NULL) return NULL;
-
-  fseek(file, 0, SEEK_END);
-  long len = ftell(file);
-  rewind(file);
-
-  char *buffer = malloc(len * sizeof(char));
-
-  fread(buffer, len, 1, file);
-  fclose(file);
-
-  return buffer;
-}
-
 int main(int argc, char **argv) {
   if (argc < 1) return PrintHelp();
 
@@ -57,36 +49,99 @@ int main(int argc, char **argv) {
 
   if (file_path == NULL) return PrintHelp();
 
-  bool verbose = GetArg("--verbose", argc, argv) != NULL;
-  bool disassemble = GetArg("--disassemble", argc, argv) != NULL;
-  size_t memory = atol(GetArgOr("--memory", "512", argc, argv));
+  bool verbose = HasArg("--verbose", argc, argv);
+  bool disassemble = HasArg("--disassemble", argc, argv);
+  bool trace = HasArg("--trace", argc, argv);
+  bool gc_stress = HasArg("--gc-stress", argc, argv);
+  bool jit_check = HasArg("--jit-check", argc, argv);
+  bool jit = jit_check || HasArg("--jit", argc, argv);
+  int jit_threshold = atoi(GetArgOr("--jit-threshold", "1", argc, argv));
+  bool profile = HasArg("--profile", argc, argv);
+  char *profile_generate = GetArg("--profile-generate", argc, argv);
+  int profile_hz = atoi(GetArgOr("--profile-hz", "1000", argc, argv));
+  // 0 means the heap can grow without limit
+  size_t memory = (size_t) atol(GetArgOr("--memory", "512", argc, argv)) * 1024 * 1024;
 
   Flags flags = {
       .memory = memory,
-      .verbose = verbose
+      .verbose = verbose,
+      .trace = trace,
+      .gc_stress = gc_stress,
+      .jit = jit,
+      .jit_threshold = jit_threshold,
+      .jit_check = jit_check,
+      .profile = profile || profile_generate != NULL,
+      .profile_hz = profile_hz
   };
 
-  char *bytes = ReadFile(file_path);
-  if (bytes == NULL) {
-    printf("Failed to read file %s\n", file_path);
-    return EXIT_FAILURE;
-  }
+  Vm *vm = VmCreate(flags);
 
-  Chunk *bytecode = ParseChunk(bytes);
-  if (bytecode == NULL) {
-    printf("Failed to read bytecode\n");
+  Chunk *bytecode = NULL;
+  BytecodeStatus status = BytecodeLoad(vm->heap, file_path, &bytecode);
+  if (status != kBytecodeOK) {
+    printf("Failed to load %s: %s\n", file_path, BytecodeStatusName(status));
 
+    VmDispose(vm);
     return EXIT_FAILURE;
   }
-  free(bytes);
 
   printf("Kofl vm\n\n");
 
+  if (verbose) {
+    printf("Pool: %d consts, %d globals, %u strings (%u bytes)\n",
+           bytecode->consts->count, bytecode->globals->count, bytecode->string_count, bytecode->strings_size);
+  }
+
   if (disassemble) {
     ChunkDisassemble(bytecode);
   }
 
-  Vm *vm = VmCreate(flags);
-  VmEval(vm, bytecode);
+  int offset;
+  VerifyResult verified = ChunkVerify(bytecode, &offset);
+  if (verified != kVerifyOK) {
+    printf("Rejected %s at offset %d: %s\n", file_path, offset, VerifyResultName(verified));
+
+    ChunkDispose(bytecode);
+    VmDispose(vm);
+    return EXIT_FAILURE;
+  }
+
+  InterpretResult result = VmEval(vm, bytecode);
+
+  if (verbose) {
+    printf("Heap: %zu bytes allocated, %zu bytes reserved\n", vm->heap->allocated, vm->heap->reserved);
+  }
+
+  // the samples point into the chunk, it's reported before disposing
+  if (vm->profiler != NULL && profile_generate != NULL && !ProfilerWriteFeedback(vm->profiler, profile_generate)) {
+    printf("Failed to write the profile to %s\n", profile_generate);
+  }
+
+  if (vm->profiler != NULL && profile) {
+    char default_folded[1024];
+    snprintf(default_folded, sizeof(default_folded), "%s.folded", file_path);
+    char *folded = GetArgOr("--profile-folded", default_folded, argc, argv);
+
+    ProfilerReport(vm->profiler, stdout);
+
+    if (!ProfilerWriteFolded(vm->profiler, file_path, folded)) {
+      printf("Failed to write the folded stacks to %s\n", folded);
+    }
+  }
+
+  ChunkDispose(bytecode);
   VmDispose(vm);
+
+  switch (result) {
+    case kResultOK: return EXIT_SUCCESS;
+    case kResultOutOfMemory:
+      printf("Out of memory\n");
+      return EXIT_FAILURE;
+    case kResultNullPointer:
+      printf("Null pointer\n");
+      return EXIT_FAILURE;
+    default:
+      printf("Runtime error\n");
+      return EXIT_FAILURE;
+  }
 }
\ No newline at end of file
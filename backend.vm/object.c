@@ -1,3 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include "object.h"
 
+// string functions>
+/**
+ * Implements the FNV-1a hash algorithm
+ * @a http://www.isthe.com/chongo/tech/comp/fnv
+ * @param key the string key
+ * @param length the length of string
+ * @return the hash of string
+ */
+uint32_t StringHash(const char *key, size_t length) {
+  uint32_t hash = 2166136261u;
+  uint32_t FNV_prime = 16777619;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t) key[i];
+    hash *= FNV_prime;
+  }
+
+  return hash;
+}
+
+/**
+ * @return the string or NULL when @param heap is out of memory
+ */
+string_t *StringCreate(Heap *heap, char *values, size_t length, uint32_t hash) {
+  string_t *string = HEAP_ALLOCATE(heap, string_t, 1);
+  if (string == NULL) return NULL;
+
+  string->holder.type = OBJ_T_STR;
+  string->holder.marked = false;
+  string->holder.next = NULL;
+  string->values = values;
+  string->length = length;
+  string->hash = hash;
+
+  return string;
+}
+
+/**
+ * Copies @param values into the string block itself
+ *
+ * @param length at most STRING_INLINE_MAX
+ * @return the string or NULL when @param heap is out of memory
+ */
+string_t *StringCreateInline(Heap *heap, const char *values, size_t length, uint32_t hash) {
+  string_t *string = HeapAlloc(heap, sizeof(string_t) + length + 1);
+  if (string == NULL) return NULL;
+
+  memcpy(string->inline_values, values, length);
+  string->inline_values[length] = '\0';
+
+  string->holder.type = OBJ_T_STR;
+  string->holder.marked = false;
+  string->holder.next = NULL;
+  string->values = string->inline_values;
+  string->length = length;
+  string->hash = hash;
+
+  return string;
+}
+
+/**
+ * @param object a string or a rope
+ */
+size_t StringLength(Object *object) {
+  if (object->type == OBJ_T_ROPE) return ((rope_t *) object)->length;
+
+  return ((string_t *) object)->length;
+}
+
+void StringDispose(Heap *heap, string_t *string) {
+  if (string->values == string->inline_values) {
+    HeapFree(heap, string, sizeof(string_t) + string->length + 1);
+    return;
+  }
+
+  HeapFree(heap, string->values, string->length + 1);
+  HEAP_FREE_ARRAY(heap, string_t, string, 1);
+}
+
+// rope functions>
+/**
+ * Flattened ropes are replaced by their string, so the rope
+ * nodes of a flattened rope can be collected
+ *
+ * @param left a string or a rope
+ * @param right a string or a rope
+ * @return the rope or NULL when @param heap is out of memory
+ */
+rope_t *RopeCreate(Heap *heap, Object *left, Object *right) {
+  rope_t *rope = HEAP_ALLOCATE(heap, rope_t, 1);
+  if (rope == NULL) return NULL;
+
+  if (left->type == OBJ_T_ROPE && ((rope_t *) left)->flat != NULL) left = (Object *) ((rope_t *) left)->flat;
+  if (right->type == OBJ_T_ROPE && ((rope_t *) right)->flat != NULL) right = (Object *) ((rope_t *) right)->flat;
+
+  rope->holder.type = OBJ_T_ROPE;
+  rope->holder.marked = false;
+  rope->holder.next = NULL;
+  rope->length = StringLength(left) + StringLength(right);
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+
+  return rope;
+}
+
+/**
+ * Writes the characters of @param rope to @param buffer, that must
+ * have length + 1 bytes. The nodes are walked with an explicit stack,
+ * the ropes built in a loop are as deep as the number of iterations
+ *
+ * @return false when the walk stack couldn't be allocated
+ */
+bool RopeCopy(rope_t *rope, char *buffer) {
+  size_t capacity = 64;
+  size_t count = 0;
+  Object **pending = malloc(sizeof(Object *) * capacity);
+  if (pending == NULL) return false;
+
+  char *end = buffer;
+  pending[count++] = (Object *) rope;
+
+  while (count > 0) {
+    Object *object = pending[--count];
+
+    if (object->type == OBJ_T_ROPE && ((rope_t *) object)->flat != NULL) {
+      object = (Object *) ((rope_t *) object)->flat;
+    }
+
+    if (object->type == OBJ_T_STR) {
+      string_t *string = (string_t *) object;
+
+      memcpy(end, string->values, string->length);
+      end += string->length;
+      continue;
+    }
+
+    if (count + 2 > capacity) {
+      Object **grown = realloc(pending, sizeof(Object *) * capacity * 2);
+      if (grown == NULL) {
+        free(pending);
+        return false;
+      }
+
+      pending = grown;
+      capacity *= 2;
+    }
+
+    // the left node is on top, so it's written first
+    pending[count++] = ((rope_t *) object)->right;
+    pending[count++] = ((rope_t *) object)->left;
+  }
+
+  *end = '\0';
+  free(pending);
 
+  return true;
+}
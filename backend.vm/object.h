@@ -1,20 +1,72 @@
 #ifndef RUNTIME_OBJECT_H
 #define RUNTIME_OBJECT_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "heap.h"
 
 typedef enum object_type {
     OBJ_T_STR,
+    OBJ_T_ROPE,
 } ObjectType;
 
-typedef struct {
+typedef struct object {
+    ObjectType type;
+    // set by the collector on the reachable objects
+    bool marked;
     struct object* next;
 } Object;
 
+/**
+ * Strings up to this length keep their characters in the same
+ * block as the string_t, which then fits a 64 byte size class
+ */
+#define STRING_INLINE_MAX 23
+
+/**
+ * Strings are immutable once created, so their hash is
+ * computed a single time and reused by every table lookup
+ */
 typedef struct string {
     Object holder;
     size_t length;
+    uint32_t hash;
+    // points to inline_values for the inline strings
     char *values;
+    char inline_values[];
 } string_t;
 
+/**
+ * The result of concatenating long strings: it only references
+ * the operands, and is flattened into an interned string the
+ * first time its characters are needed, so building a string
+ * piece by piece copies every character once
+ */
+typedef struct rope {
+    Object holder;
+    size_t length;
+    // both are strings or ropes, and NULL once it's flattened
+    Object *left;
+    Object *right;
+    string_t *flat;
+} rope_t;
+
+// string functions>
+uint32_t StringHash(const char *key, size_t length);
+
+string_t *StringCreate(Heap *heap, char *values, size_t length, uint32_t hash);
+
+string_t *StringCreateInline(Heap *heap, const char *values, size_t length, uint32_t hash);
+
+size_t StringLength(Object *object);
+
+void StringDispose(Heap *heap, string_t *string);
+
+// rope functions>
+rope_t *RopeCreate(Heap *heap, Object *left, Object *right);
+
+bool RopeCopy(rope_t *rope, char *buffer);
+
 #endif //RUNTIME_OBJECT_H
@@ -0,0 +1,492 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "bytecode.h"
+#include "profiler.h"
+#include "regvm.h"
+
+// the register opcodes are counted after the stack ones
+#define PROFILE_OPCODES (OP_COUNT + REG_OP_COUNT)
+
+typedef struct profile_entry {
+  Chunk *chunk;
+  int line;
+  int op;
+  uint64_t count;
+} profile_entry_t;
+
+static Profiler *profiler_active = NULL;
+static struct sigaction profiler_previous_action;
+
+static uint64_t ProfilerTick() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static const char *ProfilerOpName(int op) {
+  return op < OP_COUNT ? OpcodeName((Opcode) op) : RegOpcodeName((RegOpcode) (op - OP_COUNT));
+}
+
+/**
+ * Only touches the profiler, the sample buffer was allocated when
+ * it was created
+ */
+static void ProfilerSignal(int signal) {
+  (void) signal;
+
+  Profiler *profiler = profiler_active;
+  if (profiler == NULL) return;
+
+  if (profiler->sample_count >= PROFILE_MAX_SAMPLES) {
+    profiler->dropped++;
+    return;
+  }
+
+  profiler->samples[profiler->sample_count] = (profile_sample_t) {
+      .chunk = profiler->chunk,
+      .offset = profiler->offset,
+  };
+  profiler->sample_count++;
+}
+
+// profiler functions>
+/**
+ * Creates the profiler and starts sampling @param hz times per second
+ * of cpu time, sampling stays off when another profiler is active
+ */
+Profiler *ProfilerCreate(int hz) {
+  Profiler *profiler = malloc(sizeof(Profiler));
+  if (profiler == NULL) return NULL;
+
+  profiler->counts = calloc(PROFILE_OPCODES, sizeof(uint64_t));
+  profiler->ticks = calloc(PROFILE_OPCODES, sizeof(uint64_t));
+  profiler->samples = malloc(PROFILE_MAX_SAMPLES * sizeof(profile_sample_t));
+  profiler->chunk = NULL;
+  profiler->offset = 0;
+  profiler->last_op = -1;
+  profiler->last_tick = 0;
+  profiler->sample_count = 0;
+  profiler->dropped = 0;
+  profiler->hz = hz < 1 ? PROFILE_DEFAULT_HZ : hz;
+  profiler->feedback_chunk = NULL;
+  profiler->offset_counts = NULL;
+  profiler->offset_types = NULL;
+  profiler->pairs = calloc(OP_COUNT * OP_COUNT, sizeof(uint64_t));
+  profiler->last_pair_op = -1;
+
+  if (profiler->counts == NULL || profiler->ticks == NULL || profiler->samples == NULL || profiler->pairs == NULL) {
+    ProfilerDispose(profiler);
+    return NULL;
+  }
+
+  if (profiler_active != NULL) return profiler;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = ProfilerSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+
+  profiler_active = profiler;
+  sigaction(SIGPROF, &action, &profiler_previous_action);
+
+  long interval = 1000000 / profiler->hz;
+  struct itimerval timer = {
+      .it_interval = {.tv_sec = interval / 1000000, .tv_usec = interval % 1000000 + (interval == 0)},
+      .it_value = {.tv_sec = interval / 1000000, .tv_usec = interval % 1000000 + (interval == 0)},
+  };
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  return profiler;
+}
+
+static uint8_t ProfilerValueType(Value value) {
+  switch (ValueGetType(value)) {
+    case V_TYPE_INT: return PROFILE_TYPE_INT;
+    case V_TYPE_DOUBLE: return PROFILE_TYPE_DOUBLE;
+    case V_TYPE_BOOL: return PROFILE_TYPE_BOOL;
+    case V_TYPE_STR: return PROFILE_TYPE_STRING;
+    default: return IS_ROPE(value) ? PROFILE_TYPE_STRING : PROFILE_TYPE_OTHER;
+  }
+}
+
+/**
+ * Records the feedback of the instruction at @param offset, the
+ * arrays are allocated for the first stack chunk that runs
+ */
+static void ProfilerFeedback(Profiler *profiler, Chunk *chunk, int32_t offset, Value *sp) {
+  if (profiler->feedback_chunk == NULL) {
+    profiler->offset_counts = calloc(chunk->count, sizeof(uint64_t));
+    profiler->offset_types = calloc((size_t) chunk->count * 2, sizeof(uint8_t));
+    if (profiler->offset_counts == NULL || profiler->offset_types == NULL) {
+      free(profiler->offset_counts);
+      free(profiler->offset_types);
+      profiler->offset_counts = NULL;
+      profiler->offset_types = NULL;
+      return;
+    }
+
+    profiler->feedback_chunk = chunk;
+  }
+
+  if (profiler->feedback_chunk != chunk) return;
+
+  Opcode op = OpcodeBase((Opcode) chunk->code[offset]);
+  int pops = OpcodePops((Opcode) chunk->code[offset]);
+
+  profiler->offset_counts[offset]++;
+  if (pops >= 2) {
+    profiler->offset_types[offset * 2] |= ProfilerValueType(sp[-2]);
+    profiler->offset_types[offset * 2 + 1] |= ProfilerValueType(sp[-1]);
+  } else if (pops == 1) {
+    profiler->offset_types[offset * 2] |= ProfilerValueType(sp[-1]);
+  }
+
+  if (profiler->last_pair_op >= 0) {
+    profiler->pairs[profiler->last_pair_op * OP_COUNT + op]++;
+  }
+  profiler->last_pair_op = op;
+}
+
+/**
+ * Called by the interpreters before running the instruction at
+ * @param pc of @param chunk
+ *
+ * @param sp the stack top, NULL for the register chunks
+ */
+void ProfilerInstruction(Profiler *profiler, Chunk *chunk, uint8_t *pc, Value *sp) {
+  uint64_t tick = ProfilerTick();
+  int op = chunk->registers ? OP_COUNT + *pc : *pc;
+  int32_t offset = (int32_t) (pc - chunk->code);
+
+  if (profiler->last_op >= 0) {
+    profiler->ticks[profiler->last_op] += tick - profiler->last_tick;
+  }
+
+  profiler->counts[op]++;
+  profiler->last_op = op;
+  profiler->chunk = chunk;
+  profiler->offset = offset;
+
+  if (sp != NULL) ProfilerFeedback(profiler, chunk, offset, sp);
+
+  // the tick is taken again, so the bookkeeping above isn't charged
+  profiler->last_tick = ProfilerTick();
+}
+
+/**
+ * Charges the last instruction when the interpreter returns, the
+ * samples taken until the next chunk runs aren't attributed
+ */
+void ProfilerLeave(Profiler *profiler) {
+  if (profiler->last_op >= 0) {
+    profiler->ticks[profiler->last_op] += ProfilerTick() - profiler->last_tick;
+  }
+
+  profiler->last_op = -1;
+  profiler->last_pair_op = -1;
+  profiler->chunk = NULL;
+}
+
+static int ProfileEntryCompare(const void *a, const void *b) {
+  const profile_entry_t *left = a;
+  const profile_entry_t *right = b;
+
+  if (left->chunk != right->chunk) return (uintptr_t) left->chunk < (uintptr_t) right->chunk ? -1 : 1;
+  if (left->line != right->line) return left->line < right->line ? -1 : 1;
+  if (left->op != right->op) return left->op < right->op ? -1 : 1;
+
+  return 0;
+}
+
+static int ProfileEntryCountCompare(const void *a, const void *b) {
+  const profile_entry_t *left = a;
+  const profile_entry_t *right = b;
+
+  if (left->count != right->count) return left->count > right->count ? -1 : 1;
+
+  return ProfileEntryCompare(a, b);
+}
+
+/**
+ * Maps the samples to their lines and opcodes and merges the equal
+ * ones, sorted by chunk, line and opcode
+ *
+ * @return the entries, the caller frees them
+ */
+static profile_entry_t *ProfilerEntries(Profiler *profiler, int *count) {
+  int sample_count = profiler->sample_count;
+  profile_entry_t *entries = malloc((sample_count + 1) * sizeof(profile_entry_t));
+  if (entries == NULL) return NULL;
+
+  for (int i = 0; i < sample_count; i++) {
+    profile_sample_t sample = profiler->samples[i];
+    profile_entry_t *entry = &entries[i];
+
+    *entry = (profile_entry_t) {.chunk = NULL, .line = -1, .op = -1, .count = 1};
+
+    if (sample.chunk == NULL || sample.offset < 0 || sample.offset >= sample.chunk->count) continue;
+
+    uint8_t op = sample.chunk->code[sample.offset];
+    entry->chunk = sample.chunk;
+    entry->line = ChunkLine(sample.chunk, sample.offset);
+    entry->op = sample.chunk->registers ? OP_COUNT + op : op;
+  }
+
+  qsort(entries, sample_count, sizeof(profile_entry_t), ProfileEntryCompare);
+
+  int merged = 0;
+  for (int i = 0; i < sample_count; i++) {
+    if (merged > 0 && ProfileEntryCompare(&entries[merged - 1], &entries[i]) == 0) {
+      entries[merged - 1].count += entries[i].count;
+    } else {
+      entries[merged++] = entries[i];
+    }
+  }
+
+  *count = merged;
+  return entries;
+}
+
+/**
+ * Writes the opcode table, sorted by the ticks spent in each opcode,
+ * and the lines with the most samples
+ */
+void ProfilerReport(Profiler *profiler, FILE *out) {
+  uint64_t total_ticks = 0;
+  int ops[PROFILE_OPCODES];
+  int op_count = 0;
+
+  for (int op = 0; op < PROFILE_OPCODES; op++) {
+    if (profiler->counts[op] == 0) continue;
+
+    total_ticks += profiler->ticks[op];
+    ops[op_count++] = op;
+  }
+
+  // sorts by ticks, there are only a few dozens opcodes
+  for (int i = 1; i < op_count; i++) {
+    for (int j = i; j > 0 && profiler->ticks[ops[j]] > profiler->ticks[ops[j - 1]]; j--) {
+      int op = ops[j];
+      ops[j] = ops[j - 1];
+      ops[j - 1] = op;
+    }
+  }
+
+  fprintf(out, "== opcodes ==\n");
+  fprintf(out, "%-28s %14s %16s %10s %8s\n", "opcode", "count", "ticks", "ticks/op", "ticks%");
+
+  for (int i = 0; i < op_count; i++) {
+    int op = ops[i];
+    uint64_t count = profiler->counts[op];
+    uint64_t ticks = profiler->ticks[op];
+
+    fprintf(out, "%-28s %14llu %16llu %10.1f %7.2f%%\n", ProfilerOpName(op), (unsigned long long) count,
+            (unsigned long long) ticks, (double) ticks / (double) count,
+            total_ticks == 0 ? 0.0 : 100.0 * (double) ticks / (double) total_ticks);
+  }
+
+  int entry_count;
+  profile_entry_t *entries = ProfilerEntries(profiler, &entry_count);
+  if (entries == NULL) return;
+
+  // merges the opcodes of each line
+  int line_count = 0;
+  for (int i = 0; i < entry_count; i++) {
+    profile_entry_t *last = line_count > 0 ? &entries[line_count - 1] : NULL;
+
+    if (last != NULL && last->chunk == entries[i].chunk && last->line == entries[i].line) {
+      last->count += entries[i].count;
+    } else {
+      entries[line_count++] = entries[i];
+    }
+  }
+
+  qsort(entries, line_count, sizeof(profile_entry_t), ProfileEntryCountCompare);
+
+  int samples = profiler->sample_count;
+  fprintf(out, "\n== lines (%d samples at %d hz, %d dropped) ==\n", samples, profiler->hz, (int) profiler->dropped);
+  fprintf(out, "%8s %10s %8s\n", "line", "samples", "percent");
+
+  for (int i = 0; i < line_count; i++) {
+    profile_entry_t *entry = &entries[i];
+
+    if (entry->chunk == NULL) {
+      fprintf(out, "%8s", "[vm]");
+    } else {
+      fprintf(out, "%8d", entry->line);
+    }
+
+    fprintf(out, " %10llu %7.2f%%\n", (unsigned long long) entry->count, 100.0 * (double) entry->count / samples);
+  }
+
+  free(entries);
+}
+
+/**
+ * Writes the samples as folded stacks, one "frame;frame count" line
+ * per line and opcode, rooted at @param root, the input format of the
+ * flamegraph tools
+ *
+ * @return false when @param path can't be written
+ */
+bool ProfilerWriteFolded(Profiler *profiler, const char *root, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) return false;
+
+  int entry_count;
+  profile_entry_t *entries = ProfilerEntries(profiler, &entry_count);
+  if (entries == NULL) {
+    fclose(file);
+    return false;
+  }
+
+  for (int i = 0; i < entry_count; i++) {
+    profile_entry_t *entry = &entries[i];
+
+    if (entry->chunk == NULL) {
+      fprintf(file, "%s;[vm] %llu\n", root, (unsigned long long) entry->count);
+    } else {
+      fprintf(file, "%s;line %d;%s %llu\n", root, entry->line, ProfilerOpName(entry->op),
+              (unsigned long long) entry->count);
+    }
+  }
+
+  free(entries);
+  return fclose(file) == 0;
+}
+
+static void ProfilerWriteTypes(FILE *file, uint8_t types) {
+  static const char letters[] = "idbso";
+
+  fputc(' ', file);
+  for (int bit = 0; bit < 5; bit++) {
+    if (types & (1 << bit)) fputc(letters[bit], file);
+  }
+}
+
+static bool ProfilerGlobalName(Chunk *chunk, uint32_t slot, const char **name) {
+  if (slot >= (uint32_t) chunk->globals->count) return false;
+
+  Value value = chunk->globals->values[slot];
+  uint32_t length;
+
+  if (IS_STRING_REF(value)) return BytecodeString(chunk, AS_STRING_REF(value), name, &length);
+  if (!IS_STR(value)) return false;
+
+  *name = AS_CSTR(value);
+  return true;
+}
+
+/**
+ * Writes the feedback of the profiled chunk as text, one record per
+ * line after the "kofl-profile <version>" header:
+ *   - "pair <op> <op> <count>", the base opcodes that ran one after
+ *   the other;
+ *   - "global <name> <reads> <writes>", the slot accesses;
+ *   - "inst <index> <line> <op> <count> [<types>...]", the opcodes
+ *   the compiler wrote, indexed in the order it wrote them, so a
+ *   superinstruction is two records with the count of it. The types
+ *   are the letters of the ones each operand was seen with, Int,
+ *   Double, Boolean, String or other, the deepest operand first.
+ *
+ * Only the records that ran are written, koflc checks the line of
+ * the instructions, so it skips a profile of an older source
+ *
+ * @return false when @param path can't be written
+ */
+bool ProfilerWriteFeedback(Profiler *profiler, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) return false;
+
+  fprintf(file, "kofl-profile %d\n", PROFILE_FEEDBACK_VERSION);
+
+  for (int first = 0; first < OP_COUNT; first++) {
+    for (int second = 0; second < OP_COUNT; second++) {
+      uint64_t count = profiler->pairs[first * OP_COUNT + second];
+      if (count == 0) continue;
+
+      fprintf(file, "pair %s %s %llu\n", OpcodeName((Opcode) first), OpcodeName((Opcode) second),
+              (unsigned long long) count);
+    }
+  }
+
+  Chunk *chunk = profiler->feedback_chunk;
+  if (chunk == NULL) return fclose(file) == 0;
+
+  int global_count = chunk->globals->count;
+  uint64_t *accesses = calloc((size_t) global_count * 2 + 1, sizeof(uint64_t));
+  if (accesses == NULL) {
+    fclose(file);
+    return false;
+  }
+
+  int index = 0;
+  for (int offset = 0; offset < chunk->count; offset += 1 + OpcodeOperands((Opcode) chunk->code[offset])) {
+    instruction_t steps[INSTRUCTION_MAX_STEPS];
+    int step_count = InstructionExpand(chunk->code + offset, steps);
+    uint64_t count = profiler->offset_counts[offset];
+    int line = ChunkLine(chunk, offset);
+
+    for (int i = 0; i < step_count; i++, index++) {
+      Opcode op = OpcodeBase(steps[i].op);
+      if (count == 0) continue;
+
+      if ((op == OP_GET_GLOBAL_SLOT || op == OP_SET_GLOBAL_SLOT) && steps[i].operand < (uint32_t) global_count) {
+        accesses[steps[i].operand * 2 + (op == OP_SET_GLOBAL_SLOT)] += count;
+      }
+
+      fprintf(file, "inst %d %d %s %llu", index, line, OpcodeName(op), (unsigned long long) count);
+
+      // the operands of a superinstruction are known
+      int pops = step_count == 1 ? OpcodePops(op) : 0;
+      for (int operand = 0; operand < pops && operand < 2; operand++) {
+        ProfilerWriteTypes(file, profiler->offset_types[offset * 2 + operand]);
+      }
+
+      fputc('\n', file);
+    }
+  }
+
+  for (int slot = 0; slot < global_count; slot++) {
+    const char *name;
+    if (accesses[slot * 2] + accesses[slot * 2 + 1] == 0 || !ProfilerGlobalName(chunk, slot, &name)) continue;
+
+    fprintf(file, "global %s %llu %llu\n", name, (unsigned long long) accesses[slot * 2],
+            (unsigned long long) accesses[slot * 2 + 1]);
+  }
+
+  free(accesses);
+  return fclose(file) == 0;
+}
+
+void ProfilerDispose(Profiler *profiler) {
+  if (profiler_active == profiler) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    sigaction(SIGPROF, &profiler_previous_action, NULL);
+    profiler_active = NULL;
+  }
+
+  free(profiler->counts);
+  free(profiler->ticks);
+  free(profiler->samples);
+  free(profiler->offset_counts);
+  free(profiler->offset_types);
+  free(profiler->pairs);
+  free(profiler);
+}
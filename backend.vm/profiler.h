@@ -0,0 +1,87 @@
+#ifndef RUNTIME_PROFILER_H
+#define RUNTIME_PROFILER_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chunk.h"
+
+/**
+ * The --profile mode. The interpreter reports every instruction
+ * before running it, the profiler counts it and charges the ticks
+ * since the last report to the previous instruction, so an opcode
+ * total includes its dispatch and the call into the profiler.
+ *
+ * Independently, a SIGPROF timer samples the instruction the
+ * interpreter last reported, the samples are mapped to source lines
+ * through the line table of the chunk once the program is done. The
+ * handler only appends to a buffer allocated upfront, when it fills
+ * up the next samples are dropped.
+ *
+ * For the first stack chunk it sees, the profiler also keeps the
+ * feedback that koflc reads back with --profile-use: how many times
+ * each instruction ran, the types of the operands it popped, and the
+ * opcode pairs that ran one after the other, see ProfilerWriteFeedback.
+ *
+ * The ticks are the time stamp counter on x86-64 and nanoseconds
+ * elsewhere. Only one profiler can sample at a time.
+ */
+#define PROFILE_MAX_SAMPLES (1 << 20)
+#define PROFILE_DEFAULT_HZ 1000
+#define PROFILE_FEEDBACK_VERSION 1
+
+// the types an operand was seen with
+#define PROFILE_TYPE_INT 0x1
+#define PROFILE_TYPE_DOUBLE 0x2
+#define PROFILE_TYPE_BOOL 0x4
+#define PROFILE_TYPE_STRING 0x8
+#define PROFILE_TYPE_OTHER 0x10
+
+typedef struct profile_sample {
+  // NULL when no chunk was running
+  Chunk *chunk;
+  int32_t offset;
+} profile_sample_t;
+
+typedef struct {
+  uint64_t *counts;
+  uint64_t *ticks;
+  // the instruction being run, read by the signal handler
+  Chunk *volatile chunk;
+  volatile int32_t offset;
+  // the opcode the ticks since last_tick are charged to, -1 for none
+  int last_op;
+  uint64_t last_tick;
+  profile_sample_t *samples;
+  volatile sig_atomic_t sample_count;
+  volatile sig_atomic_t dropped;
+  int hz;
+
+  // the chunk of the feedback, and its arrays indexed by code offset
+  Chunk *feedback_chunk;
+  uint64_t *offset_counts;
+  // two per offset, the deepest operand first
+  uint8_t *offset_types;
+  // OP_COUNT * OP_COUNT, by the base opcodes
+  uint64_t *pairs;
+  int last_pair_op;
+} Profiler;
+
+// profiler functions>
+Profiler *ProfilerCreate(int hz);
+
+void ProfilerInstruction(Profiler *profiler, Chunk *chunk, uint8_t *pc, Value *sp);
+
+void ProfilerLeave(Profiler *profiler);
+
+void ProfilerReport(Profiler *profiler, FILE *out);
+
+bool ProfilerWriteFolded(Profiler *profiler, const char *root, const char *path);
+
+bool ProfilerWriteFeedback(Profiler *profiler, const char *path);
+
+void ProfilerDispose(Profiler *profiler);
+
+#endif //RUNTIME_PROFILER_H
@@ -0,0 +1,414 @@
+#include "regvm.h"
+#include "debug.h"
+
+#if defined(VM_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define REG_THREADED_DISPATCH
+#endif
+
+// reg_opcode functions>
+RegFormat RegOpcodeFormat(RegOpcode op) {
+  switch (op) {
+#define REG_OPCODE_FORMAT(name, format, stack_op) case name: return format;
+    REG_OPCODES(REG_OPCODE_FORMAT)
+#undef REG_OPCODE_FORMAT
+    default:return kRegFormatNone;
+  }
+}
+
+Opcode RegOpcodeStackOpcode(RegOpcode op) {
+  switch (op) {
+#define REG_OPCODE_STACK_OP(name, format, stack_op) case name: return stack_op;
+    REG_OPCODES(REG_OPCODE_STACK_OP)
+#undef REG_OPCODE_STACK_OP
+    default:return OP_COUNT;
+  }
+}
+
+const char *RegOpcodeName(RegOpcode op) {
+  switch (op) {
+    // skips the REG_ prefix
+#define REG_OPCODE_NAME(name, format, stack_op) case name: return #name + 4;
+    REG_OPCODES(REG_OPCODE_NAME)
+#undef REG_OPCODE_NAME
+    default:return "UNKNOWN";
+  }
+}
+
+/**
+ * @return the count of operand bytes after the opcode
+ */
+int RegFormatOperands(RegFormat format) {
+  switch (format) {
+    case kRegFormatNone: return 0;
+    case kRegFormatA: return 1;
+    case kRegFormatAB: return 2;
+    case kRegFormatABC: return 3;
+    case kRegFormatAK: return 4;
+    case kRegFormatKB: return 4;
+    default: return 0;
+  }
+}
+
+/**
+ * Decodes the instruction at @param code, that must be a known
+ * opcode followed by all of its operand bytes
+ *
+ * @return the size of the instruction
+ */
+int RegInstructionDecode(const uint8_t *code, reg_instruction_t *instruction) {
+  RegOpcode op = (RegOpcode) code[0];
+  RegFormat format = RegOpcodeFormat(op);
+
+  *instruction = (reg_instruction_t) {.op = op};
+
+  switch (format) {
+    case kRegFormatA:
+      instruction->a = code[1];
+      break;
+    case kRegFormatAB:
+      instruction->a = code[1];
+      instruction->b = code[2];
+      break;
+    case kRegFormatABC:
+      instruction->a = code[1];
+      instruction->b = code[2];
+      instruction->c = code[3];
+      break;
+    case kRegFormatAK:
+      instruction->a = code[1];
+      instruction->k = OperandRead(code + 2, 3);
+      break;
+    case kRegFormatKB:
+      instruction->k = OperandRead(code + 1, 3);
+      instruction->b = code[4];
+      break;
+    default:
+      break;
+  }
+
+  return 1 + RegFormatOperands(format);
+}
+
+// vm functions>
+/**
+ * Runs vm->chunk from vm->pc with the register instruction set. The
+ * registers are the chunk->max_stack slots above the stack top, they
+ * stay on the stack while the chunk runs, so the collector marks
+ * them, and are dropped when it returns.
+ *
+ * The chunk was verified, every register is written before it's
+ * read and the typed opcodes get operands of their types. The string
+ * constants were loaded by VmEval, the constant operands are read
+ * as they are.
+ */
+InterpretResult VmEvalRegisters(Vm *vm) {
+  register uint8_t *pc = vm->pc;
+  Value *registers = vm->stack->values + vm->stack->top;
+  Value *consts = vm->chunk->consts->values;
+  Value *globals = vm->global_values->values;
+  int register_count = vm->chunk->max_stack;
+
+  for (int i = 0; i < register_count; i++) {
+    registers[i] = NIL_VALUE;
+  }
+
+  vm->stack->top += register_count;
+
+#define READ_BYTE() (*pc++)
+#define READ_U24() (pc += 3, (uint32_t) pc[-3] | (uint32_t) pc[-2] << 8 | (uint32_t) pc[-1] << 16)
+#define RK(operand) ((operand) & REG_CONST_BIT ? consts[(operand) & ~REG_CONST_BIT] : registers[operand])
+
+#define REG_RETURN(result) \
+    do { \
+      vm->pc = pc; \
+      vm->stack->top -= register_count; \
+      return (result); \
+    } while (0)
+
+#define REG_HOOK() \
+    do { \
+      if (vm->tracer != NULL) TraceInstruction(vm->tracer, vm->chunk, pc, registers, registers + register_count); \
+      if (vm->profiler != NULL) ProfilerInstruction(vm->profiler, vm->chunk, pc, NULL); \
+    } while (0)
+
+  // reads the operands of the ABC and AB formats
+#define REG_ABC() \
+    uint8_t a = pc[0]; \
+    Value b = RK(pc[1]); \
+    Value c = RK(pc[2]); \
+    pc += 3
+
+#define REG_AB() \
+    uint8_t a = pc[0]; \
+    Value b = RK(pc[1]); \
+    pc += 2
+
+// the generic ops check the tags of operands the verifier couldn't
+// type, like the stack handlers
+#define IS_NUMBER(value) (IS_INT(value) || IS_DOUBLE(value))
+
+#define NUMBER_BINARY(operator) \
+    do { \
+      REG_ABC(); \
+      if (!IS_NUMBER(b) || !IS_NUMBER(c)) REG_RETURN(kResultError); \
+      registers[a] = NUM_VALUE(ValueToNumber(b) operator ValueToNumber(c)); \
+    } while (0)
+
+#define INT_BINARY(function) \
+    do { \
+      REG_ABC(); \
+      registers[a] = INT_VALUE(function(AS_INT(b), AS_INT(c))); \
+    } while (0)
+
+#define INT_COMPARE(operator) \
+    do { \
+      REG_ABC(); \
+      registers[a] = BOOL_VALUE(AS_INT(b) operator AS_INT(c)); \
+    } while (0)
+
+#define DOUBLE_BINARY(operator) \
+    do { \
+      REG_ABC(); \
+      registers[a] = NUM_VALUE(AS_DOUBLE(b) operator AS_DOUBLE(c)); \
+    } while (0)
+
+#ifdef REG_THREADED_DISPATCH
+  static void *dispatch_table[REG_OP_COUNT] = {
+#define REG_OPCODE_LABEL(name, format, stack_op) [name] = &&L_##name,
+      REG_OPCODES(REG_OPCODE_LABEL)
+#undef REG_OPCODE_LABEL
+  };
+
+  static void *hook_table[REG_OP_COUNT] = {
+#define REG_OPCODE_HOOK_LABEL(name, format, stack_op) [name] = &&L_HOOK,
+      REG_OPCODES(REG_OPCODE_HOOK_LABEL)
+#undef REG_OPCODE_HOOK_LABEL
+  };
+
+  void **active_table = vm->tracer != NULL || vm->profiler != NULL ? hook_table : dispatch_table;
+
+#define REG_CASE(name) L_##name:
+#define REG_DISPATCH() goto *active_table[READ_BYTE()]
+
+  REG_DISPATCH();
+
+  L_HOOK:
+  pc--;
+  REG_HOOK();
+  goto *dispatch_table[READ_BYTE()];
+#else
+#define REG_CASE(name) case name:
+#define REG_DISPATCH() break
+
+  bool hook = vm->tracer != NULL || vm->profiler != NULL;
+
+  while (true) {
+    if (hook) REG_HOOK();
+
+    switch ((RegOpcode) READ_BYTE()) {
+#endif
+
+  REG_CASE(REG_RET) {
+    REG_RETURN(kResultOK);
+  }
+
+  REG_CASE(REG_LOAD_CONST) {
+    uint8_t a = READ_BYTE();
+
+    registers[a] = consts[READ_U24()];
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_TRUE) {
+    registers[READ_BYTE()] = TRUE_VALUE;
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_FALSE) {
+    registers[READ_BYTE()] = FALSE_VALUE;
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_GET_GLOBAL_SLOT) {
+    uint8_t a = READ_BYTE();
+    Value v = globals[READ_U24()];
+    if (IS_UNDEFINED(v)) REG_RETURN(kResultNullPointer);
+
+    registers[a] = v;
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_SET_GLOBAL_SLOT) {
+    uint32_t slot = READ_U24();
+    uint8_t b = READ_BYTE();
+
+    globals[slot] = RK(b);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_NEGATE) {
+    REG_AB();
+    if (!IS_NUMBER(b)) REG_RETURN(kResultError);
+
+    registers[a] = NUM_VALUE(-ValueToNumber(b));
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_NOT) {
+    REG_AB();
+    if (!IS_BOOL(b)) REG_RETURN(kResultError);
+
+    registers[a] = BOOL_VALUE(!AS_BOOL(b));
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_SUM) {
+    NUMBER_BINARY(+);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_SUB) {
+    NUMBER_BINARY(-);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_MULT) {
+    NUMBER_BINARY(*);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_DIV) {
+    NUMBER_BINARY(/);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_CONCAT) {
+    REG_ABC();
+
+    if (!IS_STR_OR_ROPE(b) || !IS_STR_OR_ROPE(c)) REG_RETURN(kResultError);
+
+    // the operands are registers or constants, both are roots
+    vm->pc = pc;
+    Object *result = VmConcat(vm, AS_OBJ(b), AS_OBJ(c));
+    if (result == NULL) REG_RETURN(kResultOutOfMemory);
+
+    registers[a] = OBJ_VALUE(result);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_SUM_I32) {
+    INT_BINARY(IntAdd);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_SUB_I32) {
+    INT_BINARY(IntSub);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_MULT_I32) {
+    INT_BINARY(IntMult);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_DIV_I32) {
+    REG_ABC();
+
+    if (AS_INT(c) == 0) REG_RETURN(kResultError);
+
+    registers[a] = INT_VALUE(IntDiv(AS_INT(b), AS_INT(c)));
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_NEGATE_I32) {
+    REG_AB();
+
+    registers[a] = INT_VALUE(IntSub(0, AS_INT(b)));
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_LESS_I32) {
+    INT_COMPARE(<);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_LESS_EQUAL_I32) {
+    INT_COMPARE(<=);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_GREATER_I32) {
+    INT_COMPARE(>);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_GREATER_EQUAL_I32) {
+    INT_COMPARE(>=);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_EQUAL_I32) {
+    INT_COMPARE(==);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_NOT_EQUAL_I32) {
+    INT_COMPARE(!=);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_I32_TO_F64) {
+    REG_AB();
+
+    registers[a] = NUM_VALUE((double) AS_INT(b));
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_SUM_F64) {
+    DOUBLE_BINARY(+);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_SUB_F64) {
+    DOUBLE_BINARY(-);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_MULT_F64) {
+    DOUBLE_BINARY(*);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_DIV_F64) {
+    DOUBLE_BINARY(/);
+    REG_DISPATCH();
+  }
+
+  REG_CASE(REG_NEGATE_F64) {
+    REG_AB();
+
+    registers[a] = NUM_VALUE(-AS_DOUBLE(b));
+    REG_DISPATCH();
+  }
+
+#ifndef REG_THREADED_DISPATCH
+      default: REG_RETURN(kResultError);
+    }
+  }
+#endif
+
+#undef READ_BYTE
+#undef READ_U24
+#undef RK
+#undef REG_RETURN
+#undef REG_HOOK
+#undef REG_ABC
+#undef REG_AB
+#undef NUMBER_BINARY
+#undef IS_NUMBER
+#undef INT_BINARY
+#undef INT_COMPARE
+#undef DOUBLE_BINARY
+#undef REG_CASE
+#undef REG_DISPATCH
+}
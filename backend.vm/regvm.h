@@ -0,0 +1,102 @@
+#ifndef RUNTIME_REGVM_H
+#define RUNTIME_REGVM_H
+
+#include <stdint.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+/**
+ * The register instruction set, run instead of the stack one when
+ * the chunk has the registers flag. The registers are stack slots
+ * reserved when the chunk runs, and the operands of an instruction
+ * are bytes after its opcode:
+ *   - A is the register written;
+ *   - B and C are the registers read, or when they have the
+ *   REG_CONST_BIT set, the constant (operand & ~REG_CONST_BIT);
+ *   - K is a 3 bytes little endian index, of a constant or a
+ *   global slot.
+ *
+ * Every opcode is listed with its operands and the stack opcode it
+ * has the semantics of, the verifier checks the operand types
+ * against the rules of that opcode
+ */
+#define REG_OPCODES(X) \
+    X(REG_RET, kRegFormatNone, OP_RET) \
+    X(REG_LOAD_CONST, kRegFormatAK, OP_CONST) \
+    X(REG_TRUE, kRegFormatA, OP_TRUE) \
+    X(REG_FALSE, kRegFormatA, OP_FALSE) \
+    X(REG_GET_GLOBAL_SLOT, kRegFormatAK, OP_GET_GLOBAL_SLOT) \
+    X(REG_SET_GLOBAL_SLOT, kRegFormatKB, OP_SET_GLOBAL_SLOT) \
+    X(REG_NEGATE, kRegFormatAB, OP_NEGATE) \
+    X(REG_NOT, kRegFormatAB, OP_NOT) \
+    X(REG_SUM, kRegFormatABC, OP_SUM) \
+    X(REG_SUB, kRegFormatABC, OP_SUB) \
+    X(REG_MULT, kRegFormatABC, OP_MULT) \
+    X(REG_DIV, kRegFormatABC, OP_DIV) \
+    X(REG_CONCAT, kRegFormatABC, OP_CONCAT) \
+    X(REG_SUM_I32, kRegFormatABC, OP_SUM_I32) \
+    X(REG_SUB_I32, kRegFormatABC, OP_SUB_I32) \
+    X(REG_MULT_I32, kRegFormatABC, OP_MULT_I32) \
+    X(REG_DIV_I32, kRegFormatABC, OP_DIV_I32) \
+    X(REG_NEGATE_I32, kRegFormatAB, OP_NEGATE_I32) \
+    X(REG_LESS_I32, kRegFormatABC, OP_LESS_I32) \
+    X(REG_LESS_EQUAL_I32, kRegFormatABC, OP_LESS_EQUAL_I32) \
+    X(REG_GREATER_I32, kRegFormatABC, OP_GREATER_I32) \
+    X(REG_GREATER_EQUAL_I32, kRegFormatABC, OP_GREATER_EQUAL_I32) \
+    X(REG_EQUAL_I32, kRegFormatABC, OP_EQUAL_I32) \
+    X(REG_NOT_EQUAL_I32, kRegFormatABC, OP_NOT_EQUAL_I32) \
+    X(REG_I32_TO_F64, kRegFormatAB, OP_I32_TO_F64) \
+    X(REG_SUM_F64, kRegFormatABC, OP_SUM_F64) \
+    X(REG_SUB_F64, kRegFormatABC, OP_SUB_F64) \
+    X(REG_MULT_F64, kRegFormatABC, OP_MULT_F64) \
+    X(REG_DIV_F64, kRegFormatABC, OP_DIV_F64) \
+    X(REG_NEGATE_F64, kRegFormatAB, OP_NEGATE_F64)
+
+#define REG_CONST_BIT 0x80
+// registers are named by the operands without REG_CONST_BIT
+#define REG_MAX REG_CONST_BIT
+
+typedef enum {
+  kRegFormatNone,
+  kRegFormatA,
+  kRegFormatAB,
+  kRegFormatABC,
+  kRegFormatAK,
+  kRegFormatKB,
+} RegFormat;
+
+typedef enum {
+#define REG_OPCODE_ENUM(name, format, stack_op) name,
+    REG_OPCODES(REG_OPCODE_ENUM)
+#undef REG_OPCODE_ENUM
+    REG_OP_COUNT
+} RegOpcode;
+
+/**
+ * The operands of a decoded register instruction, the ones its
+ * format doesn't have are 0
+ */
+typedef struct reg_instruction {
+  RegOpcode op;
+  uint8_t a;
+  uint8_t b;
+  uint8_t c;
+  uint32_t k;
+} reg_instruction_t;
+
+// reg_opcode functions>
+RegFormat RegOpcodeFormat(RegOpcode op);
+
+Opcode RegOpcodeStackOpcode(RegOpcode op);
+
+const char *RegOpcodeName(RegOpcode op);
+
+int RegFormatOperands(RegFormat format);
+
+int RegInstructionDecode(const uint8_t *code, reg_instruction_t *instruction);
+
+// vm functions>
+InterpretResult VmEvalRegisters(Vm *vm);
+
+#endif //RUNTIME_REGVM_H
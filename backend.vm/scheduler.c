@@ -0,0 +1,527 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+#include "utils.h"
+
+/**
+ * Queues @param fiber at the bottom of the deque of @param worker,
+ * or at the top when it yielded, and wakes a sleeping worker
+ */
+static void WorkerPush(Worker *worker, Fiber *fiber, bool top) {
+  Scheduler *scheduler = worker->scheduler;
+
+  // counted before it's queued, so a worker never sleeps while
+  // there is a fiber to run
+  atomic_fetch_add_explicit(&scheduler->queued, 1, memory_order_acq_rel);
+
+  pthread_mutex_lock(&worker->lock);
+
+  if (top) {
+    fiber->above = NULL;
+    fiber->below = worker->top;
+    if (worker->top != NULL) worker->top->above = fiber;
+    else worker->bottom = fiber;
+    worker->top = fiber;
+  } else {
+    fiber->below = NULL;
+    fiber->above = worker->bottom;
+    if (worker->bottom != NULL) worker->bottom->below = fiber;
+    else worker->top = fiber;
+    worker->bottom = fiber;
+  }
+
+  pthread_mutex_unlock(&worker->lock);
+
+  pthread_mutex_lock(&scheduler->lock);
+  pthread_cond_signal(&scheduler->wake);
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * @return the fiber at the top of the deque of @param worker, or at
+ * the bottom, or NULL when it's empty
+ */
+static Fiber *WorkerPop(Worker *worker, bool top) {
+  pthread_mutex_lock(&worker->lock);
+
+  Fiber *fiber = top ? worker->top : worker->bottom;
+
+  if (fiber != NULL && top) {
+    worker->top = fiber->below;
+    if (worker->top != NULL) worker->top->above = NULL;
+    else worker->bottom = NULL;
+  } else if (fiber != NULL) {
+    worker->bottom = fiber->above;
+    if (worker->bottom != NULL) worker->bottom->below = NULL;
+    else worker->top = NULL;
+  }
+
+  pthread_mutex_unlock(&worker->lock);
+
+  if (fiber != NULL) {
+    atomic_fetch_sub_explicit(&worker->scheduler->queued, 1, memory_order_acq_rel);
+  }
+
+  return fiber;
+}
+
+/**
+ * @return the next fiber of @param worker, or one stolen from the
+ * other workers, starting from a random one, or NULL
+ */
+static Fiber *WorkerTake(Worker *worker) {
+  Fiber *fiber = WorkerPop(worker, false);
+  if (fiber != NULL) return fiber;
+
+  Scheduler *scheduler = worker->scheduler;
+
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 17;
+  worker->seed ^= worker->seed << 5;
+
+  int start = (int) (worker->seed % (uint32_t) scheduler->worker_count);
+
+  for (int i = 0; i < scheduler->worker_count; i++) {
+    Worker *victim = &scheduler->workers[(start + i) % scheduler->worker_count];
+    if (victim == worker) continue;
+
+    fiber = WorkerPop(victim, true);
+    if (fiber != NULL) return fiber;
+  }
+
+  return NULL;
+}
+
+/**
+ * Marks @param fiber done with @param result and queues the fibers
+ * that await it on @param worker
+ */
+static void FiberFinish(Worker *worker, Fiber *fiber, InterpretResult result) {
+  if (fiber->vm != NULL) {
+    VmDispose(fiber->vm);
+    fiber->vm = NULL;
+  }
+
+  pthread_mutex_lock(&fiber->lock);
+
+  fiber->state = kFiberDone;
+  fiber->result = result;
+
+  Fiber **waiters = fiber->waiters;
+  int waiter_count = fiber->waiter_count;
+
+  fiber->waiters = NULL;
+  fiber->waiter_count = 0;
+  fiber->waiter_capacity = 0;
+
+  pthread_mutex_unlock(&fiber->lock);
+
+  for (int i = 0; i < waiter_count; i++) {
+    Fiber *waiter = waiters[i];
+
+    // a waiter still in its slice is queued again by its worker
+    pthread_mutex_lock(&waiter->lock);
+
+    bool parked = waiter->state == kFiberParked;
+    if (parked) waiter->state = kFiberReady;
+    else waiter->woken = true;
+
+    pthread_mutex_unlock(&waiter->lock);
+
+    if (parked) WorkerPush(worker, waiter, false);
+  }
+
+  free(waiters);
+}
+
+/**
+ * Runs a slice of @param fiber on @param worker, then queues it
+ * again, parks it or finishes it
+ */
+static void FiberRun(Worker *worker, Fiber *fiber) {
+  Scheduler *scheduler = worker->scheduler;
+
+  fiber->worker = worker;
+
+  pthread_mutex_lock(&fiber->lock);
+  fiber->state = kFiberRunning;
+  pthread_mutex_unlock(&fiber->lock);
+
+  InterpretResult result;
+  if (fiber->vm != NULL) {
+    result = VmResume(fiber->vm);
+  } else {
+    fiber->vm = VmCreate(scheduler->flags);
+
+    if (fiber->vm == NULL) {
+      result = kResultOutOfMemory;
+    } else {
+      fiber->vm->fiber = fiber;
+      result = VmEvalShared(fiber->vm, fiber->chunk);
+    }
+  }
+
+  if (result != kResultYield) {
+    FiberFinish(worker, fiber, result);
+    return;
+  }
+
+  pthread_mutex_lock(&fiber->lock);
+
+  bool parked = fiber->parking && !fiber->woken;
+
+  fiber->state = parked ? kFiberParked : kFiberReady;
+  fiber->parking = false;
+  fiber->woken = false;
+
+  pthread_mutex_unlock(&fiber->lock);
+
+  if (!parked) WorkerPush(worker, fiber, true);
+}
+
+static void *WorkerMain(void *argument) {
+  Worker *worker = argument;
+  Scheduler *scheduler = worker->scheduler;
+
+  while (true) {
+    Fiber *fiber = WorkerTake(worker);
+
+    if (fiber != NULL) {
+      FiberRun(worker, fiber);
+      continue;
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    scheduler->sleeping++;
+
+    while (atomic_load_explicit(&scheduler->queued, memory_order_acquire) == 0 && !scheduler->stopping) {
+      // nothing runs, so nothing can be queued anymore
+      if (scheduler->sleeping == scheduler->running) {
+        scheduler->stopping = true;
+        pthread_cond_broadcast(&scheduler->wake);
+        break;
+      }
+
+      pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+    }
+
+    scheduler->sleeping--;
+    bool stopping = scheduler->stopping;
+
+    pthread_mutex_unlock(&scheduler->lock);
+
+    if (stopping) return NULL;
+  }
+}
+
+/**
+ * Creates a fiber of the task @param name, queued on @param worker,
+ * or on the workers in turn when NULL
+ */
+static InterpretResult SchedulerSpawnOn(Scheduler *scheduler, Worker *worker, const char *name, size_t length,
+                                        int32_t *id) {
+  Fiber *fiber = malloc(sizeof(Fiber));
+  if (fiber == NULL) return kResultOutOfMemory;
+
+  fiber->scheduler = scheduler;
+  fiber->chunk = NULL;
+  fiber->vm = NULL;
+  fiber->worker = NULL;
+  fiber->above = NULL;
+  fiber->below = NULL;
+  fiber->state = kFiberReady;
+  fiber->parking = false;
+  fiber->woken = false;
+  fiber->result = kResultOK;
+  fiber->waiters = NULL;
+  fiber->waiter_count = 0;
+  fiber->waiter_capacity = 0;
+  pthread_mutex_init(&fiber->lock, NULL);
+
+  pthread_mutex_lock(&scheduler->lock);
+
+  for (int i = 0; i < scheduler->task_count && fiber->chunk == NULL; i++) {
+    scheduler_task_t *task = &scheduler->tasks[i];
+
+    if (task->length == length && memcmp(task->name, name, length) == 0) fiber->chunk = task->chunk;
+  }
+
+  InterpretResult result = fiber->chunk == NULL ? kResultError : kResultOK;
+
+  if (result == kResultOK && scheduler->fiber_count >= scheduler->fiber_capacity) {
+    int capacity = GROW_CAPACITY(scheduler->fiber_capacity);
+    Fiber **fibers = realloc(scheduler->fibers, capacity * sizeof(Fiber *));
+
+    if (fibers == NULL) {
+      result = kResultOutOfMemory;
+    } else {
+      scheduler->fibers = fibers;
+      scheduler->fiber_capacity = capacity;
+    }
+  }
+
+  if (result == kResultOK) {
+    fiber->id = scheduler->fiber_count;
+    scheduler->fibers[scheduler->fiber_count++] = fiber;
+  }
+
+  if (worker == NULL) {
+    worker = &scheduler->workers[scheduler->next_worker];
+    scheduler->next_worker = (scheduler->next_worker + 1) % scheduler->worker_count;
+  }
+
+  pthread_mutex_unlock(&scheduler->lock);
+
+  if (result != kResultOK) {
+    pthread_mutex_destroy(&fiber->lock);
+    free(fiber);
+    return result;
+  }
+
+  *id = fiber->id;
+  WorkerPush(worker, fiber, false);
+
+  return kResultOK;
+}
+
+// scheduler functions>
+
+/**
+ * @param flags the flags of the vms of the fibers
+ * @param workers the count of worker threads, at least one
+ * @return the scheduler or NULL when out of memory
+ */
+Scheduler *SchedulerCreate(Flags flags, int workers) {
+  if (workers < 1) workers = 1;
+
+  Scheduler *scheduler = malloc(sizeof(Scheduler));
+  if (scheduler == NULL) return NULL;
+
+  scheduler->workers = calloc(workers, sizeof(Worker));
+  if (scheduler->workers == NULL) {
+    free(scheduler);
+    return NULL;
+  }
+
+  scheduler->flags = flags;
+  scheduler->worker_count = workers;
+  scheduler->running = 0;
+  scheduler->fibers = NULL;
+  scheduler->fiber_count = 0;
+  scheduler->fiber_capacity = 0;
+  scheduler->tasks = NULL;
+  scheduler->task_count = 0;
+  scheduler->task_capacity = 0;
+  scheduler->sleeping = 0;
+  scheduler->stopping = false;
+  scheduler->next_worker = 0;
+  atomic_init(&scheduler->queued, 0);
+  pthread_mutex_init(&scheduler->lock, NULL);
+  pthread_cond_init(&scheduler->wake, NULL);
+
+  for (int i = 0; i < workers; i++) {
+    Worker *worker = &scheduler->workers[i];
+
+    worker->scheduler = scheduler;
+    worker->top = NULL;
+    worker->bottom = NULL;
+    worker->seed = 2654435761u * (uint32_t) (i + 1);
+    pthread_mutex_init(&worker->lock, NULL);
+  }
+
+  return scheduler;
+}
+
+/**
+ * Makes @param chunk, verified and shared, spawnable as @param name,
+ * it must outlive the scheduler. Not while it runs
+ *
+ * @return false when the name is taken or out of memory
+ */
+bool SchedulerRegister(Scheduler *scheduler, const char *name, Chunk *chunk) {
+  if (!chunk->verified) return false;
+
+  size_t length = strlen(name);
+
+  for (int i = 0; i < scheduler->task_count; i++) {
+    scheduler_task_t *task = &scheduler->tasks[i];
+    if (task->length == length && memcmp(task->name, name, length) == 0) return false;
+  }
+
+  if (scheduler->task_count >= scheduler->task_capacity) {
+    int capacity = GROW_CAPACITY(scheduler->task_capacity);
+    scheduler_task_t *tasks = realloc(scheduler->tasks, capacity * sizeof(scheduler_task_t));
+    if (tasks == NULL) return false;
+
+    scheduler->tasks = tasks;
+    scheduler->task_capacity = capacity;
+  }
+
+  char *copy = malloc(length + 1);
+  if (copy == NULL) return false;
+
+  memcpy(copy, name, length + 1);
+
+  scheduler->tasks[scheduler->task_count++] = (scheduler_task_t) {copy, length, chunk};
+
+  return true;
+}
+
+/**
+ * Creates a fiber of the task @param name, it runs with the next
+ * SchedulerRun. Not while it runs, the fibers spawn with FiberSpawn
+ *
+ * @param id receives the id of the fiber
+ * @return kResultError when there is no such task
+ */
+InterpretResult SchedulerSpawn(Scheduler *scheduler, const char *name, size_t length, int32_t *id) {
+  return SchedulerSpawnOn(scheduler, NULL, name, length, id);
+}
+
+/**
+ * Runs the fibers on the worker threads, the calling thread being
+ * the first one, until they are all done. The fibers that are left
+ * awaiting each other fail
+ */
+void SchedulerRun(Scheduler *scheduler) {
+  // the workers can't stop before the count of those running is known
+  pthread_mutex_lock(&scheduler->lock);
+
+  scheduler->stopping = false;
+  scheduler->running = 1;
+
+  for (int i = 1; i < scheduler->worker_count; i++) {
+    Worker *worker = &scheduler->workers[i];
+
+    // the others steal the fibers queued on a worker that didn't start
+    if (pthread_create(&worker->thread, NULL, WorkerMain, worker) != 0) break;
+
+    scheduler->running++;
+  }
+
+  int started = scheduler->running;
+
+  pthread_mutex_unlock(&scheduler->lock);
+
+  WorkerMain(&scheduler->workers[0]);
+
+  for (int i = 1; i < started; i++) {
+    pthread_join(scheduler->workers[i].thread, NULL);
+  }
+
+  // the fibers left await each other, nothing wakes them anymore
+  for (int i = 0; i < scheduler->fiber_count; i++) {
+    Fiber *fiber = scheduler->fibers[i];
+    if (fiber->state == kFiberDone) continue;
+
+    if (fiber->vm != NULL) {
+      VmDispose(fiber->vm);
+      fiber->vm = NULL;
+    }
+    fiber->state = kFiberDone;
+    fiber->result = kResultError;
+    fiber->waiter_count = 0;
+  }
+}
+
+/**
+ * @param result receives how the fiber @param id ended
+ * @return false when there is no such fiber or it isn't done
+ */
+bool SchedulerResult(Scheduler *scheduler, int32_t id, InterpretResult *result) {
+  if (id < 0 || id >= scheduler->fiber_count) return false;
+
+  Fiber *fiber = scheduler->fibers[id];
+  if (fiber->state != kFiberDone) return false;
+
+  *result = fiber->result;
+
+  return true;
+}
+
+void SchedulerDispose(Scheduler *scheduler) {
+  for (int i = 0; i < scheduler->fiber_count; i++) {
+    Fiber *fiber = scheduler->fibers[i];
+
+    if (fiber->vm != NULL) {
+      VmDispose(fiber->vm);
+    }
+
+    pthread_mutex_destroy(&fiber->lock);
+    free(fiber->waiters);
+    free(fiber);
+  }
+
+  for (int i = 0; i < scheduler->task_count; i++) {
+    free(scheduler->tasks[i].name);
+  }
+
+  for (int i = 0; i < scheduler->worker_count; i++) {
+    pthread_mutex_destroy(&scheduler->workers[i].lock);
+  }
+
+  pthread_mutex_destroy(&scheduler->lock);
+  pthread_cond_destroy(&scheduler->wake);
+  free(scheduler->fibers);
+  free(scheduler->tasks);
+  free(scheduler->workers);
+  free(scheduler);
+}
+
+// fiber functions>
+
+/**
+ * OP_SPAWN, creates a fiber of the task @param name queued on the
+ * worker running @param fiber
+ */
+InterpretResult FiberSpawn(Fiber *fiber, const char *name, size_t length, int32_t *id) {
+  return SchedulerSpawnOn(fiber->scheduler, fiber->worker, name, length, id);
+}
+
+/**
+ * OP_AWAIT, when the fiber @param id is done @param ok receives
+ * whether it ran to the end, otherwise @param fiber is added to its
+ * waiters and parks once its slice returns
+ *
+ * @return kResultYield when @param fiber must wait, kResultError
+ * when there is no such fiber or it's the fiber itself
+ */
+InterpretResult FiberAwait(Fiber *fiber, int32_t id, bool *ok) {
+  Scheduler *scheduler = fiber->scheduler;
+
+  pthread_mutex_lock(&scheduler->lock);
+  Fiber *awaited = id >= 0 && id < scheduler->fiber_count ? scheduler->fibers[id] : NULL;
+  pthread_mutex_unlock(&scheduler->lock);
+
+  if (awaited == NULL || awaited == fiber) return kResultError;
+
+  pthread_mutex_lock(&awaited->lock);
+
+  InterpretResult result = kResultYield;
+
+  if (awaited->state == kFiberDone) {
+    *ok = awaited->result == kResultOK;
+    result = kResultOK;
+  } else if (awaited->waiter_count >= awaited->waiter_capacity) {
+    int capacity = GROW_CAPACITY(awaited->waiter_capacity);
+    Fiber **waiters = realloc(awaited->waiters, capacity * sizeof(Fiber *));
+
+    if (waiters == NULL) {
+      result = kResultOutOfMemory;
+    } else {
+      awaited->waiters = waiters;
+      awaited->waiter_capacity = capacity;
+    }
+  }
+
+  if (result == kResultYield) {
+    awaited->waiters[awaited->waiter_count++] = fiber;
+    fiber->parking = true;
+  }
+
+  pthread_mutex_unlock(&awaited->lock);
+
+  return result;
+}
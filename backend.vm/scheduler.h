@@ -0,0 +1,126 @@
+#ifndef RUNTIME_SCHEDULER_H
+#define RUNTIME_SCHEDULER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+/**
+ * Runs fibers on a pool of worker threads. A fiber runs a task, a
+ * shared chunk registered under a name, in a vm of its own: its own
+ * stack, which starts with a few slots, its own heap and globals, so
+ * fibers share nothing and a fiber can move to any thread between
+ * two slices.
+ *
+ * A slice ends when the chunk returns, or when it yields: OP_YIELD,
+ * or OP_AWAIT on a fiber that isn't done. The interpreter keeps its
+ * whole state in the vm, so a fiber is continued by VmResume without
+ * a native stack of its own.
+ *
+ * Each worker keeps its runnable fibers in a deque: it pushes the
+ * fibers it spawns or wakes at the bottom and runs from the bottom,
+ * the fibers that yield go to the top, and an idle worker steals
+ * from the top of the others. A fiber that awaits is parked in the
+ * waiters of the awaited one, until it's done. The workers stop once
+ * all of them are idle with nothing queued: every fiber is done, or
+ * the ones left await each other and are failed.
+ */
+typedef enum {
+  kFiberReady,
+  kFiberRunning,
+  kFiberParked,
+  kFiberDone,
+} FiberState;
+
+typedef struct fiber {
+  struct scheduler *scheduler;
+  int32_t id;
+  // the shared chunk of the task
+  Chunk *chunk;
+  // created by the first slice, disposed once the fiber is done
+  Vm *vm;
+  // the worker running the fiber
+  struct worker *worker;
+  // the links of the deque the fiber is queued in
+  struct fiber *above;
+  struct fiber *below;
+
+  // state, woken, result and waiters are guarded by lock
+  pthread_mutex_t lock;
+  FiberState state;
+  // set by FiberAwait, the worker parks the fiber after the slice
+  bool parking;
+  // the awaited fiber was done before the worker parked this one
+  bool woken;
+  InterpretResult result;
+  struct fiber **waiters;
+  int waiter_count;
+  int waiter_capacity;
+} Fiber;
+
+typedef struct worker {
+  struct scheduler *scheduler;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  Fiber *top;
+  Fiber *bottom;
+  // picks the workers to steal from
+  uint32_t seed;
+} Worker;
+
+typedef struct scheduler_task {
+  char *name;
+  size_t length;
+  Chunk *chunk;
+} scheduler_task_t;
+
+typedef struct scheduler {
+  // the flags of the vms of the fibers
+  Flags flags;
+  Worker *workers;
+  int worker_count;
+  // the workers SchedulerRun started
+  int running;
+
+  // guards the fibers, the tasks and the sleeping workers
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  // by id, the fibers are kept until the scheduler is disposed
+  Fiber **fibers;
+  int fiber_count;
+  int fiber_capacity;
+  scheduler_task_t *tasks;
+  int task_count;
+  int task_capacity;
+  int sleeping;
+  bool stopping;
+  // the worker that gets the next fiber spawned out of the workers
+  int next_worker;
+
+  // the fibers in the deques
+  atomic_int queued;
+} Scheduler;
+
+// scheduler functions>
+Scheduler *SchedulerCreate(Flags flags, int workers);
+
+bool SchedulerRegister(Scheduler *scheduler, const char *name, Chunk *chunk);
+
+InterpretResult SchedulerSpawn(Scheduler *scheduler, const char *name, size_t length, int32_t *id);
+
+void SchedulerRun(Scheduler *scheduler);
+
+bool SchedulerResult(Scheduler *scheduler, int32_t id, InterpretResult *result);
+
+void SchedulerDispose(Scheduler *scheduler);
+
+// fiber functions>
+InterpretResult FiberSpawn(Fiber *fiber, const char *name, size_t length, int32_t *id);
+
+InterpretResult FiberAwait(Fiber *fiber, int32_t id, bool *ok);
+
+#endif //RUNTIME_SCHEDULER_H
@@ -12,10 +12,27 @@ Stack *StackCreate(size_t capacity) {
   return stack;
 }
 
-bool StackPush(Stack *stack, Value *value) {
+/**
+ * Grows @param stack to hold at least @param capacity values
+ *
+ * @return false when it couldn't be grown
+ */
+bool StackReserve(Stack *stack, size_t capacity) {
+  if (capacity <= stack->capacity) return true;
+
+  Value *values = realloc(stack->values, capacity * sizeof(Value));
+  if (values == NULL) return false;
+
+  stack->values = values;
+  stack->capacity = capacity;
+
+  return true;
+}
+
+bool StackPush(Stack *stack, Value value) {
   if (stack->top >= stack->capacity) return false;
 
-  stack->values[stack->top] = *value;
+  stack->values[stack->top] = value;
   stack->top++;
 
   return true;
@@ -27,12 +44,12 @@ Value *StackPeek(Stack *stack) {
   return &stack->values[stack->top - 1];
 }
 
-Value *StackPop(Stack *stack) {
-  if (stack->top <= 0) return NULL;
+Value StackPop(Stack *stack) {
+  if (stack->top <= 0) return NIL_VALUE;
 
   stack->top--;
 
-  return &stack->values[stack->top];
+  return stack->values[stack->top];
 }
 
 void StackDispose(Stack *stack) {
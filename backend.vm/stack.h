@@ -14,11 +14,13 @@ typedef struct {
 // stack functions>
 Stack *StackCreate(size_t capacity);
 
-bool StackPush(Stack *stack, Value *value);
+bool StackReserve(Stack *stack, size_t capacity);
+
+bool StackPush(Stack *stack, Value value);
 
 Value *StackPeek(Stack *stack);
 
-Value *StackPop(Stack *stack);
+Value StackPop(Stack *stack);
 
 void StackDispose(Stack *stack);
 
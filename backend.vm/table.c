@@ -3,167 +3,556 @@
 #include <inttypes.h>
 #include <string.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TABLE_NEON
+#endif
+
 #include "utils.h"
 #include "table.h"
 
 /**
- * Will refill the table when its gets 75% full
+ * Will grow the table when its gets 7/8 full
  *
- * Its 75% 'cause the table never gets full, so
- * can never collide on every element
+ * Probing stops on the first group with an empty slot,
+ * so the table never gets full, or a miss would visit
+ * every group
+ */
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+/**
+ * Tables with less slots than that are always resized in a
+ * single pass, even if they are incremental, it's cheaper
+ * than checking two slot arrays on every lookup
  */
-#define TABLE_MAX_LOAD 0.75
+#define TABLE_INCREMENTAL_MIN 1024
 
 /**
- * Implements the FNV-1a hash algorithm
- * @a http://www.isthe.com/chongo/tech/comp/fnv
- * @param key the string key
- * @param length the length of string
- * @return the hash of string
+ * The amount of old slots moved to the new slot array on
+ * each table_set/table_remove of an incremental resize
  */
-long table_hash(const char *key, int length) {
-    uint32_t hash = 2166136261u;
-    uint32_t FNV_prime = 16777619;
-    for (int i = 0; i < length; i++) {
-        hash ^= key[i];
-        hash *= FNV_prime;
+#define TABLE_MIGRATE_BATCH 64
+
+#define TABLE_NOT_FOUND SIZE_MAX
+
+#define TABLE_H1(hash) ((hash) >> 7)
+#define TABLE_H2(hash) ((int8_t) ((hash) & 0x7f))
+
+/**
+ * One bit per matching slot of a group, NEON has no movemask
+ * so there it's one nibble per slot instead
+ */
+typedef uint64_t table_mask_t;
+
+#ifdef TABLE_NEON
+#define TABLE_MASK_SHIFT 2
+#else
+#define TABLE_MASK_SHIFT 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TABLE_CTZ(mask) ((size_t) __builtin_ctzll(mask))
+#else
+static inline size_t table_ctz(table_mask_t mask) {
+    size_t n = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        n++;
+    }
+    return n;
+}
+#define TABLE_CTZ(mask) table_ctz(mask)
+#endif
+
+#define TABLE_MASK_FIRST(mask) (TABLE_CTZ(mask) >> TABLE_MASK_SHIFT)
+
+// group functions>
+static inline table_mask_t table_group_match(const int8_t *ctrl, int8_t h2) {
+#if defined(TABLE_SSE2)
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return (table_mask_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), group));
+#elif defined(TABLE_NEON)
+    int8x16_t group = vld1q_s8(ctrl);
+    uint8x16_t eq = vceqq_s8(group, vdupq_n_s8(h2));
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888ull;
+#else
+    table_mask_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (ctrl[i] == h2) mask |= (table_mask_t) 1 << i;
     }
+    return mask;
+#endif
+}
 
-    return hash;
+static inline table_mask_t table_group_match_empty(const int8_t *ctrl) {
+    return table_group_match(ctrl, TABLE_CTRL_EMPTY);
 }
 
-Table *table_create(size_t capacity) {
-    Table *table = malloc(sizeof(Table));
+/**
+ * Matches empty and deleted slots, they are the only control
+ * bytes with the sign bit set
+ */
+static inline table_mask_t table_group_match_free(const int8_t *ctrl) {
+#if defined(TABLE_SSE2)
+    return (table_mask_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#elif defined(TABLE_NEON)
+    int8x16_t group = vld1q_s8(ctrl);
+    uint8x16_t free = vcltq_s8(group, vdupq_n_s8(0));
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(free), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888ull;
+#else
+    table_mask_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (ctrl[i] < 0) mask |= (table_mask_t) 1 << i;
+    }
+    return mask;
+#endif
+}
 
-    table->capacity = capacity;
-    table->count = 0;
-    table->nodes = calloc(capacity, sizeof(table_node_t));
+// hash functions>
+/**
+ * Strings already carry their hash, other keys are
+ * hashed by their bits with the murmur3 finalizer
+ */
+static inline size_t table_hash(Value key) {
+    if (IS_STR(key)) return AS_STR(key)->hash;
 
-    return table;
+    uint64_t hash = key;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+
+    return (size_t) hash;
 }
 
+// probe functions>
 /**
  * Implementation details:
- *   - Its returns the node when the found value
- *   has NULL key or equals @var key
-
- *   - If the found value kas a different key
- *   than @var key then this will start probing
- *   the next element on the @var table->nodes
- *   array, if not found, then will search the
- *   next
+ *   - the probe starts on the group selected by the high
+ *   bits of the hash, and every slot whose control byte is
+ *   the low 7 bits of the hash has its key compared
+
+ *   - keys are compared by their bits, strings are interned
+ *   so they are compared by identity
+
+ *   - if the group has an empty slot the key isn't on the
+ *   table, otherwise the next group is visited with
+ *   triangular steps, that visit every group since the
+ *   group count is a power of two
  *
- * @param table the target table
- * @param key the string key
- * @return the table node
- */
-table_node_t *table_find_entry(Table *table, string_t *key) {
-    uint32_t index = table_hash(key->values, key->length) % table->capacity;
-    table_node_t *tombstone = NULL;
-
-    while (true) {
-        table_node_t *node = &table->nodes[index];
-
-        // return the tombstone if has one,
-        // to reduce wasting space in the array
-        // on table set
-        if (node->key == NULL) {
-            if (node->value == NULL) {
-                return tombstone != NULL ? tombstone : node;
-            } else {
-                if (tombstone == NULL) {
-                    tombstone = node;
-                }
-            }
-        }
+ * @return the slot index or TABLE_NOT_FOUND
+ */
+static size_t table_probe(const int8_t *ctrl, const table_slot_t *slots, size_t capacity, Value key, size_t hash) {
+    size_t groups_mask = capacity / TABLE_GROUP_WIDTH - 1;
+    size_t group = TABLE_H1(hash) & groups_mask;
+    int8_t h2 = TABLE_H2(hash);
+
+    for (size_t step = 1; step <= groups_mask + 1; step++) {
+        const int8_t *group_ctrl = ctrl + group * TABLE_GROUP_WIDTH;
 
-        if (strcmp(node->key->values, key->values) == 0 || node->key == NULL) {
-            return node;
+        for (table_mask_t mask = table_group_match(group_ctrl, h2); mask != 0; mask &= mask - 1) {
+            size_t index = group * TABLE_GROUP_WIDTH + TABLE_MASK_FIRST(mask);
+            if (slots[index].key == key) return index;
         }
 
-        index = (index + 1) % table->capacity;
+        if (table_group_match_empty(group_ctrl) != 0) break;
+
+        group = (group + step) & groups_mask;
     }
+
+    return TABLE_NOT_FOUND;
 }
 
-void table_adjust(Table *table, size_t capacity) {
-    table_node_t *nodes = ALLOCATE(table_node_t, capacity);
+/**
+ * @return the first empty or deleted slot of the probe sequence of @param hash
+ */
+static size_t table_probe_free(const int8_t *ctrl, size_t capacity, size_t hash) {
+    size_t groups_mask = capacity / TABLE_GROUP_WIDTH - 1;
+    size_t group = TABLE_H1(hash) & groups_mask;
+
+    for (size_t step = 1;; step++) {
+        table_mask_t mask = table_group_match_free(ctrl + group * TABLE_GROUP_WIDTH);
+        if (mask != 0) return group * TABLE_GROUP_WIDTH + TABLE_MASK_FIRST(mask);
 
-    for (int i = 0; i < capacity; i++) {
-        nodes[i].key = NULL;
-        nodes[i].value = NULL;
+        group = (group + step) & groups_mask;
     }
+}
 
-    // to mitigate collisions, this re build the node array
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        table_node_t *node = &table->nodes[i];
-        if (node->key == NULL) continue;
+/**
+ * Clears the slot at @param index, it can only become empty
+ * again if its group still has an empty slot: otherwise some
+ * probe may have walked past this group, and stopping there
+ * would hide the keys it placed further
+ */
+static void table_erase(int8_t *ctrl, size_t index, size_t *growth_left) {
+    const int8_t *group_ctrl = ctrl + index / TABLE_GROUP_WIDTH * TABLE_GROUP_WIDTH;
+
+    if (table_group_match_empty(group_ctrl) != 0) {
+        ctrl[index] = TABLE_CTRL_EMPTY;
+        if (growth_left != NULL) (*growth_left)++;
+    } else {
+        ctrl[index] = TABLE_CTRL_DELETED;
+    }
+}
 
-        table_node_t *dest = table_find_entry(table, node->key);
+// resize functions>
+static void table_alloc(Table *table, size_t capacity) {
+    table->capacity = capacity;
+    table->ctrl = ALLOCATE(int8_t, capacity);
+    table->slots = ALLOCATE(table_slot_t, capacity);
+    table->growth_left = TABLE_MAX_LOAD(capacity) - table->count;
 
-        dest->key = node->key;
-        dest->value = node->value;
+    memset(table->ctrl, TABLE_CTRL_EMPTY, capacity);
+}
+
+/**
+ * Puts an entry that is known to be missing in the new slot array,
+ * the space for it was already reserved when the array was created
+ */
+static void table_place(Table *table, Value key, Value value, size_t hash) {
+    size_t index = table_probe_free(table->ctrl, table->capacity, hash);
+
+    table->ctrl[index] = TABLE_H2(hash);
+    table->slots[index].key = key;
+    table->slots[index].value = value;
+}
+
+/**
+ * Moves up to @param budget slots of the old slot array
+ * to the new one, the old array is freed when it's empty
+ */
+static void table_migrate(Table *table, size_t budget) {
+    if (table->old_ctrl == NULL) return;
+
+    while (budget > 0 && table->migrated < table->old_capacity) {
+        size_t index = table->migrated++;
+        budget--;
+
+        if (table->old_ctrl[index] < 0) continue;
 
-        table->count++;
+        table_slot_t *slot = &table->old_slots[index];
+        table_place(table, slot->key, slot->value, table_hash(slot->key));
+
+        // keeps the probe chains of the old array intact for
+        // the lookups that still fall back to it
+        table->old_ctrl[index] = TABLE_CTRL_DELETED;
     }
 
-    free(table->nodes);
-    table->nodes = nodes;
-    table->capacity = capacity;
+    if (table->migrated == table->old_capacity) {
+        free(table->old_ctrl);
+        free(table->old_slots);
+
+        table->old_ctrl = NULL;
+        table->old_slots = NULL;
+        table->old_capacity = 0;
+        table->migrated = 0;
+    }
 }
 
-void *table_get(Table *table, string_t *key) {
-    if (table->count == 0) return NULL;
+static void table_rehash(Table *table, size_t capacity) {
+    int8_t *old_ctrl = table->ctrl;
+    table_slot_t *old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+
+    table_alloc(table, capacity);
+
+    if (table->incremental && old_capacity >= TABLE_INCREMENTAL_MIN) {
+        table->old_ctrl = old_ctrl;
+        table->old_slots = old_slots;
+        table->old_capacity = old_capacity;
+        table->migrated = 0;
+
+        return;
+    }
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_ctrl[i] < 0) continue;
 
-    table_node_t *node = table_find_entry(table, key);
-    if (node->key == NULL) return NULL;
+        table_place(table, old_slots[i].key, old_slots[i].value, table_hash(old_slots[i].key));
+    }
 
-    return node->value;
+    free(old_ctrl);
+    free(old_slots);
+}
+
+/**
+ * Called when there is no room left for a new key, if most of
+ * the used slots are tombstones the table is rebuilt with the
+ * same capacity, otherwise its capacity is doubled
+ */
+static void table_grow(Table *table) {
+    // a pending migration must end before starting another one
+    table_migrate(table, SIZE_MAX);
+
+    size_t capacity = table->capacity;
+    if (table->count * 2 > TABLE_MAX_LOAD(capacity)) {
+        capacity *= 2;
+    }
+
+    table_rehash(table, capacity);
+}
+
+// table functions>
+Table *table_create(size_t capacity) {
+    Table *table = malloc(sizeof(Table));
+
+    size_t slots = TABLE_GROUP_WIDTH;
+    while (TABLE_MAX_LOAD(slots) < capacity) {
+        slots *= 2;
+    }
+
+    table->count = 0;
+    table->incremental = false;
+    table->old_ctrl = NULL;
+    table->old_slots = NULL;
+    table->old_capacity = 0;
+    table->migrated = 0;
+
+    table_alloc(table, slots);
+
+    return table;
 }
 
 /**
  * @param table the target table
- * @param key the string key
+ * @param incremental if resizes of big tables should be spread
+ * through the following operations instead of done in one pass
+ */
+void table_set_incremental(Table *table, bool incremental) {
+    table->incremental = incremental;
+
+    if (!incremental) {
+        table_migrate(table, SIZE_MAX);
+    }
+}
+
+/**
+ * @param table the target table
+ * @param key the key
+ * @param value where the found value is written
+ * @return if the key was found
+ */
+bool table_get(Table *table, Value key, Value *value) {
+    size_t hash = table_hash(key);
+    size_t index = table_probe(table->ctrl, table->slots, table->capacity, key, hash);
+
+    if (index != TABLE_NOT_FOUND) {
+        *value = table->slots[index].value;
+        return true;
+    }
+
+    if (table->old_ctrl != NULL) {
+        index = table_probe(table->old_ctrl, table->old_slots, table->old_capacity, key, hash);
+
+        if (index != TABLE_NOT_FOUND) {
+            *value = table->old_slots[index].value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @param table the target table
+ * @param key the key
  * @return if the operation was successful
  */
-bool table_remove(Table *table, string_t *key) {
-    if (table->count == 0) return false;
+bool table_remove(Table *table, Value key) {
+    table_migrate(table, TABLE_MIGRATE_BATCH);
 
-    table_node_t *node = table_find_entry(table, key);
-    if (node->key == NULL) return false;
+    size_t hash = table_hash(key);
+    size_t index = table_probe(table->ctrl, table->slots, table->capacity, key, hash);
 
-    node->key = NULL;
-    node->value = (void *) true;
+    if (index != TABLE_NOT_FOUND) {
+        table_erase(table->ctrl, index, &table->growth_left);
+        table->count--;
 
-    return true;
+        return true;
+    }
+
+    if (table->old_ctrl != NULL) {
+        index = table_probe(table->old_ctrl, table->old_slots, table->old_capacity, key, hash);
+
+        if (index != TABLE_NOT_FOUND) {
+            table_erase(table->old_ctrl, index, NULL);
+            table->count--;
+
+            return true;
+        }
+    }
+
+    return false;
 }
 
 /**
  * @param table the target table
- * @param key the string key
- * @param length the string key length
+ * @param key the key
  * @param value the value
- * @return if the node is new
+ * @return if the key is new
+ */
+bool table_set(Table *table, Value key, Value value) {
+    table_migrate(table, TABLE_MIGRATE_BATCH);
+
+    size_t hash = table_hash(key);
+    size_t index = table_probe(table->ctrl, table->slots, table->capacity, key, hash);
+
+    if (index != TABLE_NOT_FOUND) {
+        table->slots[index].value = value;
+        return false;
+    }
+
+    if (table->old_ctrl != NULL) {
+        index = table_probe(table->old_ctrl, table->old_slots, table->old_capacity, key, hash);
+
+        if (index != TABLE_NOT_FOUND) {
+            table->old_slots[index].value = value;
+            return false;
+        }
+    }
+
+    if (table->growth_left == 0) {
+        table_grow(table);
+    }
+
+    index = table_probe_free(table->ctrl, table->capacity, hash);
+    if (table->ctrl[index] == TABLE_CTRL_EMPTY) {
+        table->growth_left--;
+    }
+
+    table->ctrl[index] = TABLE_H2(hash);
+    table->slots[index].key = key;
+    table->slots[index].value = value;
+    table->count++;
+
+    return true;
+}
+
+/**
+ * Iterates over the entries of the table, in no particular order
+ *
+ * @param table the target table
+ * @param cursor the iteration state, must start at 0
+ * @param key where the key of the entry is written
+ * @param value where the value of the entry is written
+ * @return if an entry was found, false when the iteration ended
+ */
+bool table_next(Table *table, size_t *cursor, Value *key, Value *value) {
+    while (*cursor < table->capacity + table->old_capacity) {
+        size_t index = (*cursor)++;
+
+        int8_t *ctrl = table->ctrl;
+        table_slot_t *slots = table->slots;
+
+        if (index >= table->capacity) {
+            index -= table->capacity;
+            ctrl = table->old_ctrl;
+            slots = table->old_slots;
+        }
+
+        if (ctrl[index] < 0) continue;
+
+        *key = slots[index].key;
+        *value = slots[index].value;
+
+        return true;
+    }
+
+    return false;
+}
+
+static string_t *table_probe_string(const int8_t *ctrl, const table_slot_t *slots, size_t capacity,
+                                    const char *values, size_t length, uint32_t hash) {
+    size_t groups_mask = capacity / TABLE_GROUP_WIDTH - 1;
+    size_t group = TABLE_H1((size_t) hash) & groups_mask;
+    int8_t h2 = TABLE_H2((size_t) hash);
+
+    for (size_t step = 1; step <= groups_mask + 1; step++) {
+        const int8_t *group_ctrl = ctrl + group * TABLE_GROUP_WIDTH;
+
+        for (table_mask_t mask = table_group_match(group_ctrl, h2); mask != 0; mask &= mask - 1) {
+            Value key = slots[group * TABLE_GROUP_WIDTH + TABLE_MASK_FIRST(mask)].key;
+            if (!IS_STR(key)) continue;
+
+            string_t *string = AS_STR(key);
+            if (string->hash == hash && string->length == length &&
+                memcmp(string->values, values, length) == 0) {
+                return string;
+            }
+        }
+
+        if (table_group_match_empty(group_ctrl) != 0) break;
+
+        group = (group + step) & groups_mask;
+    }
+
+    return NULL;
+}
+
+/**
+ * Looks up a key by its contents instead of its identity,
+ * it's what the string interning uses to find the canonical
+ * string before one exists for the given characters
+ *
+ * @param table the target table
+ * @param values the characters of the string
+ * @param length the length of values
+ * @param hash the hash of values
+ * @return the interned key or NULL
  */
-bool table_set(Table *table, string_t* key, void *value) {
-    table_node_t *node = table_find_entry(table, key);
+string_t *table_find_string(Table *table, const char *values, size_t length, uint32_t hash) {
+    if (table->count == 0) return NULL;
+
+    string_t *string = table_probe_string(table->ctrl, table->slots, table->capacity, values, length, hash);
 
-    if (table->count + 1 > (table->capacity + 1) * TABLE_MAX_LOAD) { // NOLINT(cppcoreguidelines-narrowing-conversions)
-        table_adjust(table, GROW_CAPACITY(table->capacity));
+    if (string == NULL && table->old_ctrl != NULL) {
+        string = table_probe_string(table->old_ctrl, table->old_slots, table->old_capacity, values, length, hash);
     }
 
-    bool is_new = node->key == NULL;
-    if (is_new && node->value == NULL) {
-        table->count++;
+    return string;
+}
+
+static size_t table_erase_unmarked(int8_t *ctrl, table_slot_t *slots, size_t capacity, size_t *growth_left) {
+    size_t removed = 0;
+
+    for (size_t i = 0; i < capacity; i++) {
+        if (ctrl[i] < 0) continue;
+
+        Value key = slots[i].key;
+        if (IS_OBJ(key) && !AS_OBJ(key)->marked) {
+            table_erase(ctrl, i, growth_left);
+            removed++;
+        }
     }
 
-    node->key = key;
-    node->value = value;
+    return removed;
+}
+
+/**
+ * Removes the entries whose key is an object the collector didn't
+ * mark, it's how the weak intern table drops unreachable strings
+ * before they are freed
+ *
+ * @param table the target table
+ */
+void table_remove_unmarked(Table *table) {
+    table->count -= table_erase_unmarked(table->ctrl, table->slots, table->capacity, &table->growth_left);
 
-    return is_new;
+    if (table->old_ctrl != NULL) {
+        table->count -= table_erase_unmarked(table->old_ctrl, table->old_slots, table->old_capacity, NULL);
+    }
 }
 
 void table_dispose(Table *table) {
-    free(table->nodes);
+    free(table->ctrl);
+    free(table->slots);
+    free(table->old_ctrl);
+    free(table->old_slots);
     free(table);
 }
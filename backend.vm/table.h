@@ -3,27 +3,58 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "object.h"
+#include "value.h"
 
-typedef struct table_node {
-    string_t *key;
-    void *value;
-} table_node_t;
+/**
+ * Slots are probed in groups of 16, each slot has a control
+ * byte that is either empty, deleted or the low 7 bits of the
+ * hash of its key, so a whole group can be matched against a
+ * hash with a single SSE2/NEON compare
+ */
+#define TABLE_GROUP_WIDTH 16
+
+#define TABLE_CTRL_EMPTY ((int8_t) -128)
+#define TABLE_CTRL_DELETED ((int8_t) -2)
+
+typedef struct table_slot {
+    Value key;
+    Value value;
+} table_slot_t;
 
 typedef struct table {
-    int count;
+    size_t count;
     size_t capacity;
-    table_node_t *nodes;
+    size_t growth_left;
+    int8_t *ctrl;
+    table_slot_t *slots;
+
+    // when set, growing a big table keeps the old slots around
+    // and moves them a few at a time on the following operations
+    bool incremental;
+    size_t old_capacity;
+    size_t migrated;
+    int8_t *old_ctrl;
+    table_slot_t *old_slots;
 } Table;
 
 Table *table_create(size_t capacity);
 
-bool table_set(Table *table, string_t *key, void *value);
+void table_set_incremental(Table *table, bool incremental);
+
+bool table_set(Table *table, Value key, Value value);
+
+bool table_remove(Table *table, Value key);
+
+bool table_get(Table *table, Value key, Value *value);
+
+bool table_next(Table *table, size_t *cursor, Value *key, Value *value);
 
-bool table_remove(Table *table, string_t *key);
+string_t *table_find_string(Table *table, const char *values, size_t length, uint32_t hash);
 
-void *table_get(Table *table, string_t *key);
+void table_remove_unmarked(Table *table);
 
 void table_dispose(Table* table);
 
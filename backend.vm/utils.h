@@ -3,8 +3,6 @@
 
 #include <stddef.h>
 
-#define VM_DEBUG_TRACE
-
 #undef CHUNK_DEBUG
 #undef VALUE_DEBUG
 
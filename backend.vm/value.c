@@ -6,79 +6,103 @@
 #include "utils.h"
 
 // value functions>
-Value *ValueCreate(ValueType type, ObjectValue obj) {
-  Value *value = malloc(sizeof(Value));
-
-  value->type = type;
-  value->as = obj;
-
-  return value;
+ValueType ValueGetType(Value value) {
+  if (IS_DOUBLE(value)) return V_TYPE_DOUBLE;
+  if (IS_INT(value)) return V_TYPE_INT;
+  if (IS_BOOL(value)) return V_TYPE_BOOL;
+  if (IS_STR(value)) return V_TYPE_STR;
+  if (IS_OBJ(value)) return V_TYPE_OBJ;
+
+  return V_TYPE_NIL;
 }
 
-char *ValueToStr(Value *value) {
+char *ValueToStr(Value value) {
   char *str = malloc(80 * sizeof(char));
 
-  switch (value->type) {
-    case V_TYPE_BOOL:sprintf(str, "%d", value->as._bool);
+  switch (ValueGetType(value)) {
+    case V_TYPE_NIL:str = "nil";
+      break;
+    case V_TYPE_BOOL:sprintf(str, "%d", AS_BOOL(value));
       break;
-    case V_TYPE_DOUBLE:sprintf(str, "%f", value->as._double);
+    case V_TYPE_DOUBLE:sprintf(str, "%f", AS_DOUBLE(value));
       break;
     case V_TYPE_INT:
-            sprintf(str, "%d", value->as._int);
+            sprintf(str, "%d", AS_INT(value));
             break;
         case V_TYPE_OBJ:
+            if (IS_ROPE(value)) {
+              free(str);
+              str = malloc(AS_ROPE(value)->length + 1);
+              if (str == NULL || !RopeCopy(AS_ROPE(value), str)) return "ROPE";
+              break;
+            }
+
             str = "OBJECT";
             break;
         case V_TYPE_STR:
-            str = AS_CSTR(value->as._obj);
+            str = AS_CSTR(value);
             break;
     }
 
     return str;
 }
 
-Value *StrValueCreate(char *str) {
-  string_t *string = malloc(sizeof(string_t));
-
-  string->values = str;
-  string->length = strlen(str);
+Value StrValueCreate(Heap *heap, char *str) {
+  size_t length = strlen(str);
 
-  return ValueCreate(V_TYPE_STR, (ObjectValue) {
-      ._obj = (Object *) string
-  });
+  return OBJ_VALUE(StringCreate(heap, str, length, StringHash(str, length)));
 }
 
 // value array functions>
-ValueArray *ValueArrayCreate(int count, int capacity) {
-    ValueArray *array = malloc(sizeof(ValueArray));
-
+/**
+ * @param heap where the array and its values are allocated
+ * @return the array or NULL when @param heap is out of memory
+ */
+ValueArray *ValueArrayCreate(Heap *heap, int count, int capacity) {
+    ValueArray *array = HEAP_ALLOCATE(heap, ValueArray, 1);
+    if (array == NULL) return NULL;
+
+    array->heap = heap;
     array->capacity = capacity;
   array->count = count;
-  array->values = malloc(capacity * sizeof(Value));
+  array->values = capacity == 0 ? NULL : HEAP_ALLOCATE(heap, Value, capacity);
+
+  if (capacity != 0 && array->values == NULL) {
+    HeapFree(heap, array, sizeof(ValueArray));
+    return NULL;
+  }
 
     return array;
 }
 
-void ValueArrayWrite(ValueArray *array, Value value) {
+/**
+ * @return false when the heap of @param array is out of memory
+ */
+bool ValueArrayWrite(ValueArray *array, Value value) {
 #ifdef VALUE_DEBUG
-  printf("value_array_write(array = UNKNOWN, value = %s)\n", value_to_str(&value));
+  printf("value_array_write(array = UNKNOWN, value = %s)\n", ValueToStr(value));
 #endif
 
   if (array->capacity < array->count + 1) {
-    size_t old_capacity = array->capacity;
-    array->capacity = GROW_CAPACITY(array->capacity);
-    array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+    int capacity = GROW_CAPACITY(array->capacity);
+    Value *values = HEAP_GROW_ARRAY(array->heap, Value, array->values, array->capacity, capacity);
+    if (values == NULL) return false;
+
+    array->values = values;
+    array->capacity = capacity;
   }
 
   array->values[array->count] = value;
     array->count++;
+
+    return true;
 }
 
 char *ValueArrayDump(ValueArray *array) {
     char *str = malloc(80 * sizeof(char));
 
     for (size_t i = 0; i < array->capacity; ++i) {
-        sprintf(str, "%s, %s", str, ValueToStr(&array->values[i]));
+        sprintf(str, "%s, %s", str, ValueToStr(array->values[i]));
     }
 
     *str += ']';
@@ -87,6 +111,6 @@ char *ValueArrayDump(ValueArray *array) {
 }
 
 void ValueArrayDispose(ValueArray *array) {
-    free(array->values);
-    free(array);
+    HEAP_FREE_ARRAY(array->heap, Value, array->values, array->capacity);
+    HeapFree(array->heap, array, sizeof(ValueArray));
 }
@@ -2,22 +2,86 @@
 #define RUNTIME_VALUE_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "heap.h"
 #include "object.h"
 
-#define NUM_VALUE(value) value_create(V_TYPE_DOUBLE, \
-    (ObjectValue) { ._double = (value) })
-
-#define BOOL_VALUE(value) value_create(V_TYPE_BOOL, \
-    (ObjectValue) { ._bool = (value) })
-
-#define STR_VALUE(value) value_str_create(value)
-
-#define AS_STR(value) ((string_t*) (value))
-#define AS_CSTR(value) AS_STR((value))->values
+/**
+ * Values are NaN-boxed into 8 bytes:
+ *   - any bit pattern that doesn't have all the @a VALUE_QNAN bits set
+ *   is a plain IEEE 754 double;
+ *   - quiet NaNs with the sign bit set carry an object pointer in the
+ *   low 48 bits;
+ *   - quiet NaNs without the sign bit carry a 3 bit tag (bits 32..34)
+ *   and a 32 bit payload, used by nil, booleans, ints, the
+ *   undefined marker of global slots and the string references
+ *   of the chunks loaded from a file.
+ *
+ * Numbers and booleans are never heap allocated, they live directly in
+ * the stack slot or the constant pool entry.
+ */
+typedef uint64_t Value;
+
+#define VALUE_SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define VALUE_QNAN ((uint64_t) 0x7ffc000000000000)
+
+#define VALUE_TAG_SHIFT 32
+#define VALUE_TAG_MASK ((uint64_t) 0x7 << VALUE_TAG_SHIFT)
+
+#define VALUE_TAG_NIL 1
+#define VALUE_TAG_FALSE 2
+#define VALUE_TAG_TRUE 3
+#define VALUE_TAG_INT 4
+#define VALUE_TAG_UNDEFINED 5
+#define VALUE_TAG_STRING_REF 6
+
+#define VALUE_TAGGED(tag, payload) \
+    (VALUE_QNAN | ((uint64_t) (tag) << VALUE_TAG_SHIFT) | (uint64_t) (uint32_t) (payload))
+
+#define NIL_VALUE VALUE_TAGGED(VALUE_TAG_NIL, 0)
+#define FALSE_VALUE VALUE_TAGGED(VALUE_TAG_FALSE, 0)
+#define TRUE_VALUE VALUE_TAGGED(VALUE_TAG_TRUE, 0)
+
+// never visible to programs, marks global slots not assigned yet
+#define UNDEFINED_VALUE VALUE_TAGGED(VALUE_TAG_UNDEFINED, 0)
+
+// index in the string pool of a loaded chunk, the vm replaces it
+// by the string the first time it's used
+#define STRING_REF_VALUE(index) VALUE_TAGGED(VALUE_TAG_STRING_REF, index)
+
+#define NUM_VALUE(value) DoubleToValue(value)
+#define INT_VALUE(value) VALUE_TAGGED(VALUE_TAG_INT, (int32_t) (value))
+#define BOOL_VALUE(value) ((value) ? TRUE_VALUE : FALSE_VALUE)
+#define OBJ_VALUE(value) (VALUE_SIGN_BIT | VALUE_QNAN | (uint64_t) (uintptr_t) (value))
+#define STR_VALUE(heap, value) StrValueCreate(heap, value)
+
+#define IS_DOUBLE(value) (((value) & VALUE_QNAN) != VALUE_QNAN)
+#define IS_OBJ(value) \
+    (((value) & (VALUE_QNAN | VALUE_SIGN_BIT)) == (VALUE_QNAN | VALUE_SIGN_BIT))
+#define IS_TAGGED(value, tag) \
+    (((value) & (VALUE_SIGN_BIT | VALUE_QNAN | VALUE_TAG_MASK)) == VALUE_TAGGED(tag, 0))
+#define IS_NIL(value) ((value) == NIL_VALUE)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VALUE)
+#define IS_BOOL(value) (((value) | ((uint64_t) 1 << VALUE_TAG_SHIFT)) == TRUE_VALUE)
+#define IS_INT(value) IS_TAGGED(value, VALUE_TAG_INT)
+#define IS_STRING_REF(value) IS_TAGGED(value, VALUE_TAG_STRING_REF)
+#define IS_STR(value) (IS_OBJ(value) && AS_OBJ(value)->type == OBJ_T_STR)
+#define IS_ROPE(value) (IS_OBJ(value) && AS_OBJ(value)->type == OBJ_T_ROPE)
+#define IS_STR_OR_ROPE(value) (IS_STR(value) || IS_ROPE(value))
+
+#define AS_DOUBLE(value) ValueToDouble(value)
+#define AS_INT(value) ((int32_t) (uint32_t) (value))
+#define AS_STRING_REF(value) ((uint32_t) (value))
+#define AS_BOOL(value) ((value) == TRUE_VALUE)
+#define AS_OBJ(value) ((Object*) (uintptr_t) ((value) & ~(VALUE_SIGN_BIT | VALUE_QNAN)))
+#define AS_STR(value) ((string_t*) AS_OBJ(value))
+#define AS_CSTR(value) AS_STR(value)->values
+#define AS_ROPE(value) ((rope_t*) AS_OBJ(value))
 
 typedef enum {
+  V_TYPE_NIL,
   V_TYPE_OBJ,
   V_TYPE_INT,
   V_TYPE_DOUBLE,
@@ -25,37 +89,65 @@ typedef enum {
   V_TYPE_STR,
 } ValueType;
 
-typedef union {
-  int _int;
-  double _double;
-  Object *_obj;
-  bool _bool;
-} ObjectValue;
-
-typedef struct {
-  ValueType type;
-  ObjectValue as;
-} Value;
-
 typedef struct {
   int count;
   int capacity;
   Value *values;
+  Heap *heap;
 } ValueArray;
 
-// value functions>
-Value *ValueCreate(ValueType type, ObjectValue obj);
+static inline Value DoubleToValue(double d) {
+  Value value;
+  memcpy(&value, &d, sizeof(double));
+  return value;
+}
+
+static inline double ValueToDouble(Value value) {
+  double d;
+  memcpy(&d, &value, sizeof(double));
+  return d;
+}
+
+/**
+ * Reads an int or a double @param value as a double, for the
+ * opcodes that don't know the type of their operands
+ */
+static inline double ValueToNumber(Value value) {
+  return IS_INT(value) ? (double) AS_INT(value) : ValueToDouble(value);
+}
+
+/**
+ * Ints wrap around on overflow, like two's complement 32 bit
+ * integers, the math is done unsigned to stay defined in C
+ */
+static inline int32_t IntAdd(int32_t a, int32_t b) {
+  return (int32_t) ((uint32_t) a + (uint32_t) b);
+}
+
+static inline int32_t IntSub(int32_t a, int32_t b) {
+  return (int32_t) ((uint32_t) a - (uint32_t) b);
+}
+
+static inline int32_t IntMult(int32_t a, int32_t b) {
+  return (int32_t) ((uint32_t) a * (uint32_t) b);
+}
+
+// @param b must not be 0
+static inline int32_t IntDiv(int32_t a, int32_t b) {
+  return b == -1 ? IntSub(0, a) : a / b;
+}
 
-Value *StrValueCreate(char *str);
+// value functions>
+ValueType ValueGetType(Value value);
 
-void ValueDispose(Value *value);
+Value StrValueCreate(Heap *heap, char *str);
 
-char *ValueToStr(Value *value);
+char *ValueToStr(Value value);
 
 // value_array functions>
-ValueArray *ValueArrayCreate(int count, int capacity);
+ValueArray *ValueArrayCreate(Heap *heap, int count, int capacity);
 
-void ValueArrayWrite(ValueArray *array, Value value);
+bool ValueArrayWrite(ValueArray *array, Value value);
 
 char *ValueArrayDump(ValueArray *array);
 
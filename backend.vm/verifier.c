@@ -0,0 +1,453 @@
+#include <stdlib.h>
+
+#include "verifier.h"
+#include "regvm.h"
+
+/**
+ * @return the opcode that @param op is a _WIDE variant of, or op
+ */
+static Opcode VerifyNarrowOpcode(Opcode op) {
+  switch (op) {
+    case OP_CONST_WIDE16:
+    case OP_CONST_WIDE24:
+      return OP_CONST;
+    case OP_GET_GLOBAL_SLOT_WIDE16:
+    case OP_GET_GLOBAL_SLOT_WIDE24:
+      return OP_GET_GLOBAL_SLOT;
+    case OP_SET_GLOBAL_SLOT_WIDE16:
+    case OP_SET_GLOBAL_SLOT_WIDE24:
+      return OP_SET_GLOBAL_SLOT;
+    // the quick variants check their operands, like the generic ones
+    case OP_SUM_QUICK_I32:
+    case OP_SUM_QUICK_F64:
+      return OP_SUM;
+    case OP_SUB_QUICK_I32:
+    case OP_SUB_QUICK_F64:
+      return OP_SUB;
+    case OP_MULT_QUICK_I32:
+    case OP_MULT_QUICK_F64:
+      return OP_MULT;
+    case OP_DIV_QUICK_I32:
+    case OP_DIV_QUICK_F64:
+      return OP_DIV;
+    case OP_NEGATE_QUICK_I32:
+    case OP_NEGATE_QUICK_F64:
+      return OP_NEGATE;
+    case OP_ACCESS_GLOBAL_QUICK:
+      return OP_ACCESS_GLOBAL;
+    default:
+      return op;
+  }
+}
+
+static VerifyType VerifyConstType(Value value) {
+  if (IS_STRING_REF(value) || IS_STR_OR_ROPE(value)) return kTypeString;
+  if (IS_DOUBLE(value)) return kTypeDouble;
+  if (IS_INT(value)) return kTypeInt;
+  if (IS_BOOL(value)) return kTypeBool;
+  if (IS_NIL(value)) return kTypeNil;
+
+  return kTypeAny;
+}
+
+/**
+ * The generic arithmetic handlers take ints and doubles, the compiler
+ * emits ints for Int constants. Unknown values are accepted, like for
+ * the strings the handlers check their tags at run time
+ */
+static bool VerifyIsNumeric(VerifyType type) {
+  return type == kTypeDouble || type == kTypeInt || type == kTypeAny;
+}
+
+/**
+ * The _I32 and _F64 handlers read their operands without checking
+ * the tags, so unknown values are rejected: a chunk that reads a
+ * global it didn't set must use the generic opcodes
+ */
+static bool VerifyIsInt(VerifyType type) {
+  return type == kTypeInt;
+}
+
+static bool VerifyIsDouble(VerifyType type) {
+  return type == kTypeDouble;
+}
+
+// OP_NOT checks the tag of unknown values at run time
+static bool VerifyIsBool(VerifyType type) {
+  return type == kTypeBool || type == kTypeAny;
+}
+
+/**
+ * The string handlers dereference their operands, they still check
+ * the type of unknown values at run time
+ */
+static bool VerifyIsString(VerifyType type) {
+  return type == kTypeString || type == kTypeAny;
+}
+
+/**
+ * Checks the operand types of @param op against the slots below
+ * @param top and sets @param pushed to the type it pushes
+ */
+static bool VerifyOperands(Opcode op, const VerifyType *top, VerifyType *pushed) {
+  switch (op) {
+    case OP_NEGATE:
+      *pushed = kTypeDouble;
+      return VerifyIsNumeric(top[-1]);
+    case OP_SUM:
+    case OP_SUB:
+    case OP_MULT:
+    case OP_DIV:
+      *pushed = kTypeDouble;
+      return VerifyIsNumeric(top[-1]) && VerifyIsNumeric(top[-2]);
+    case OP_NEGATE_I32:
+      *pushed = kTypeInt;
+      return VerifyIsInt(top[-1]);
+    case OP_SUM_I32:
+    case OP_SUB_I32:
+    case OP_MULT_I32:
+    case OP_DIV_I32:
+      *pushed = kTypeInt;
+      return VerifyIsInt(top[-1]) && VerifyIsInt(top[-2]);
+    case OP_LESS_I32:
+    case OP_LESS_EQUAL_I32:
+    case OP_GREATER_I32:
+    case OP_GREATER_EQUAL_I32:
+    case OP_EQUAL_I32:
+    case OP_NOT_EQUAL_I32:
+      *pushed = kTypeBool;
+      return VerifyIsInt(top[-1]) && VerifyIsInt(top[-2]);
+    case OP_I32_TO_F64:
+      *pushed = kTypeDouble;
+      return VerifyIsInt(top[-1]);
+    case OP_NEGATE_F64:
+      *pushed = kTypeDouble;
+      return VerifyIsDouble(top[-1]);
+    case OP_SUM_F64:
+    case OP_SUB_F64:
+    case OP_MULT_F64:
+    case OP_DIV_F64:
+      *pushed = kTypeDouble;
+      return VerifyIsDouble(top[-1]) && VerifyIsDouble(top[-2]);
+    case OP_TRUE:
+    case OP_FALSE:
+      *pushed = kTypeBool;
+      return true;
+    case OP_NOT:
+      *pushed = kTypeBool;
+      return VerifyIsBool(top[-1]);
+    case OP_CONCAT:
+      *pushed = kTypeString;
+      return VerifyIsString(top[-1]) && VerifyIsString(top[-2]);
+    case OP_STORE_GLOBAL:
+      return VerifyIsString(top[-2]);
+    case OP_ACCESS_GLOBAL:
+      *pushed = kTypeAny;
+      return VerifyIsString(top[-1]);
+    case OP_AWAIT:
+      // the handler checks the tag of unknown ids
+      *pushed = kTypeBool;
+      return VerifyIsInt(top[-1]) || top[-1] == kTypeAny;
+    default:
+      return true;
+  }
+}
+
+/**
+ * Checks one opcode @param step against the slots of @param stack
+ * and applies it to the stack and to the @param globals types
+ */
+static VerifyResult VerifyStep(Chunk *chunk, instruction_t step, VerifyType *stack, int *depth,
+                               VerifyType *globals, bool *returned) {
+  Opcode op = VerifyNarrowOpcode(step.op);
+  uint32_t operand = step.operand;
+
+  if ((op == OP_CONST && operand >= (uint32_t) chunk->consts->count) ||
+      ((op == OP_GET_GLOBAL_SLOT || op == OP_SET_GLOBAL_SLOT) &&
+          operand >= (uint32_t) chunk->globals->count)) {
+    return kVerifyBadOperand;
+  }
+
+  // the name of the task to spawn
+  if (op == OP_SPAWN && (operand >= (uint32_t) chunk->consts->count ||
+      VerifyConstType(chunk->consts->values[operand]) != kTypeString)) {
+    return kVerifyBadOperand;
+  }
+
+  if (OpcodePops(op) > *depth) return kVerifyStackUnderflow;
+
+  VerifyType pushed = kTypeAny;
+  if (!VerifyOperands(op, stack + *depth, &pushed)) return kVerifyTypeMismatch;
+
+  switch (op) {
+    case OP_RET:
+      *returned = true;
+      break;
+    case OP_CONST:
+      pushed = VerifyConstType(chunk->consts->values[operand]);
+      break;
+    case OP_GET_GLOBAL_SLOT:
+      pushed = globals[operand];
+      break;
+    case OP_SPAWN:
+      pushed = kTypeInt;
+      break;
+    case OP_SET_GLOBAL_SLOT:
+      globals[operand] = stack[*depth - 1];
+      break;
+    case OP_STORE_GLOBAL:
+      // a name may be any of the slots
+      for (int slot = 0; slot < chunk->globals->count; slot++) {
+        globals[slot] = kTypeAny;
+      }
+      break;
+    default:
+      break;
+  }
+
+  *depth -= OpcodePops(op);
+  if (OpcodePushes(op) > 0) stack[(*depth)++] = pushed;
+
+  return kVerifyOK;
+}
+
+/**
+ * Reads the type of the register or constant @param operand into
+ * @param type, a register must have been written before
+ */
+static bool VerifyRegisterOperand(Chunk *chunk, uint8_t operand, const VerifyType *registers,
+                                  const bool *written, VerifyType *type) {
+  if (operand & REG_CONST_BIT) {
+    int index = operand & ~REG_CONST_BIT;
+    if (index >= chunk->consts->count) return false;
+
+    *type = VerifyConstType(chunk->consts->values[index]);
+    return true;
+  }
+
+  if (!written[operand]) return false;
+
+  *type = registers[operand];
+  return true;
+}
+
+/**
+ * ChunkVerify for the register instruction set: instead of a stack
+ * depth, every register read must have been written before by the
+ * only path, and the operand types are checked with the rules of
+ * the stack opcode the instruction stands for. max_stack is set to
+ * the count of registers
+ */
+static VerifyResult ChunkVerifyRegisters(Chunk *chunk, int *offset) {
+  VerifyType *globals = malloc(sizeof(VerifyType) * (chunk->globals->count + 1));
+  if (globals == NULL) return kVerifyOutOfMemory;
+
+  for (int i = 0; i < chunk->globals->count; i++) {
+    globals[i] = kTypeAny;
+  }
+
+  VerifyType registers[REG_MAX];
+  bool written[REG_MAX] = {false};
+
+  *offset = 0;
+
+  VerifyResult result = kVerifyNoReturn;
+  bool returned = false;
+  int register_count = 0;
+  int i = 0;
+
+  while (i < chunk->count) {
+    uint8_t raw = chunk->code[i];
+    *offset = i;
+
+    if (raw >= REG_OP_COUNT) {
+      result = kVerifyBadOpcode;
+      break;
+    }
+
+    RegFormat format = RegOpcodeFormat((RegOpcode) raw);
+    int operands = RegFormatOperands(format);
+
+    if (operands >= chunk->count - i) {
+      result = kVerifyTruncated;
+      break;
+    }
+
+    reg_instruction_t instruction;
+    i += RegInstructionDecode(chunk->code + i, &instruction);
+
+    if (returned) continue;
+
+    Opcode op = RegOpcodeStackOpcode(instruction.op);
+    bool writes = format == kRegFormatA || format == kRegFormatAB ||
+        format == kRegFormatABC || format == kRegFormatAK;
+
+    // the operand types, in the order the stack opcode pops them
+    VerifyType operand_types[2] = {kTypeAny, kTypeAny};
+    bool valid = !writes || instruction.a < REG_MAX;
+
+    switch (format) {
+      case kRegFormatAB:
+      case kRegFormatKB:
+        valid &= VerifyRegisterOperand(chunk, instruction.b, registers, written, &operand_types[0]);
+        break;
+      case kRegFormatABC:
+        valid &= VerifyRegisterOperand(chunk, instruction.b, registers, written, &operand_types[0]);
+        valid &= VerifyRegisterOperand(chunk, instruction.c, registers, written, &operand_types[1]);
+        break;
+      default:
+        break;
+    }
+
+    if ((op == OP_CONST && instruction.k >= (uint32_t) chunk->consts->count) ||
+        ((op == OP_GET_GLOBAL_SLOT || op == OP_SET_GLOBAL_SLOT) &&
+            instruction.k >= (uint32_t) chunk->globals->count)) {
+      valid = false;
+    }
+
+    if (!valid) {
+      result = kVerifyBadOperand;
+      break;
+    }
+
+    VerifyType pushed = kTypeAny;
+    if (!VerifyOperands(op, operand_types + OpcodePops(op), &pushed)) {
+      result = kVerifyTypeMismatch;
+      break;
+    }
+
+    switch (op) {
+      case OP_RET:
+        returned = true;
+        break;
+      case OP_CONST:
+        pushed = VerifyConstType(chunk->consts->values[instruction.k]);
+        break;
+      case OP_GET_GLOBAL_SLOT:
+        pushed = globals[instruction.k];
+        break;
+      case OP_SET_GLOBAL_SLOT:
+        globals[instruction.k] = operand_types[0];
+        break;
+      default:
+        break;
+    }
+
+    if (writes) {
+      registers[instruction.a] = pushed;
+      written[instruction.a] = true;
+      if (instruction.a >= register_count) register_count = instruction.a + 1;
+    }
+  }
+
+  if (returned && i == chunk->count) {
+    result = kVerifyOK;
+    chunk->verified = true;
+    chunk->max_stack = register_count;
+  }
+
+  free(globals);
+
+  return result;
+}
+
+// verifier functions>
+/**
+ * Runs once per chunk, before it's executed: every opcode must be
+ * known, have its operands inside the code and in range, never pop
+ * more values than the stack has, get operands of the types its
+ * handler reads, and the code must reach an OP_RET. The handlers
+ * can then run without any check, and the vm reserves max_stack
+ * slots once instead of checking every push.
+ *
+ * The code has no jumps yet, so a single pass in order follows the
+ * only path, and the depth and types of every slot are exact.
+ *
+ * @param offset receives the offset of the rejected instruction
+ */
+VerifyResult ChunkVerify(Chunk *chunk, int *offset) {
+  if (chunk->verified) return kVerifyOK;
+  if (chunk->registers) return ChunkVerifyRegisters(chunk, offset);
+
+  VerifyType *stack = malloc(sizeof(VerifyType) * (chunk->count + 1));
+  VerifyType *globals = malloc(sizeof(VerifyType) * (chunk->globals->count + 1));
+  if (stack == NULL || globals == NULL) {
+    free(stack);
+    free(globals);
+    return kVerifyOutOfMemory;
+  }
+
+  for (int i = 0; i < chunk->globals->count; i++) {
+    globals[i] = kTypeAny;
+  }
+
+  *offset = 0;
+
+  VerifyResult result = kVerifyNoReturn;
+  bool returned = false;
+  int depth = 0;
+  int max_depth = 0;
+  int i = 0;
+
+  while (i < chunk->count) {
+    uint8_t raw = chunk->code[i];
+    *offset = i;
+
+    if (raw >= OP_COUNT) {
+      result = kVerifyBadOpcode;
+      break;
+    }
+
+    int operands = OpcodeOperands((Opcode) raw);
+
+    if (operands >= chunk->count - i) {
+      result = kVerifyTruncated;
+      break;
+    }
+
+    instruction_t steps[INSTRUCTION_MAX_STEPS];
+    int step_count = InstructionExpand(chunk->code + i, steps);
+    i += 1 + operands;
+
+    // the instructions after the first return are never executed,
+    // they only need to decode
+    if (returned) continue;
+
+    // a superinstruction is checked as the opcodes it stands for
+    VerifyResult step_result = kVerifyOK;
+    for (int step = 0; step < step_count && step_result == kVerifyOK; step++) {
+      step_result = VerifyStep(chunk, steps[step], stack, &depth, globals, &returned);
+      if (depth > max_depth) max_depth = depth;
+    }
+
+    if (step_result != kVerifyOK) {
+      result = step_result;
+      break;
+    }
+  }
+
+  if (returned && i == chunk->count) {
+    result = kVerifyOK;
+    chunk->verified = true;
+    chunk->max_stack = max_depth;
+  }
+
+  free(stack);
+  free(globals);
+
+  return result;
+}
+
+const char *VerifyResultName(VerifyResult result) {
+  switch (result) {
+    case kVerifyOK: return "ok";
+    case kVerifyBadOpcode: return "unknown opcode";
+    case kVerifyTruncated: return "missing operand";
+    case kVerifyBadOperand: return "operand out of range";
+    case kVerifyStackUnderflow: return "stack underflow";
+    case kVerifyTypeMismatch: return "operand type mismatch";
+    case kVerifyNoReturn: return "code doesn't return";
+    case kVerifyOutOfMemory: return "out of memory";
+    default: return "unknown error";
+  }
+}
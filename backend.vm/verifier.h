@@ -0,0 +1,36 @@
+#ifndef RUNTIME_VERIFIER_H
+#define RUNTIME_VERIFIER_H
+
+#include "chunk.h"
+
+/**
+ * The type of a stack slot or global slot as known by the verifier,
+ * kTypeAny is a value only known at run time, like a global that the
+ * chunk reads before setting it
+ */
+typedef enum {
+  kTypeAny,
+  kTypeNil,
+  kTypeBool,
+  kTypeInt,
+  kTypeDouble,
+  kTypeString,
+} VerifyType;
+
+typedef enum {
+  kVerifyOK,
+  kVerifyBadOpcode,
+  kVerifyTruncated,
+  kVerifyBadOperand,
+  kVerifyStackUnderflow,
+  kVerifyTypeMismatch,
+  kVerifyNoReturn,
+  kVerifyOutOfMemory
+} VerifyResult;
+
+// verifier functions>
+VerifyResult ChunkVerify(Chunk *chunk, int *offset);
+
+const char *VerifyResultName(VerifyResult result);
+
+#endif //RUNTIME_VERIFIER_H
@@ -2,249 +2,1359 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "vm.h"
+#include "bytecode.h"
+#include "gc.h"
+#include "regvm.h"
+#include "jit.h"
+#include "verifier.h"
 #include "utils.h"
+#include "debug.h"
+#include "scheduler.h"
+
+/**
+ * Threaded dispatch needs the labels-as-values extension,
+ * other compilers fall back to the portable switch loop
+ */
+#if defined(VM_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define VM_THREADED_DISPATCH
+#endif
 
 // vm functions>
 Vm *VmCreate(Flags flags) {
   Vm *vm = malloc(sizeof(Vm));
+  if (vm == NULL) return NULL;
 
   vm->pc = NULL;
   vm->chunk = NULL;
   vm->objects = NULL;
+  vm->next_gc = GC_INITIAL_THRESHOLD;
+  vm->gc_stress = flags.gc_stress;
+  vm->gray_stack = NULL;
+  vm->gray_count = 0;
+  vm->gray_capacity = 0;
+  vm->heap = HeapCreate(flags.memory);
   vm->strings = table_create(10);
   vm->globals = table_create(10);
-  vm->heap = HeapCreate(flags.memory);
+  table_set_incremental(vm->globals, true);
+  vm->global_values = ValueArrayCreate(vm->heap, 0, 0);
+  vm->linked = NULL;
   vm->stack = StackCreate(10);
+  vm->tracer = flags.trace ? TraceWriterCreate(stdout) : NULL;
+  vm->profiler = flags.profile ? ProfilerCreate(flags.profile_hz) : NULL;
+  vm->views = NULL;
+  vm->view_count = 0;
+  vm->view_capacity = 0;
+  vm->chunks = NULL;
+  vm->chunk_count = 0;
+  vm->chunk_capacity = 0;
+  vm->jit_threshold = flags.jit ? (flags.jit_threshold < 1 ? 1 : flags.jit_threshold) : 0;
+  vm->jit_check = flags.jit_check;
+  vm->fiber = NULL;
 
   return vm;
 }
 
+/**
+ * Allocates on vm->heap, collecting the garbage and trying again
+ * once when the heap limit was reached
+ *
+ * @return the block or NULL when the heap is out of memory
+ */
+static void *VmAllocate(Vm *vm, size_t size) {
+  void *ptr = HeapAlloc(vm->heap, size);
+
+  if (ptr == NULL) {
+    GcCollect(vm);
+    ptr = HeapAlloc(vm->heap, size);
+  }
+
+  return ptr;
+}
+
+/**
+ * Returns the canonical string with the contents of @param values,
+ * taking the ownership of the buffer: it was allocated on vm->heap
+ * with length + 1 bytes and is freed when an equal string was already
+ * interned in vm->strings
+ *
+ * It may collect the garbage, the values the caller still needs
+ * must be reachable from the roots
+ *
+ * @return the string or NULL when the heap is out of memory
+ */
+string_t *VmTakeString(Vm *vm, char *values, size_t length) {
+  if (length <= STRING_INLINE_MAX) {
+    string_t *string = VmCopyString(vm, values, length);
+    HeapFree(vm->heap, values, length + 1);
+
+    return string;
+  }
+
+  GcMaybeCollect(vm);
+
+  uint32_t hash = StringHash(values, length);
+  string_t *interned = table_find_string(vm->strings, values, length, hash);
+
+  if (interned != NULL) {
+    HeapFree(vm->heap, values, length + 1);
+    return interned;
+  }
+
+  string_t *string = StringCreate(vm->heap, values, length, hash);
+  if (string == NULL) {
+    GcCollect(vm);
+    string = StringCreate(vm->heap, values, length, hash);
+  }
+
+  if (string == NULL) {
+    HeapFree(vm->heap, values, length + 1);
+    return NULL;
+  }
+
+  string->holder.next = vm->objects;
+  vm->objects = (Object *) string;
+
+  table_set(vm->strings, OBJ_VALUE(string), NIL_VALUE);
+
+  return string;
+}
+
+/**
+ * Like VmTakeString, but copies @param values, the short strings are
+ * copied inline and the interned ones don't allocate at all
+ *
+ * @return the string or NULL when the heap is out of memory
+ */
+string_t *VmCopyString(Vm *vm, const char *values, size_t length) {
+  if (length > STRING_INLINE_MAX) {
+    char *copy = VmAllocate(vm, length + 1);
+    if (copy == NULL) return NULL;
+
+    memcpy(copy, values, length);
+    copy[length] = '\0';
+
+    return VmTakeString(vm, copy, length);
+  }
+
+  GcMaybeCollect(vm);
+
+  uint32_t hash = StringHash(values, length);
+  string_t *interned = table_find_string(vm->strings, values, length, hash);
+  if (interned != NULL) return interned;
+
+  string_t *string = StringCreateInline(vm->heap, values, length, hash);
+  if (string == NULL) {
+    GcCollect(vm);
+    string = StringCreateInline(vm->heap, values, length, hash);
+  }
+
+  if (string == NULL) return NULL;
+
+  string->holder.next = vm->objects;
+  vm->objects = (Object *) string;
+
+  table_set(vm->strings, OBJ_VALUE(string), NIL_VALUE);
+
+  return string;
+}
+
+/**
+ * Concatenates @param left and @param right, short results are
+ * copied into a string right away and the long ones become ropes
+ *
+ * @return the string or rope, or NULL when the heap is out of memory
+ */
+Object *VmConcat(Vm *vm, Object *left, Object *right) {
+  size_t length = StringLength(left) + StringLength(right);
+
+  if (StringLength(left) == 0) return right;
+  if (StringLength(right) == 0) return left;
+
+  if (length <= STRING_INLINE_MAX) {
+    // ropes are always longer, so both are plain strings here
+    string_t *s0 = (string_t *) left;
+    string_t *s1 = (string_t *) right;
+    char values[STRING_INLINE_MAX + 1];
+
+    memcpy(values, s0->values, s0->length);
+    memcpy(values + s0->length, s1->values, s1->length);
+
+    return (Object *) VmCopyString(vm, values, length);
+  }
+
+  GcMaybeCollect(vm);
+
+  rope_t *rope = RopeCreate(vm->heap, left, right);
+  if (rope == NULL) {
+    GcCollect(vm);
+    rope = RopeCreate(vm->heap, left, right);
+  }
+
+  if (rope == NULL) return NULL;
+
+  rope->holder.next = vm->objects;
+  vm->objects = (Object *) rope;
+
+  return (Object *) rope;
+}
+
+/**
+ * Returns the string with the characters of @param value, ropes are
+ * flattened the first time and keep the result for the next reads
+ *
+ * @param value a string or a rope, that must be reachable from the roots
+ * @return the string or NULL when the heap is out of memory
+ */
+string_t *VmFlatten(Vm *vm, Value value) {
+  if (IS_STR(value)) return AS_STR(value);
+
+  rope_t *rope = AS_ROPE(value);
+  if (rope->flat != NULL) return rope->flat;
+
+  char *values = VmAllocate(vm, rope->length + 1);
+  if (values == NULL) return NULL;
+
+  if (!RopeCopy(rope, values)) {
+    HeapFree(vm->heap, values, rope->length + 1);
+    return NULL;
+  }
+
+  string_t *flat = VmTakeString(vm, values, rope->length);
+  if (flat == NULL) return NULL;
+
+  rope->flat = flat;
+  rope->left = NULL;
+  rope->right = NULL;
+
+  return flat;
+}
+
+/**
+ * Makes @param chunk a root of the vm: VmEval writes strings of the
+ * vm heap into its consts and globals, which are read again by the
+ * next runs. A chunk is rooted by the last vm that ran it, the
+ * chunks that vms share run through VmEvalShared
+ *
+ * @return false when out of memory
+ */
+static bool VmRootChunk(Vm *vm, Chunk *chunk) {
+  if (chunk->vm == vm) return true;
+
+  if (vm->chunk_count >= vm->chunk_capacity) {
+    int capacity = GROW_CAPACITY(vm->chunk_capacity);
+    Chunk **chunks = realloc(vm->chunks, capacity * sizeof(Chunk *));
+    if (chunks == NULL) return false;
+
+    vm->chunks = chunks;
+    vm->chunk_capacity = capacity;
+  }
+
+  if (chunk->vm != NULL) VmForgetChunk(chunk->vm, chunk);
+
+  chunk->vm = vm;
+  vm->chunks[vm->chunk_count++] = chunk;
+
+  return true;
+}
+
+/**
+ * Drops @param chunk from the roots of @param vm, ChunkDispose calls
+ * it, so the strings only the chunk referenced are collected
+ */
+void VmForgetChunk(Vm *vm, Chunk *chunk) {
+  for (int i = 0; i < vm->chunk_count; i++) {
+    if (vm->chunks[i] != chunk) continue;
+
+    vm->chunks[i] = vm->chunks[--vm->chunk_count];
+    break;
+  }
+
+  if (vm->chunk == chunk) {
+    vm->chunk = NULL;
+    vm->pc = NULL;
+  }
+
+  if (vm->linked == chunk) vm->linked = NULL;
+
+  chunk->vm = NULL;
+}
+
+/**
+ * Replaces the string reference at @param index of @param values
+ * by the interned string it points to in the pool of @param chunk
+ */
+InterpretResult VmLoadString(Vm *vm, Chunk *chunk, ValueArray *values, int index) {
+  const char *chars;
+  uint32_t length;
+
+  if (!BytecodeString(chunk, AS_STRING_REF(values->values[index]), &chars, &length)) return kResultError;
+
+  string_t *string = VmCopyString(vm, chars, length);
+  if (string == NULL) return kResultOutOfMemory;
+
+  values->values[index] = OBJ_VALUE(string);
+
+  return kResultOK;
+}
+
+/**
+ * Interns the strings of @param values, so that equal names
+ * share one string_t and globals can be found by identity
+ */
+void VmInternValues(Vm *vm, ValueArray *values) {
+  for (int i = 0; i < values->count; i++) {
+    Value value = values->values[i];
+    if (!IS_STR(value)) continue;
+
+    string_t *string = AS_STR(value);
+    string_t *interned = table_find_string(vm->strings, string->values, string->length, string->hash);
+
+    if (interned == NULL) {
+      table_set(vm->strings, OBJ_VALUE(string), NIL_VALUE);
+    } else if (interned != string) {
+      values->values[i] = OBJ_VALUE(interned);
+    }
+  }
+}
+
+/**
+ * Rebuilds the globals of the vm with the slots of @param chunk
+ * first, see VmLinkGlobals
+ *
+ * @return false when the heap is out of memory
+ */
+static bool VmRenumberGlobals(Vm *vm, Chunk *chunk) {
+  ValueArray *values = ValueArrayCreate(vm->heap, 0, chunk->globals->count);
+  if (values == NULL) return false;
+
+  Table *globals = table_create(chunk->globals->count);
+  table_set_incremental(globals, true);
+
+  for (int i = 0; i < chunk->globals->count; i++) {
+    Value name = chunk->globals->values[i];
+    Value slot;
+
+    Value value = UNDEFINED_VALUE;
+    if (table_get(vm->globals, name, &slot)) {
+      value = vm->global_values->values[AS_INT(slot)];
+    }
+
+    // the capacity was reserved up front
+    ValueArrayWrite(values, value);
+    table_set(globals, name, INT_VALUE(i));
+  }
+
+  Value name, slot, ignored;
+  for (size_t cursor = 0; table_next(vm->globals, &cursor, &name, &slot);) {
+    if (table_get(globals, name, &ignored)) continue;
+
+    table_set(globals, name, INT_VALUE(values->count));
+
+    if (!ValueArrayWrite(values, vm->global_values->values[AS_INT(slot)])) {
+      table_dispose(globals);
+      ValueArrayDispose(values);
+      return false;
+    }
+  }
+
+  table_dispose(vm->globals);
+  ValueArrayDispose(vm->global_values);
+
+  vm->globals = globals;
+  vm->global_values = values;
+
+  // the inline caches of every chunk may point to the old slots
+  for (int i = 0; i < vm->chunk_count; i++) {
+    Chunk *cached = vm->chunks[i];
+    if (cached->global_cache == NULL) continue;
+
+    for (int offset = 0; offset < cached->count; offset++) {
+      cached->global_cache[offset] = (global_cache_t) {NIL_VALUE, 0};
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Links the global slots of @param chunk into the vm: slot i of the
+ * chunk becomes slot i of vm->global_values, keeping the values of
+ * globals the vm already had. The slots stay where they are when
+ * they already match, the names the vm doesn't have yet are appended,
+ * otherwise the globals are renumbered: the ones only known by name
+ * (defined through OP_STORE_GLOBAL) are moved after the chunk ones,
+ * and the global caches of every chunk of the vm are cleared
+ *
+ * @return false when the heap is out of memory
+ */
+bool VmLinkGlobals(Vm *vm, Chunk *chunk) {
+  // only OP_STORE_GLOBAL changed the globals since, it appends
+  if (vm->linked == chunk) return true;
+
+  int linked = 0;
+  for (; linked < chunk->globals->count; linked++) {
+    Value name = chunk->globals->values[linked];
+    Value slot;
+
+    if (table_get(vm->globals, name, &slot)) {
+      if (AS_INT(slot) != linked) break;
+    } else {
+      if (vm->global_values->count != linked) break;
+      if (!ValueArrayWrite(vm->global_values, UNDEFINED_VALUE)) return false;
+
+      table_set(vm->globals, name, INT_VALUE(linked));
+    }
+  }
+
+  if (linked < chunk->globals->count && !VmRenumberGlobals(vm, chunk)) return false;
+
+  vm->linked = chunk;
+
+  return true;
+}
+
+/**
+ * Allocates the inline caches of the OP_ACCESS_GLOBAL of @param chunk
+ * the first time one is quickened
+ *
+ * @return the caches or NULL when the heap is out of memory, the
+ * instructions then stay generic
+ */
+static global_cache_t *VmGlobalCache(Chunk *chunk) {
+  if (chunk->global_cache != NULL) return chunk->global_cache;
+
+  global_cache_t *cache = HEAP_ALLOCATE(chunk->heap, global_cache_t, chunk->count);
+  if (cache == NULL) return NULL;
+
+  for (int i = 0; i < chunk->count; i++) {
+    cache[i] = (global_cache_t) {NIL_VALUE, 0};
+  }
+
+  chunk->global_cache = cache;
+
+  return cache;
+}
+
 InterpretResult VmEvalImpl(Vm *vm) {
+  register uint8_t *pc = vm->pc;
+  register Value *sp = vm->stack->values + vm->stack->top;
+  Value *stack_start = vm->stack->values;
+  Value *consts = vm->chunk->consts->values;
+  Value *globals = vm->global_values->values;
+
+#define READ_INST() (*pc++)
+#define READ_U16() (pc += 2, (uint32_t) pc[-2] | (uint32_t) pc[-1] << 8)
+#define READ_U24() (pc += 3, (uint32_t) pc[-3] | (uint32_t) pc[-2] << 8 | (uint32_t) pc[-1] << 16)
+#define READ_NUMBER() ValueToNumber(POP())
+#define READ_INT() AS_INT(POP())
+#define READ_DOUBLE() AS_DOUBLE(POP())
+#define READ_BOOL() AS_BOOL(POP())
+#define READ_STR() AS_STR(POP())
+
+#define POP() (*--sp)
+#define PEEK() (sp[-1])
+// the verifier checked the depth and VmEval reserved max_stack
+// slots, so pushes and pops don't check the bounds
+#define PUSH(value) (*sp++ = (value))
+
+#define VM_RETURN(result) \
+    do { \
+      VM_SYNC(); \
+      return (result); \
+    } while (0)
+
+// replaces a rope on the stack by its flattened string
+#define FLATTEN(slot) \
+    do { \
+      if (!IS_STR(slot)) { \
+        if (!IS_ROPE(slot)) VM_RETURN(kResultError); \
+        VM_SYNC(); \
+        string_t *flat = VmFlatten(vm, slot); \
+        if (flat == NULL) VM_RETURN(kResultOutOfMemory); \
+        (slot) = OBJ_VALUE(flat); \
+      } \
+    } while (0)
+
+// the generic ops take operands the verifier couldn't type, a
+// value of another type read as a double may forge an object
+#define CHECK_NUMBER(slot) \
+    do { \
+      if (!IS_INT(slot) && !IS_DOUBLE(slot)) VM_RETURN(kResultError); \
+    } while (0)
+
+// writes the registers back, before anything that may collect
+// the garbage and walk the stack
+#define VM_SYNC() \
+    do { \
+      vm->pc = pc; \
+      vm->stack->top = (int) (sp - stack_start); \
+    } while (0)
+
+// traces and profiles the instruction at pc, before it runs
+#define VM_HOOK() \
+    do { \
+      if (vm->tracer != NULL) TraceInstruction(vm->tracer, vm->chunk, pc, stack_start, sp); \
+      if (vm->profiler != NULL) ProfilerInstruction(vm->profiler, vm->chunk, pc, sp); \
+    } while (0)
+
+#ifdef VM_THREADED_DISPATCH
+  static void *dispatch_table[OP_COUNT] = {
+#define OPCODE_LABEL(name, operands, pops, pushes) [name] = &&L_##name,
+      OPCODES(OPCODE_LABEL)
+#undef OPCODE_LABEL
+  };
+
+  // every opcode goes through L_HOOK first, so the handlers
+  // themselves are identical in both modes and the trace and
+  // profile modes cost nothing when they aren't selected
+  static void *hook_table[OP_COUNT] = {
+#define OPCODE_HOOK_LABEL(name, operands, pops, pushes) [name] = &&L_HOOK,
+      OPCODES(OPCODE_HOOK_LABEL)
+#undef OPCODE_HOOK_LABEL
+  };
+
+  void **active_table = vm->tracer != NULL || vm->profiler != NULL ? hook_table : dispatch_table;
+
+#define VM_CASE(name) L_##name:
+#define VM_DISPATCH() goto *active_table[READ_INST()]
+
+  VM_DISPATCH();
+
+  L_HOOK:
+  pc--;
+  VM_HOOK();
+  goto *dispatch_table[READ_INST()];
+#else
+#define VM_CASE(name) case name:
+#define VM_DISPATCH() break
+
+  bool hook = vm->tracer != NULL || vm->profiler != NULL;
+
   while (true) {
-#ifdef VM_DEBUG_TRACE
-    printf("=>> ");
+    if (hook) VM_HOOK();
+
+    switch ((Opcode) READ_INST()) {
+#endif
+
+  // handle ret op
+  VM_CASE(OP_RET) {
+    VM_RETURN(kResultOK);
+  }
+
+  // the generic ops rewrite themselves to a _QUICK variant after
+  // the types of the operands they see first
+#define QUICKEN_BINARY(quick_i32, quick_f64) \
+    do { \
+      if (IS_INT(sp[-1]) && IS_INT(sp[-2])) pc[-1] = (quick_i32); \
+      else if (IS_DOUBLE(sp[-1]) && IS_DOUBLE(sp[-2])) pc[-1] = (quick_f64); \
+    } while (0)
+
+#define QUICKEN_UNARY(quick_i32, quick_f64) \
+    do { \
+      if (IS_INT(sp[-1])) pc[-1] = (quick_i32); \
+      else if (IS_DOUBLE(sp[-1])) pc[-1] = (quick_f64); \
+    } while (0)
+
+  // rewrites the instruction back to @param generic and runs it again
+#define DEOPTIMIZE(generic) \
+    do { \
+      pc[-1] = (generic); \
+      pc--; \
+    } while (0)
+
+  // the quick variants compute the same doubles as the generic ops,
+  // they only skip reading the tags of the operands
+#define QUICK_BINARY(generic, is, as, operator) \
+    if (!is(sp[-1]) || !is(sp[-2])) { \
+      DEOPTIMIZE(generic); \
+      VM_DISPATCH(); \
+    } \
+    sp--; \
+    sp[-1] = NUM_VALUE((double) as(sp[-1]) operator (double) as(sp[0]))
+
+#define QUICK_UNARY(generic, is, as) \
+    if (!is(sp[-1])) { \
+      DEOPTIMIZE(generic); \
+      VM_DISPATCH(); \
+    } \
+    sp[-1] = NUM_VALUE(-(double) as(sp[-1]))
+
+  // handle negate op
+  VM_CASE(OP_NEGATE) {
+    CHECK_NUMBER(sp[-1]);
+    QUICKEN_UNARY(OP_NEGATE_QUICK_I32, OP_NEGATE_QUICK_F64);
+
+    double d0 = READ_NUMBER();
+
+    PUSH(NUM_VALUE(-d0));
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_NEGATE_QUICK_I32) {
+    QUICK_UNARY(OP_NEGATE, IS_INT, AS_INT);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_NEGATE_QUICK_F64) {
+    QUICK_UNARY(OP_NEGATE, IS_DOUBLE, AS_DOUBLE);
+    VM_DISPATCH();
+  }
+
+  // handle sum op
+  VM_CASE(OP_SUM) {
+    CHECK_NUMBER(sp[-1]);
+    CHECK_NUMBER(sp[-2]);
+    QUICKEN_BINARY(OP_SUM_QUICK_I32, OP_SUM_QUICK_F64);
+
+    double d1 = READ_NUMBER();
+    double d0 = READ_NUMBER();
+
+    PUSH(NUM_VALUE(d0 + d1));
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_SUM_QUICK_I32) {
+    QUICK_BINARY(OP_SUM, IS_INT, AS_INT, +);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_SUM_QUICK_F64) {
+    QUICK_BINARY(OP_SUM, IS_DOUBLE, AS_DOUBLE, +);
+    VM_DISPATCH();
+  }
+
+  // handle sub op
+  VM_CASE(OP_SUB) {
+    CHECK_NUMBER(sp[-1]);
+    CHECK_NUMBER(sp[-2]);
+    QUICKEN_BINARY(OP_SUB_QUICK_I32, OP_SUB_QUICK_F64);
+
+    double d1 = READ_NUMBER();
+    double d0 = READ_NUMBER();
+
+    PUSH(NUM_VALUE(d0 - d1));
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_SUB_QUICK_I32) {
+    QUICK_BINARY(OP_SUB, IS_INT, AS_INT, -);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_SUB_QUICK_F64) {
+    QUICK_BINARY(OP_SUB, IS_DOUBLE, AS_DOUBLE, -);
+    VM_DISPATCH();
+  }
+
+  // handle mult op
+  VM_CASE(OP_MULT) {
+    CHECK_NUMBER(sp[-1]);
+    CHECK_NUMBER(sp[-2]);
+    QUICKEN_BINARY(OP_MULT_QUICK_I32, OP_MULT_QUICK_F64);
+
+    double d1 = READ_NUMBER();
+    double d0 = READ_NUMBER();
+
+    PUSH(NUM_VALUE(d0 * d1));
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_MULT_QUICK_I32) {
+    QUICK_BINARY(OP_MULT, IS_INT, AS_INT, *);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_MULT_QUICK_F64) {
+    QUICK_BINARY(OP_MULT, IS_DOUBLE, AS_DOUBLE, *);
+    VM_DISPATCH();
+  }
 
-    for (int i = 0; i < vm->stack->top; i++) {
-      printf("[ '%s' ]", ValueToStr(&vm->stack->values[i]));
+  // handle div op
+  VM_CASE(OP_DIV) {
+    CHECK_NUMBER(sp[-1]);
+    CHECK_NUMBER(sp[-2]);
+    QUICKEN_BINARY(OP_DIV_QUICK_I32, OP_DIV_QUICK_F64);
+
+    double d1 = READ_NUMBER();
+    double d0 = READ_NUMBER();
+
+    PUSH(NUM_VALUE(d0 / d1));
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_DIV_QUICK_I32) {
+    QUICK_BINARY(OP_DIV, IS_INT, AS_INT, /);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_DIV_QUICK_F64) {
+    QUICK_BINARY(OP_DIV, IS_DOUBLE, AS_DOUBLE, /);
+    VM_DISPATCH();
+  }
+
+#define INT_BINARY(function) \
+    do { \
+      int32_t i1 = READ_INT(); \
+      int32_t i0 = READ_INT(); \
+      PUSH(INT_VALUE(function(i0, i1))); \
+    } while (0)
+
+#define INT_COMPARE(operator) \
+    do { \
+      int32_t i1 = READ_INT(); \
+      int32_t i0 = READ_INT(); \
+      PUSH(BOOL_VALUE(i0 operator i1)); \
+    } while (0)
+
+#define DOUBLE_BINARY(operator) \
+    do { \
+      double d1 = READ_DOUBLE(); \
+      double d0 = READ_DOUBLE(); \
+      PUSH(NUM_VALUE(d0 operator d1)); \
+    } while (0)
+
+  // handle typed int ops
+  VM_CASE(OP_SUM_I32) {
+    INT_BINARY(IntAdd);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_SUB_I32) {
+    INT_BINARY(IntSub);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_MULT_I32) {
+    INT_BINARY(IntMult);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_DIV_I32) {
+    if (AS_INT(PEEK()) == 0) VM_RETURN(kResultError);
+
+    INT_BINARY(IntDiv);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_NEGATE_I32) {
+    int32_t i0 = READ_INT();
+
+    PUSH(INT_VALUE(IntSub(0, i0)));
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_LESS_I32) {
+    INT_COMPARE(<);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_LESS_EQUAL_I32) {
+    INT_COMPARE(<=);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_GREATER_I32) {
+    INT_COMPARE(>);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_GREATER_EQUAL_I32) {
+    INT_COMPARE(>=);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_EQUAL_I32) {
+    INT_COMPARE(==);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_NOT_EQUAL_I32) {
+    INT_COMPARE(!=);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_I32_TO_F64) {
+    int32_t i0 = READ_INT();
+
+    PUSH(NUM_VALUE((double) i0));
+    VM_DISPATCH();
+  }
+
+  // handle typed double ops
+  VM_CASE(OP_SUM_F64) {
+    DOUBLE_BINARY(+);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_SUB_F64) {
+    DOUBLE_BINARY(-);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_MULT_F64) {
+    DOUBLE_BINARY(*);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_DIV_F64) {
+    DOUBLE_BINARY(/);
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_NEGATE_F64) {
+    double d0 = READ_DOUBLE();
+
+    PUSH(NUM_VALUE(-d0));
+    VM_DISPATCH();
+  }
+
+  // handle true op
+  VM_CASE(OP_TRUE) {
+    PUSH(TRUE_VALUE);
+    VM_DISPATCH();
+  }
+
+  // handle false op
+  VM_CASE(OP_FALSE) {
+    PUSH(FALSE_VALUE);
+    VM_DISPATCH();
+  }
+
+  // handle not op
+  VM_CASE(OP_NOT) {
+    if (!IS_BOOL(sp[-1])) VM_RETURN(kResultError);
+
+    bool b0 = READ_BOOL();
+
+    PUSH(BOOL_VALUE(!b0));
+    VM_DISPATCH();
+  }
+
+  // handle concat op
+  VM_CASE(OP_CONCAT) {
+    // the verifier lets the values read from globals through,
+    // their type is only known now
+    if (!IS_STR_OR_ROPE(sp[-1]) || !IS_STR_OR_ROPE(sp[-2])) VM_RETURN(kResultError);
+
+    // the operands stay on the stack until the result exists,
+    // so a collection can't free them
+    VM_SYNC();
+
+    Object *result = VmConcat(vm, AS_OBJ(sp[-2]), AS_OBJ(sp[-1]));
+    if (result == NULL) VM_RETURN(kResultOutOfMemory);
+
+    sp -= 2;
+    PUSH(OBJ_VALUE(result));
+    VM_DISPATCH();
+  }
+
+  // handle pop op
+  VM_CASE(OP_POP) {
+    (void) POP();
+    VM_DISPATCH();
+  }
+
+  // handle store global op
+  VM_CASE(OP_STORE_GLOBAL) {
+    FLATTEN(sp[-2]);
+
+    Value v = POP();
+    string_t *name = READ_STR();
+    Value slot;
+
+    if (table_get(vm->globals, OBJ_VALUE(name), &slot)) {
+      globals[AS_INT(slot)] = v;
+    } else {
+      if (!ValueArrayWrite(vm->global_values, v)) VM_RETURN(kResultOutOfMemory);
+      table_set(vm->globals, OBJ_VALUE(name), INT_VALUE(vm->global_values->count - 1));
+
+      globals = vm->global_values->values;
     }
 
-    printf("\n");
+    VM_DISPATCH();
+  }
 
-    // TODO DISASSEMBLE CODE HERE
-#endif
+  // handle access global op
+  VM_CASE(OP_ACCESS_GLOBAL) {
+    FLATTEN(sp[-1]);
 
-#define READ_INST() (*vm->pc++)
-#define READ_NUMBER() (stack_pop(vm->stack)->as._double)
-#define READ_BOOL() (stack_pop(vm->stack)->as._bool)
-#define READ_OBJ() (stack_pop(vm->stack)->as._obj)
+    string_t *name = READ_STR();
+    Value slot;
 
-    Opcode op = READ_INST();
+    if (!table_get(vm->globals, OBJ_VALUE(name), &slot)) VM_RETURN(kResultNullPointer);
 
-        switch (op) {
-            // handle ret op
-            case OP_RET:
-#ifdef VM_DEBUG_TRACE
-            printf("RET %s\n", ValueToStr(StackPop(vm->stack)));
-#endif
+    Value v = globals[AS_INT(slot)];
+    if (IS_UNDEFINED(v)) VM_RETURN(kResultNullPointer);
 
-            return kResultOK;
+    global_cache_t *cache = VmGlobalCache(vm->chunk);
+    if (cache != NULL) {
+      cache[pc - 1 - vm->chunk->code] = (global_cache_t) {OBJ_VALUE(name), AS_INT(slot)};
+      pc[-1] = OP_ACCESS_GLOBAL_QUICK;
+    }
 
-                // handle negate op
-            case OP_NEGATE: {
-                double d0 = READ_NUMBER();
+    PUSH(v);
+    VM_DISPATCH();
+  }
 
-#ifdef VM_DEBUG_TRACE
-                printf("NEGATE %f\n", d0);
-#endif
+  // the name is compared by identity, the generic op handles the
+  // names that differ from the last one
+  VM_CASE(OP_ACCESS_GLOBAL_QUICK) {
+    global_cache_t *cache = vm->chunk->global_cache;
+    ptrdiff_t offset = pc - 1 - vm->chunk->code;
 
-              StackPush(vm->stack, NUM_VALUE(-d0));
-                break;
-            }
+    if (cache == NULL || cache[offset].name != sp[-1]) {
+      DEOPTIMIZE(OP_ACCESS_GLOBAL);
+      VM_DISPATCH();
+    }
 
+    Value v = globals[cache[offset].slot];
+    if (IS_UNDEFINED(v)) VM_RETURN(kResultNullPointer);
 
-                // handle sum op
-            case OP_SUM: {
-                double d1 = READ_NUMBER();
-                double d0 = READ_NUMBER();
+    sp[-1] = v;
+    VM_DISPATCH();
+  }
 
-#ifdef VM_DEBUG_TRACE
-                printf("SUM %f %f\n", d0, d1);
-#endif
+  // the _WIDE variants only differ by how they read the index
+#define GET_GLOBAL_SLOT(index) \
+    do { \
+      Value v = globals[index]; \
+      if (IS_UNDEFINED(v)) VM_RETURN(kResultNullPointer); \
+      \
+      PUSH(v); \
+    } while (0)
 
-              StackPush(vm->stack, NUM_VALUE(d0 + d1));
-                break;
-            }
-                // handle sub op
-            case OP_SUB: {
-                double d1 = READ_NUMBER();
-                double d0 = READ_NUMBER();
+#define SET_GLOBAL_SLOT(index) (globals[index] = POP())
 
-#ifdef VM_DEBUG_TRACE
-                printf("SUB %f %f\n", d0, d1);
-#endif
+  // the strings of a loaded chunk are read on their first use
+#define CONST(read_index) \
+    do { \
+      uint32_t index = (read_index); \
+      \
+      if (IS_STRING_REF(consts[index])) { \
+        VM_SYNC(); \
+        \
+        InterpretResult result = VmLoadString(vm, vm->chunk, vm->chunk->consts, (int) index); \
+        if (result != kResultOK) VM_RETURN(result); \
+      } \
+      \
+      PUSH(consts[index]); \
+    } while (0)
 
-              StackPush(vm->stack, NUM_VALUE(d0 - d1));
-                break;
-            }
+  // handle get global slot op
+  VM_CASE(OP_GET_GLOBAL_SLOT) {
+    GET_GLOBAL_SLOT(READ_INST());
+    VM_DISPATCH();
+  }
 
-                // handle mult op
-            case OP_MULT: {
-                double d1 = READ_NUMBER();
-                double d0 = READ_NUMBER();
+  VM_CASE(OP_GET_GLOBAL_SLOT_WIDE16) {
+    GET_GLOBAL_SLOT(READ_U16());
+    VM_DISPATCH();
+  }
 
-#ifdef VM_DEBUG_TRACE
-                printf("MULT %f %f\n", d0, d1);
-#endif
+  VM_CASE(OP_GET_GLOBAL_SLOT_WIDE24) {
+    GET_GLOBAL_SLOT(READ_U24());
+    VM_DISPATCH();
+  }
 
-              StackPush(vm->stack, NUM_VALUE(d0 * d1));
-                break;
-            }
+  // handle set global slot op
+  VM_CASE(OP_SET_GLOBAL_SLOT) {
+    SET_GLOBAL_SLOT(READ_INST());
+    VM_DISPATCH();
+  }
 
-                // handle div op
-            case OP_DIV: {
-                double d1 = READ_NUMBER();
-                double d0 = READ_NUMBER();
+  VM_CASE(OP_SET_GLOBAL_SLOT_WIDE16) {
+    SET_GLOBAL_SLOT(READ_U16());
+    VM_DISPATCH();
+  }
 
-#ifdef VM_DEBUG_TRACE
-                printf("DIV %f %f\n", d0, d1);
-#endif
+  VM_CASE(OP_SET_GLOBAL_SLOT_WIDE24) {
+    SET_GLOBAL_SLOT(READ_U24());
+    VM_DISPATCH();
+  }
 
-              StackPush(vm->stack, NUM_VALUE(d0 / d1));
-                break;
-            }
+  // handle const op
+  VM_CASE(OP_CONST) {
+    CONST(READ_INST());
+    VM_DISPATCH();
+  }
 
-                // handle true op
-            case OP_TRUE: {
-#ifdef VM_DEBUG_TRACE
-                printf("TRUE\n");
-#endif
+  VM_CASE(OP_CONST_WIDE16) {
+    CONST(READ_U16());
+    VM_DISPATCH();
+  }
 
-              StackPush(vm->stack, BOOL_VALUE(true));
-                break;
-            }
-                // handle false op
-            case OP_FALSE: {
-#ifdef VM_DEBUG_TRACE
-                printf("FALSE\n");
-#endif
+  VM_CASE(OP_CONST_WIDE24) {
+    CONST(READ_U24());
+    VM_DISPATCH();
+  }
 
-              StackPush(vm->stack, BOOL_VALUE(false));
-                break;
-            }
-                // handle not op
-            case OP_NOT: {
-                bool b0 = READ_BOOL();
+  // handle superinstructions, they run the handlers of the
+  // opcodes they stand for without dispatching in between
+  VM_CASE(OP_CONST_SUM_I32) {
+    CONST(READ_INST());
+    INT_BINARY(IntAdd);
+    VM_DISPATCH();
+  }
 
-#ifdef VM_DEBUG_TRACE
-                printf("NOT %d\n", b0);
-#endif
+  VM_CASE(OP_CONST_SUM_F64) {
+    CONST(READ_INST());
+    DOUBLE_BINARY(+);
+    VM_DISPATCH();
+  }
 
-              StackPush(vm->stack, BOOL_VALUE(!b0));
-                break;
-            }
-                // handle concat op
-            case OP_CONCAT: {
-                char *s1 = AS_CSTR(READ_OBJ());
-                char *s0 = AS_CSTR(READ_OBJ());
+  VM_CASE(OP_GET_GLOBAL_SLOT_SUM_I32) {
+    GET_GLOBAL_SLOT(READ_INST());
+    INT_BINARY(IntAdd);
+    VM_DISPATCH();
+  }
 
-#ifdef VM_DEBUG_TRACE
-                printf("CONCAT %s %s\n", s0, s1);
-#endif
+  VM_CASE(OP_GET_GLOBAL_SLOT_SUM_F64) {
+    GET_GLOBAL_SLOT(READ_INST());
+    DOUBLE_BINARY(+);
+    VM_DISPATCH();
+  }
 
-              StackPush(vm->stack, STR_VALUE(strcat(s0, s1)));
-                break;
-            }
-                // handle pop op
-            case OP_POP: {
-              Value *v = StackPop(vm->stack);
+  VM_CASE(OP_CONST_SET_GLOBAL_SLOT) {
+    CONST(READ_INST());
+    SET_GLOBAL_SLOT(READ_INST());
+    VM_DISPATCH();
+  }
 
-#ifdef VM_DEBUG_TRACE
-              printf("POP %s\n", ValueToStr(v));
-#endif
+  // handle the fiber ops, out of a scheduler there is no other
+  // fiber to spawn, await or yield to
+  VM_CASE(OP_SPAWN) {
+    if (vm->fiber == NULL) VM_RETURN(kResultError);
 
-                break;
-            }
-                // handle store global op
-            case OP_STORE_GLOBAL: {
-              Value *v = StackPop(vm->stack);
-              string_t *name = AS_STR(READ_OBJ());
+    CONST(READ_INST());
 
-              table_set(vm->globals, name, v);
+    string_t *name = READ_STR();
+    int32_t id;
 
-#ifdef VM_DEBUG_TRACE
-              printf("STORE_GLOBAL '%s' '%s'\n", name->values, ValueToStr(v));
-#endif
+    InterpretResult result = FiberSpawn(vm->fiber, name->values, name->length, &id);
+    if (result != kResultOK) VM_RETURN(result);
 
-              break;
-            }
-                // handle access global op
-            case OP_ACCESS_GLOBAL: {
-              string_t *name = AS_STR(READ_OBJ());
+    PUSH(INT_VALUE(id));
+    VM_DISPATCH();
+  }
 
-#ifdef VM_DEBUG_TRACE
-              printf("ACCESS_GLOBAL %s\n", name->values);
-#endif
+  VM_CASE(OP_AWAIT) {
+    if (vm->fiber == NULL || !IS_INT(sp[-1])) VM_RETURN(kResultError);
 
-              Value *v = table_get(vm->globals, name);
-              if (v == NULL) return kResultNullPointer;
+    bool ok;
+    InterpretResult result = FiberAwait(vm->fiber, AS_INT(sp[-1]), &ok);
 
-              StackPush(vm->stack, v);
+    // the fiber parks and runs the await again once it's woken
+    if (result == kResultYield) pc--;
+    if (result != kResultOK) VM_RETURN(result);
 
-              break;
-            }
-                // handle const op
-            case OP_CONST: {
-              Value *v = &vm->chunk->consts->values[READ_INST()];
+    sp[-1] = BOOL_VALUE(ok);
+    VM_DISPATCH();
+  }
 
-#ifdef VM_DEBUG_TRACE
-              printf("CONST %s\n", ValueToStr(v));
-#endif
+  VM_CASE(OP_YIELD) {
+    if (vm->fiber != NULL) VM_RETURN(kResultYield);
 
-              StackPush(vm->stack, v);
+    VM_DISPATCH();
+  }
+
+#undef GET_GLOBAL_SLOT
+#undef SET_GLOBAL_SLOT
+#undef CONST
 
-                break;
-            }
+#ifndef VM_THREADED_DISPATCH
+      default: VM_RETURN(kResultError);
+    }
+  }
+#endif
 
-            default: {
-              return kResultError;
-            }
-        }
 #undef READ_INST
+#undef READ_U16
+#undef READ_U24
 #undef READ_BOOL
-#undef READ_OBJ
+#undef READ_STR
 #undef READ_NUMBER
+#undef CHECK_NUMBER
+#undef READ_INT
+#undef READ_DOUBLE
+#undef QUICKEN_BINARY
+#undef QUICKEN_UNARY
+#undef DEOPTIMIZE
+#undef QUICK_BINARY
+#undef QUICK_UNARY
+#undef INT_BINARY
+#undef INT_COMPARE
+#undef DOUBLE_BINARY
+#undef POP
+#undef PEEK
+#undef PUSH
+#undef VM_RETURN
+#undef VM_SYNC
+#undef FLATTEN
+#undef VM_HOOK
+#undef VM_CASE
+#undef VM_DISPATCH
+}
+
+/**
+ * Runs the native code of vm->chunk, and the interpreter from the
+ * instruction it bailed out at, if it did
+ */
+static InterpretResult VmEvalJit(Vm *vm) {
+  jit_frame_t frame = {
+      .sp = vm->stack->values + vm->stack->top,
+      .consts = vm->chunk->consts->values,
+      .globals = vm->global_values->values,
+      .offset = 0,
+  };
+
+  JitExit exit = JitRun(vm->chunk->jit, &frame);
+
+  vm->stack->top = (int) (frame.sp - vm->stack->values);
+  vm->pc = vm->chunk->code + frame.offset;
+
+  switch (exit) {
+    case kJitExitReturn: return kResultOK;
+    case kJitExitBailout: return VmEvalImpl(vm);
+    case kJitExitNullPointer: return kResultNullPointer;
+    default: return kResultError;
+  }
+}
+
+// equal bits, or strings with the same characters
+static bool VmValuesMatch(Vm *vm, Value a, Value b) {
+  if (a == b) return true;
+  if (!IS_STR_OR_ROPE(a) || !IS_STR_OR_ROPE(b)) return false;
+  if (StringLength(AS_OBJ(a)) != StringLength(AS_OBJ(b))) return false;
+
+  string_t *flat_a = VmFlatten(vm, a);
+  string_t *flat_b = VmFlatten(vm, b);
+
+  return flat_a != NULL && flat_b != NULL && memcmp(flat_a->values, flat_b->values, flat_a->length) == 0;
+}
+
+/**
+ * Runs vm->chunk in the interpreter, then again with its native code
+ * from the same globals, and fails when they don't end with the same
+ * result and the same globals. The collector is held off meanwhile,
+ * the saved globals aren't roots
+ */
+static InterpretResult VmEvalJitChecked(Vm *vm) {
+  ValueArray *globals = vm->global_values;
+  int count = globals->count;
+  int top = vm->stack->top;
+  size_t next_gc = vm->next_gc;
+  bool gc_stress = vm->gc_stress;
+
+  Value *before = malloc(sizeof(Value) * (count + 1));
+  if (before == NULL) return kResultOutOfMemory;
+
+  for (int i = 0; i < count; i++) {
+    before[i] = globals->values[i];
+  }
+
+  vm->next_gc = SIZE_MAX;
+  vm->gc_stress = false;
+
+  InterpretResult expected = VmEvalImpl(vm);
+
+  // OP_STORE_GLOBAL may have added slots, they're undefined again
+  // for the second run
+  int interpreted_count = globals->count;
+  Value *interpreted = malloc(sizeof(Value) * (interpreted_count + 1));
+  if (interpreted == NULL) {
+    free(before);
+    vm->next_gc = next_gc;
+    vm->gc_stress = gc_stress;
+    return kResultOutOfMemory;
+  }
+
+  for (int i = 0; i < interpreted_count; i++) {
+    interpreted[i] = globals->values[i];
+    globals->values[i] = i < count ? before[i] : UNDEFINED_VALUE;
+  }
+
+  vm->stack->top = top;
+  vm->pc = vm->chunk->code;
+
+  InterpretResult result = VmEvalJit(vm);
+
+  if (result != expected) {
+    fprintf(stderr, "Jit check: the interpreter returned %d and the native code %d\n", expected, result);
+    result = kResultError;
+  }
+
+  for (int i = 0; i < interpreted_count && result != kResultError; i++) {
+    if (i >= globals->count || !VmValuesMatch(vm, interpreted[i], globals->values[i])) {
+      fprintf(stderr, "Jit check: the global slot %d differs\n", i);
+      result = kResultError;
     }
+  }
+
+  free(before);
+  free(interpreted);
+  vm->next_gc = next_gc;
+  vm->gc_stress = gc_stress;
+
+  return result;
 }
 
 InterpretResult VmEval(Vm *vm, Chunk *chunk) {
+  int offset;
+  if (ChunkVerify(chunk, &offset) != kVerifyOK) return kResultError;
+
+  if (!StackReserve(vm->stack, vm->stack->top + chunk->max_stack)) return kResultOutOfMemory;
+
+  if (chunk->hotness < INT32_MAX) chunk->hotness++;
+  if (vm->jit_threshold > 0 && chunk->jit == NULL && chunk->hotness == vm->jit_threshold) {
+    // when the chunk can't be compiled it stays interpreted
+    chunk->jit = JitCompile(chunk);
+  }
+
+  // the native code doesn't trace nor profile
+  bool native = vm->jit_threshold > 0 && chunk->jit != NULL && vm->tracer == NULL && vm->profiler == NULL;
+
+  // the chunk is a root from now on, the strings loaded below
+  // and by the last runs can't be collected
+  if (!VmRootChunk(vm, chunk)) return kResultOutOfMemory;
+
   vm->pc = chunk->code;
   vm->chunk = chunk;
 
-  return VmEvalImpl(vm);
+  // the names are needed to link the globals
+  for (int i = 0; i < chunk->globals->count; i++) {
+    if (!IS_STRING_REF(chunk->globals->values[i])) continue;
+
+    InterpretResult result = VmLoadString(vm, chunk, chunk->globals, i);
+    if (result != kResultOK) return result;
+  }
+
+  // the register instructions read the constants as operands of
+  // any instruction and the native code can't allocate, so the
+  // strings are loaded before instead of by the constant loads
+  for (int i = 0; (chunk->registers || native) && i < chunk->consts->count; i++) {
+    if (!IS_STRING_REF(chunk->consts->values[i])) continue;
+
+    InterpretResult result = VmLoadString(vm, chunk, chunk->consts, i);
+    if (result != kResultOK) return result;
+  }
+
+  VmInternValues(vm, chunk->consts);
+  VmInternValues(vm, chunk->globals);
+  if (!VmLinkGlobals(vm, chunk)) return kResultOutOfMemory;
+
+  InterpretResult result;
+  if (chunk->registers) {
+    result = VmEvalRegisters(vm);
+  } else if (native) {
+    result = vm->jit_check ? VmEvalJitChecked(vm) : VmEvalJit(vm);
+  } else {
+    result = VmEvalImpl(vm);
+  }
+
+  if (vm->tracer != NULL) {
+    TraceFlush(vm->tracer);
+  }
+
+  if (vm->profiler != NULL) {
+    ProfilerLeave(vm->profiler);
+  }
+
+  return result;
+}
+
+/**
+ * Runs @param chunk, a verified chunk shared with other vms, which
+ * may run it at the same time on other threads: the vm runs a view
+ * of it, see ChunkCreateView, created the first time and kept until
+ * the vm is disposed, so nothing is written to @param chunk
+ */
+InterpretResult VmEvalShared(Vm *vm, Chunk *chunk) {
+  if (!chunk->verified) return kResultError;
+
+  for (int i = 0; i < vm->view_count; i++) {
+    if (vm->views[i]->origin == chunk) return VmEval(vm, vm->views[i]);
+  }
+
+  if (vm->view_count >= vm->view_capacity) {
+    int capacity = GROW_CAPACITY(vm->view_capacity);
+    Chunk **views = realloc(vm->views, capacity * sizeof(Chunk *));
+    if (views == NULL) return kResultOutOfMemory;
+
+    vm->views = views;
+    vm->view_capacity = capacity;
+  }
+
+  Chunk *view = ChunkCreateView(vm->heap, chunk);
+  if (view == NULL) return kResultOutOfMemory;
+
+  vm->views[vm->view_count++] = view;
+
+  return VmEval(vm, view);
+}
+
+/**
+ * Continues the chunk of @param vm where it returned kResultYield,
+ * only stack chunks yield, in the interpreter
+ */
+InterpretResult VmResume(Vm *vm) {
+  InterpretResult result = VmEvalImpl(vm);
+
+  if (vm->tracer != NULL) {
+    TraceFlush(vm->tracer);
+  }
+
+  return result;
 }
 
 void VmDisposeObjects(Vm *vm) {
+  Object *object = vm->objects;
+
+  while (object != NULL) {
+    Object *next = object->next;
+    GcFreeObject(vm, object);
+    object = next;
+  }
+
+  vm->objects = NULL;
 }
 
+/**
+ * The chunk isn't disposed, it's owned by whoever created it
+ * (if it was created on vm->heap, it goes away with the heap)
+ */
 void VmDispose(Vm *vm) {
-  HeapDispose(vm->heap);
   StackDispose(vm->stack);
   table_dispose(vm->globals);
   table_dispose(vm->strings);
+  ValueArrayDispose(vm->global_values);
+
+  if (vm->tracer != NULL) {
+    TraceWriterDispose(vm->tracer);
+  }
+
+  if (vm->profiler != NULL) {
+    ProfilerDispose(vm->profiler);
+  }
 
   if (vm->objects != NULL) {
     VmDisposeObjects(vm);
   }
 
-  if (vm->chunk != NULL) {
-    free(vm->chunk);
+  for (int i = 0; i < vm->view_count; i++) {
+    ChunkDispose(vm->views[i]);
   }
 
-  if (vm->pc != NULL) {
-    free(vm->pc);
+  // the chunks left outlive the vm, that no longer roots them
+  for (int i = 0; i < vm->chunk_count; i++) {
+    vm->chunks[i]->vm = NULL;
   }
 
+  free(vm->views);
+  free(vm->chunks);
+  free(vm->gray_stack);
+  HeapDispose(vm->heap);
   free(vm);
 }
@@ -9,26 +9,74 @@
 #include "table.h"
 #include "stack.h"
 #include "object.h"
+#include "debug.h"
+#include "profiler.h"
 
 typedef struct {
   bool verbose;
+  bool trace;
+  // max bytes of the vm heap, 0 for no limit
   size_t memory;
+  // collect garbage on every object allocation
+  bool gc_stress;
+  // compile the chunks evaluated jit_threshold times to native code
+  bool jit;
+  int jit_threshold;
+  // run the compiled chunks in the interpreter too and compare
+  bool jit_check;
+  // count and time the opcodes and sample the lines, profile_hz
+  // times per second of cpu time
+  bool profile;
+  int profile_hz;
 } Flags;
 
-typedef struct {
+typedef struct vm {
   Stack *stack;
   Chunk *chunk;
-  Opcode *pc;
+  uint8_t *pc;
   Heap *heap;
+  // name to slot index of the globals, only used by the
+  // dynamic name based opcodes and debugging
   Table *globals;
+  ValueArray *global_values;
+  // the chunk the slots were last linked for, see VmLinkGlobals
+  Chunk *linked;
+  // weak, the collector drops the unreachable strings
   Table *strings;
   Object *objects;
+  // heap->allocated that triggers the next collection
+  size_t next_gc;
+  bool gc_stress;
+  // marked objects whose references weren't traced yet, it's
+  // allocated outside the heap so marking never collects
+  Object **gray_stack;
+  int gray_count;
+  int gray_capacity;
+  TraceWriter *tracer;
+  Profiler *profiler;
+  // the views VmEvalShared created for the shared chunks, malloc'd
+  Chunk **views;
+  int view_count;
+  int view_capacity;
+  // the chunks VmEval loaded strings into, roots until they're
+  // disposed or run by another vm, malloc'd
+  Chunk **chunks;
+  int chunk_count;
+  int chunk_capacity;
+  // 0 when the jit is disabled
+  int jit_threshold;
+  bool jit_check;
+  // the fiber the vm runs, NULL out of a scheduler
+  struct fiber *fiber;
 } Vm;
 
 typedef enum interpret_result {
   kResultOK,
   kResultError,
-  kResultNullPointer
+  kResultNullPointer,
+  kResultOutOfMemory,
+  // the fiber stopped before an instruction, VmResume runs it
+  kResultYield
 } InterpretResult;
 
 // vm functions>
@@ -36,6 +84,20 @@ Vm *VmCreate(Flags flags);
 
 InterpretResult VmEval(Vm *vm, Chunk *chunk);
 
+InterpretResult VmEvalShared(Vm *vm, Chunk *chunk);
+
+InterpretResult VmResume(Vm *vm);
+
+void VmForgetChunk(Vm *vm, Chunk *chunk);
+
+string_t *VmTakeString(Vm *vm, char *values, size_t length);
+
+string_t *VmCopyString(Vm *vm, const char *values, size_t length);
+
+string_t *VmFlatten(Vm *vm, Value value);
+
+Object *VmConcat(Vm *vm, Object *left, Object *right);
+
 void VmDispose(Vm *vm);
 
 #endif //RUNTIME_VM_H
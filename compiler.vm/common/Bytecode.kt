@@ -0,0 +1,164 @@
+package me.devgabi.kofl.compiler.vm
+
+/**
+ * Layout of the compiled files, read by `backend.vm/bytecode.c`: a
+ * header, a table of sections and the sections, every field is little
+ * endian and every section starts at a multiple of [ALIGNMENT], so the
+ * vm maps the file and uses the sections in place
+ */
+object Bytecode {
+  const val MAGIC = "kofl"
+  const val VERSION = 4
+  const val ALIGNMENT = 8
+
+  // the code is in the register instruction set, see [RegOpCode]
+  const val FLAG_REGISTERS = 0x1
+
+  const val HEADER_SIZE = 16
+  const val SECTION_SIZE = 16
+}
+
+enum class Section(val kind: Int) {
+  Code(1),
+  Lines(2),
+  Consts(3),
+  Globals(4),
+  Strings(5),
+}
+
+/**
+ * Deduplicates the strings of a chunk, constants and global names
+ * reference them by their index in the pool
+ */
+class StringPool(initial: Array<String> = emptyArray()) {
+  private val indexes = mutableMapOf<String, Int>()
+
+  init {
+    initial.forEach { indexOf(it) }
+  }
+
+  val strings: List<String> get() = indexes.entries.sortedBy { it.value }.map { it.key }
+
+  fun indexOf(string: String): Int {
+    return indexes.getOrPut(string) { indexes.size }
+  }
+}
+
+class BytecodeWriter(initialCapacity: Int = 256) {
+  private var bytes = ByteArray(initialCapacity)
+
+  var size: Int = 0
+    private set
+
+  private fun ensure(count: Int) {
+    if (size + count <= bytes.size) return
+
+    var capacity = bytes.size * 2
+    while (capacity < size + count) capacity *= 2
+
+    bytes = bytes.copyOf(capacity)
+  }
+
+  fun writeByte(value: Int) {
+    ensure(1)
+    bytes[size++] = value.toByte()
+  }
+
+  fun writeInt(value: Int) {
+    ensure(Int.SIZE_BYTES)
+    putInt(size, value)
+    size += Int.SIZE_BYTES
+  }
+
+  fun writeLong(value: Long) {
+    writeInt(value.toInt())
+    writeInt((value ushr 32).toInt())
+  }
+
+  fun writeBytes(value: ByteArray) {
+    ensure(value.size)
+    value.copyInto(bytes, size)
+    size += value.size
+  }
+
+  /**
+   * Overwrites the int at [offset], used to fill the section
+   * table once the sections were written
+   */
+  fun putInt(offset: Int, value: Int) {
+    bytes[offset] = value.toByte()
+    bytes[offset + 1] = (value ushr 8).toByte()
+    bytes[offset + 2] = (value ushr 16).toByte()
+    bytes[offset + 3] = (value ushr 24).toByte()
+  }
+
+  fun align(alignment: Int = Bytecode.ALIGNMENT) {
+    while (size % alignment != 0) writeByte(0)
+  }
+
+  fun toByteArray(): ByteArray = bytes.copyOf(size)
+}
+
+@ExperimentalUnsignedTypes
+fun Chunk.toBytecode(): ByteArray {
+  val pool = StringPool(strings)
+  val writer = BytecodeWriter(Bytecode.HEADER_SIZE + code.size * 5)
+  val sections = Section.values()
+
+  val encodedConsts = consts.values.map { it.encode(pool) }
+  val encodedGlobals = globals.values.map { it.encode(pool) }
+
+  writer.writeBytes(Bytecode.MAGIC.encodeToByteArray())
+  writer.writeInt(Bytecode.VERSION)
+  writer.writeInt(sections.size)
+  writer.writeInt(if (registers) Bytecode.FLAG_REGISTERS else 0)
+
+  val table = writer.size
+  repeat(sections.size * Bytecode.SECTION_SIZE) { writer.writeByte(0) }
+
+  sections.forEachIndexed { index, section ->
+    writer.align()
+
+    val offset = writer.size
+    val count = when (section) {
+      Section.Code -> code.size.also { code.forEach { writer.writeByte(it.toInt()) } }
+      Section.Lines -> lines.size.also {
+        lines.forEach { run ->
+          writer.writeInt(run.offset)
+          writer.writeInt(run.line)
+        }
+      }
+      Section.Consts -> encodedConsts.size.also { encodedConsts.forEach { writer.writeLong(it) } }
+      Section.Globals -> encodedGlobals.size.also { encodedGlobals.forEach { writer.writeLong(it) } }
+      Section.Strings -> pool.strings.size.also { writer.writeStrings(pool.strings) }
+    }
+
+    val entry = table + index * Bytecode.SECTION_SIZE
+    writer.putInt(entry, section.kind)
+    writer.putInt(entry + 4, count)
+    writer.putInt(entry + 8, offset)
+    writer.putInt(entry + 12, writer.size - offset)
+  }
+
+  return writer.toByteArray()
+}
+
+/**
+ * Writes an offset per string, from the start of the section, then
+ * the strings as their length, utf-8 bytes and a '\0'
+ */
+private fun BytecodeWriter.writeStrings(strings: List<String>) {
+  val encoded = strings.map { it.encodeToByteArray() }
+  var offset = strings.size * Int.SIZE_BYTES
+
+  encoded.forEach { bytes ->
+    writeInt(offset)
+    offset += Int.SIZE_BYTES + bytes.size + 1
+  }
+
+  encoded.forEach { bytes ->
+    writeInt(bytes.size)
+    writeBytes(bytes)
+    writeByte(0)
+  }
+}
@@ -1,15 +1,23 @@
 package me.devgabi.kofl.compiler.vm
 
-import pw.binom.ByteBuffer
-import pw.binom.writeInt
+/**
+ * The code from [offset] to the offset of the next run was compiled
+ * from [line]
+ */
+data class LineRun(val offset: Int, val line: Int)
 
 @ExperimentalUnsignedTypes
 data class Chunk(
   val count: Int,
   val capacity: Int,
-  val lines: IntArray,
-  val code: UIntArray,
-  val consts: ValueArray
+  val lines: Array<LineRun>,
+  val code: UByteArray,
+  val consts: ValueArray,
+  val globals: ValueArray,
+  // the string table, shared by the constants and the global names
+  val strings: Array<String>,
+  // the code is made of [RegOpCode]s instead of [OpCode]s
+  val registers: Boolean = false
 ) {
   override fun equals(other: Any?): Boolean {
     if (this === other) return true
@@ -20,6 +28,9 @@ data class Chunk(
     if (!lines.contentEquals(other.lines)) return false
     if (code != other.code) return false
     if (consts != other.consts) return false
+    if (globals != other.globals) return false
+    if (!strings.contentEquals(other.strings)) return false
+    if (registers != other.registers) return false
 
     return true
   }
@@ -30,43 +41,23 @@ data class Chunk(
     result = 31 * result + lines.contentHashCode()
     result = 31 * result + code.hashCode()
     result = 31 * result + consts.hashCode()
+    result = 31 * result + globals.hashCode()
+    result = 31 * result + strings.contentHashCode()
+    result = 31 * result + registers.hashCode()
     return result
   }
 }
 
-enum class ChunkOp(val end: ChunkOp? = null) {
-  ChunkEnd,
-  Chunk(ChunkEnd),
-
-  InfoEnd,
-  Info(InfoEnd),
-
-  CodeEnd,
-  Code(CodeEnd),
-
-  ValueEnd,
-  Value(ValueEnd),
-
-  LinesEnd,
-  Lines(LinesEnd),
-
-  ConstsEnd,
-  Consts(ConstsEnd),
-}
-
-fun ByteBuffer.writeChunkOp(buffer: ByteBuffer, chunk: ChunkOp) {
-  writeInt(buffer, chunk.ordinal)
-}
-
-fun ByteBuffer.writeChunkInfo(op: ChunkOp, block: () -> Unit) {
-  writeChunkOp(ByteBuffer.alloc(Int.SIZE_BITS), op)
-  block()
-  op.end?.let { writeChunkOp(ByteBuffer.alloc(Int.SIZE_BITS), op) }
-}
-
+/**
+ * Must match the OPCODES list of `backend.vm/chunk.h`, the opcodes
+ * with an index operand are followed by their Wide16 and Wide24
+ * variants, with a 2 and 3 bytes operand
+ */
 enum class OpCode {
   Ret,
   Const,
+  ConstWide16,
+  ConstWide24,
   Negate,
   Sum,
   Sub,
@@ -78,5 +69,97 @@ enum class OpCode {
   Concat,
   Pop,
   SGlobal,
-  AGlobal;
+  AGlobal,
+  GetGlobalSlot,
+  GetGlobalSlotWide16,
+  GetGlobalSlotWide24,
+  SetGlobalSlot,
+  SetGlobalSlotWide16,
+  SetGlobalSlotWide24,
+  SumI32,
+  SubI32,
+  MultI32,
+  DivI32,
+  NegateI32,
+  LessI32,
+  LessEqualI32,
+  GreaterI32,
+  GreaterEqualI32,
+  EqualI32,
+  NotEqualI32,
+  I32ToF64,
+  SumF64,
+  SubF64,
+  MultF64,
+  DivF64,
+  NegateF64,
+  SumQuickI32,
+  SumQuickF64,
+  SubQuickI32,
+  SubQuickF64,
+  MultQuickI32,
+  MultQuickF64,
+  DivQuickI32,
+  DivQuickF64,
+  NegateQuickI32,
+  NegateQuickF64,
+  AGlobalQuick,
+  ConstSumI32,
+  ConstSumF64,
+  GetGlobalSlotSumI32,
+  GetGlobalSlotSumF64,
+  ConstSetGlobalSlot,
+  Spawn,
+  Await,
+  Yield;
+}
+
+/**
+ * Must match the SUPERINSTRUCTIONS list of `backend.vm/chunk.h`: the
+ * superinstruction that runs a pair of opcodes with narrow operands
+ */
+val superinstructions = mapOf(
+  (OpCode.Const to OpCode.SumI32) to OpCode.ConstSumI32,
+  (OpCode.Const to OpCode.SumF64) to OpCode.ConstSumF64,
+  (OpCode.GetGlobalSlot to OpCode.SumI32) to OpCode.GetGlobalSlotSumI32,
+  (OpCode.GetGlobalSlot to OpCode.SumF64) to OpCode.GetGlobalSlotSumF64,
+  (OpCode.Const to OpCode.SetGlobalSlot) to OpCode.ConstSetGlobalSlot,
+)
+
+/**
+ * Must match the REG_OPCODES list of `backend.vm/regvm.h`, the
+ * register instruction set: the operands are the register written,
+ * then the registers or constants read, see `IrRegisterAllocator`
+ */
+enum class RegOpCode {
+  Ret,
+  LoadConst,
+  True,
+  False,
+  GetGlobalSlot,
+  SetGlobalSlot,
+  Negate,
+  Not,
+  Sum,
+  Sub,
+  Mult,
+  Div,
+  Concat,
+  SumI32,
+  SubI32,
+  MultI32,
+  DivI32,
+  NegateI32,
+  LessI32,
+  LessEqualI32,
+  GreaterI32,
+  GreaterEqualI32,
+  EqualI32,
+  NotEqualI32,
+  I32ToF64,
+  SumF64,
+  SubF64,
+  MultF64,
+  DivF64,
+  NegateF64;
 }
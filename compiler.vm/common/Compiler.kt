@@ -30,32 +30,59 @@ import me.devgabi.kofl.compiler.vm.ir.IrBinary
 import me.devgabi.kofl.compiler.vm.ir.IrComponent
 import me.devgabi.kofl.compiler.vm.ir.IrConst
 import me.devgabi.kofl.compiler.vm.ir.IrContext
+import me.devgabi.kofl.compiler.vm.ir.IrOptimizer
+import me.devgabi.kofl.compiler.vm.ir.IrRegisterAllocator
+import me.devgabi.kofl.compiler.vm.ir.IrUnary
 import me.devgabi.kofl.compiler.vm.ir.IrVal
 import me.devgabi.kofl.compiler.vm.ir.IrVar
-import pw.binom.ByteBuffer
-import pw.binom.io.use
-import pw.binom.writeInt
-import pw.binom.writeUtf8Char
+import me.devgabi.kofl.compiler.vm.ir.write
 
 @ExperimentalUnsignedTypes
-class Compiler(private val verbose: Boolean, private val code: List<Descriptor>) :
-  Descriptor.Visitor<IrComponent> {
-  fun compile(): ByteBuffer {
-    val chunk = IrContext().let { context ->
-      visitDescriptors(code).forEach { component ->
+class Compiler(
+  private val verbose: Boolean,
+  private val code: List<Descriptor>,
+  private val optimization: Int = 0,
+  private val registers: Boolean = false,
+  private val profile: Profile? = null
+) : Descriptor.Visitor<IrComponent> {
+  fun compile(): ByteArray {
+    val context = IrContext(fuse = optimization >= 1 && !registers, registers = registers, profile = profile)
+    val allocator = IrRegisterAllocator(context)
+
+    val components = IrOptimizer(optimization).optimize(visitDescriptors(code).toList())
+    val line = code.lastOrNull()?.line ?: 0
+
+    if (profile != null) {
+      // the profile indexes the stack instructions, a first render
+      // maps them to the constants they load
+      val profiled = IrContext()
+      components.forEach { component ->
+        component.render(profiled)
+      }
+
+      context.place(profiled.hotConsts(profile), profiled.hotGlobals(profile))
+    }
+
+    if (registers) {
+      allocator.allocate(components)
+      context.write(RegOpCode.Ret, emptyList(), line)
+    } else {
+      components.forEach { component ->
         component.render(context)
       }
 
-      context.toChunk()
+      context.write(OpCode.Ret, line)
     }
 
+    val chunk = context.toChunk()
+
     if (verbose) {
       println("CHUNK INFO =")
       println("  count = ${chunk.count}")
       println("  capacity = ${chunk.capacity}")
       println("  lines =")
       chunk.lines.forEach {
-        println("    - $it")
+        println("    - ${it.offset}: ${it.line}")
       }
       print("  code = ")
 
@@ -81,76 +108,32 @@ class Compiler(private val verbose: Boolean, private val code: List<Descriptor>)
       chunk.consts.values.forEach { const ->
         println("      - $const")
       }
-    }
-
-    val constPoolCapacity = chunk.consts.values.fold(chunk.consts.capacity) { total, right ->
-      total + right.size
-    }
-
-    val totalSize = chunk.capacity + constPoolCapacity + chunk.lines.size + 100
-
-    return ByteBuffer.alloc(totalSize).use { buffer ->
-      "kofl".forEach {
-        buffer.writeUtf8Char(ByteBuffer.alloc(Char.SIZE_BITS), it)
+      println("  globals =")
+      chunk.globals.values.forEachIndexed { slot, name ->
+        println("    - $slot = $name")
       }
-
-      buffer.writeChunkInfo(ChunkOp.Chunk) {
-        buffer.writeChunkInfo(ChunkOp.Info) {
-          buffer.writeInt(ByteBuffer.alloc(Int.SIZE_BITS), chunk.count)
-          buffer.writeInt(ByteBuffer.alloc(Int.SIZE_BITS), chunk.capacity)
-          buffer.writeInt(ByteBuffer.alloc(Int.SIZE_BITS), chunk.lines.size)
-          buffer.writeInt(ByteBuffer.alloc(Int.SIZE_BITS), chunk.consts.capacity)
-        }
-
-        buffer.writeChunkInfo(ChunkOp.Code) {
-          chunk.code.forEach { op ->
-            buffer.writeInt(ByteBuffer.alloc(Int.SIZE_BITS), op.toInt())
-          }
-        }
-
-        buffer.writeChunkInfo(ChunkOp.Lines) {
-          chunk.lines.forEach { op ->
-            buffer.writeInt(ByteBuffer.alloc(Int.SIZE_BITS), op)
-          }
-        }
-
-        buffer.writeChunkInfo(ChunkOp.Consts) {
-          chunk.consts.values.forEach { value ->
-            value.write(buffer)
-          }
+      println("  strings =")
+      chunk.strings.forEachIndexed { index, string ->
+        println("    - $index = \"$string\"")
+      }
+      println("POOL STATS =")
+      println("  const requests = ${context.constRequests}")
+      println("  consts = ${chunk.consts.count} (${context.constRequests - chunk.consts.count} deduplicated)")
+      println("  globals = ${chunk.globals.count}")
+      if (registers) println("  registers = ${allocator.registerCount}")
+      println("  strings = ${chunk.strings.size} (${chunk.strings.sumOf { it.encodeToByteArray().size }} bytes)")
+
+      if (profile != null) {
+        println("PROFILE =")
+        println("  hot pairs without a superinstruction =")
+        profile.unfusedPairs(10).forEach { (pair, count) ->
+          println("    - ${pair.first} ${pair.second}: $count")
         }
       }
-
-      buffer.flush()
-
-      buffer
     }
-  }
-/*
-      OpChunk.ChunkStart, // 0
 
-      OpChunk.InfoStart, // 1
-      chunk.count.toUByte(), // 2
-      chunk.capacity.toUByte(), // 3
-      chunk.lines.size.toUByte(), // 4
-      chunk.consts.count.toUByte(), // 5
-      OpChunk.InfoEnd, // 6
-
-      OpChunk.CodeStart, // 7
-      // code.size = 2
-      *chunk.code.map { it.toUByte() }.toUByteArray(), // 8
-      OpChunk.CodeEnd, // 10
-
-      OpChunk.LinesStart, // 11
-      *chunk.lines.map { it.toUByte() }.toUByteArray(), // 12
-      OpChunk.LinesEnd, // 13
-
-      OpChunk.ConstsStart, // 14
-      *chunk.consts.values.flatMap { it.toUByteArray() }.toUByteArray(),
-      OpChunk.ConstsEnd,
-
-      OpChunk.ChunkEnd
- */
+    return chunk.toBytecode()
+  }
 
   override fun visitConstDescriptor(descriptor: ConstDescriptor): IrComponent {
     return IrConst(descriptor.value, descriptor.type, descriptor.line)
@@ -173,7 +156,7 @@ class Compiler(private val verbose: Boolean, private val code: List<Descriptor>)
   }
 
   override fun visitAccessVarDescriptor(descriptor: AccessVarDescriptor): IrComponent {
-    return IrAccessVar(descriptor.name, descriptor.line)
+    return IrAccessVar(descriptor.name, descriptor.type, descriptor.line)
   }
 
   override fun visitAccessFunctionDescriptor(descriptor: AccessFunctionDescriptor): IrComponent {
@@ -181,7 +164,7 @@ class Compiler(private val verbose: Boolean, private val code: List<Descriptor>)
   }
 
   override fun visitUnaryDescriptor(descriptor: UnaryDescriptor): IrComponent {
-    TODO("Not yet implemented")
+    return IrUnary(descriptor.op, visitDescriptor(descriptor.right), descriptor.type, descriptor.line)
   }
 
   override fun visitValDescriptor(descriptor: ValDescriptor): IrComponent {
@@ -221,6 +204,7 @@ class Compiler(private val verbose: Boolean, private val code: List<Descriptor>)
       visitDescriptor(descriptor.left),
       visitDescriptor(descriptor.right),
       descriptor.op,
+      descriptor.type,
       descriptor.line
     )
   }
@@ -27,6 +27,18 @@ class Koflc : CliktCommand() {
 
   private val verbose by option().flag().help("Enables the verbose mode: TODO")
 
+  private val optimization by option("-O")
+    .help("Optimization level of the IR: 0 disables it, 1 folds constants, drops dead expressions and fuses superinstructions, 2 also inlines constant vals")
+    .int()
+    .default(0)
+
+  private val registers by option()
+    .flag()
+    .help("Compiles to the register instruction set of the vm instead of the stack one")
+
+  private val profileUse by option("--profile-use")
+    .help("Profile written by koflvm --profile-generate for this file: specializes the generic opcodes after the types seen and gives the hottest constants and globals the narrow operands")
+
   private val maxStack by option()
     .help("Max stack size on type definitions")
     .int()
@@ -55,12 +67,16 @@ class Koflc : CliktCommand() {
         stack.push(container)
       }
     )
-    val compiler = Compiler(verbose, converter.compile(parser.parse()).toList())
+    val profile = profileUse?.let { path ->
+      Profile.parse(File(path).readContents().decodeToString())
+        ?: error("$path isn't a profile of version ${Profile.VERSION}")
+    }
+
+    val compiler = Compiler(verbose, converter.compile(parser.parse()).toList(), optimization, registers, profile)
 
     target.write(append = false).use { channel ->
-      val buffer = compiler.compile()
+      val bytecode = compiler.compile()
       val pool = ByteBuffer.alloc(10)
-      val bytecode = buffer.toByteArray()
 
       bytecode.forEach {
         channel.writeByte(pool, it)
@@ -0,0 +1,123 @@
+package me.devgabi.kofl.compiler.vm
+
+/**
+ * The feedback `koflvm --profile-generate` writes, see
+ * `ProfilerWriteFeedback` in `backend.vm/profiler.c`. The instructions
+ * are indexed in the order the compiler writes them, before they are
+ * fused, so a profile only applies to the same source compiled with
+ * the same optimization level: the records whose line or opcode
+ * don't match are ignored
+ */
+class Profile(
+  val pairs: Map<Pair<String, String>, Long>,
+  // the reads and writes of each global
+  val globals: Map<String, Long>,
+  private val instructions: Map<Int, Instruction>
+) {
+  /**
+   * @param types the letters of the types each operand was seen
+   * with, the deepest operand first: `i`nt, `d`ouble, `b`oolean,
+   * `s`tring or `o`ther
+   */
+  class Instruction(val line: Int, val op: String, val count: Long, val types: List<String>)
+
+  /**
+   * @return the record of the instruction written at [index], when it
+   * was written from [line] with [op]
+   */
+  fun instruction(index: Int, op: OpCode, line: Int): Instruction? {
+    return instructions[index]?.takeIf { it.line == line && it.op == op.vmName }
+  }
+
+  /**
+   * The _QUICK variant of the generic [op] written at [index], when
+   * its operands were always ints or always doubles: the variant
+   * checks the types and the vm rewrites it back when they change,
+   * so it's only a head start on the quickening of the vm
+   */
+  fun specialize(index: Int, op: OpCode, line: Int): OpCode {
+    val variants = quickVariants[op] ?: return op
+    val types = instruction(index, op, line)?.types ?: return op
+
+    return when {
+      types.isEmpty() -> op
+      types.all { it == "i" } -> variants.first
+      types.all { it == "d" } -> variants.second
+      else -> op
+    }
+  }
+
+  /**
+   * The opcode pairs that ran most and have no superinstruction, the
+   * candidates for new ones
+   */
+  fun unfusedPairs(limit: Int): List<Pair<Pair<String, String>, Long>> {
+    val fused = superinstructions.keys.map { (first, second) -> first.vmName to second.vmName }.toSet()
+
+    return pairs.entries
+      .filter { it.key !in fused }
+      .sortedByDescending { it.value }
+      .take(limit)
+      .map { it.key to it.value }
+  }
+
+  companion object {
+    const val VERSION = 1
+
+    private val quickVariants = mapOf(
+      OpCode.Sum to (OpCode.SumQuickI32 to OpCode.SumQuickF64),
+      OpCode.Sub to (OpCode.SubQuickI32 to OpCode.SubQuickF64),
+      OpCode.Mult to (OpCode.MultQuickI32 to OpCode.MultQuickF64),
+      OpCode.Div to (OpCode.DivQuickI32 to OpCode.DivQuickF64),
+      OpCode.Negate to (OpCode.NegateQuickI32 to OpCode.NegateQuickF64),
+    )
+
+    /**
+     * @return the profile, or null when [text] isn't a profile of this
+     * version
+     */
+    fun parse(text: String): Profile? {
+      val lines = text.lines().filter { it.isNotBlank() }
+      if (lines.firstOrNull() != "kofl-profile $VERSION") return null
+
+      val pairs = mutableMapOf<Pair<String, String>, Long>()
+      val globals = mutableMapOf<String, Long>()
+      val instructions = mutableMapOf<Int, Instruction>()
+
+      lines.drop(1).forEach { line ->
+        val fields = line.split(' ')
+
+        when (fields[0]) {
+          "pair" -> pairs[fields[1] to fields[2]] = fields[3].toLong()
+          "global" -> globals[fields[1]] = fields[2].toLong() + fields[3].toLong()
+          "inst" -> instructions[fields[1].toInt()] = Instruction(
+            line = fields[2].toInt(),
+            op = fields[3],
+            count = fields[4].toLong(),
+            types = fields.drop(5)
+          )
+          else -> return null
+        }
+      }
+
+      return Profile(pairs, globals, instructions)
+    }
+  }
+}
+
+/**
+ * The name of the opcode in the OPCODES list of `backend.vm/chunk.h`,
+ * without the OP_ prefix
+ */
+val OpCode.vmName: String
+  get() = when (this) {
+    OpCode.SGlobal -> "STORE_GLOBAL"
+    OpCode.AGlobal -> "ACCESS_GLOBAL"
+    OpCode.AGlobalQuick -> "ACCESS_GLOBAL_QUICK"
+    else -> buildString {
+      name.forEachIndexed { index, char ->
+        if (index > 0 && char.isUpperCase() && !name[index - 1].isUpperCase()) append('_')
+        append(char.toUpperCase())
+      }
+    }
+  }
@@ -2,38 +2,42 @@
 
 package me.devgabi.kofl.compiler.vm
 
-import pw.binom.ByteBuffer
-import pw.binom.writeDouble
-import pw.binom.writeInt
-import pw.binom.writeUTF8String
+/**
+ * The bits of the vm values, see `backend.vm/value.h`: doubles are
+ * stored as they are, and the other values are quiet NaNs with a tag
+ * and a 32 bit payload
+ */
+private const val VALUE_QNAN = 0x7ffc000000000000L
+private const val VALUE_TAG_INT = 4L
+private const val VALUE_TAG_STRING_REF = 6L
 
-sealed class Value {
-  abstract val size: Int
-
-  abstract fun write(buffer: ByteBuffer)
+private fun tagged(tag: Long, payload: Int): Long {
+  return VALUE_QNAN or (tag shl 32) or (payload.toLong() and 0xffffffffL)
 }
 
-data class StringValue(private val value: String) : Value() {
-  override val size = Char.SIZE_BITS * value.length + Int.SIZE_BITS
+sealed class Value {
+  /**
+   * @return the bits of the vm value, the strings are added to [pool]
+   */
+  abstract fun encode(pool: StringPool): Long
+}
 
-  override fun write(buffer: ByteBuffer) {
-    buffer.writeUTF8String(ByteBuffer.alloc(size), value)
+data class StringValue(val value: String) : Value() {
+  override fun encode(pool: StringPool): Long {
+    return tagged(VALUE_TAG_STRING_REF, pool.indexOf(value))
   }
 }
 
 data class DoubleValue(private val value: Double) : Value() {
-  override val size: Int = Double.SIZE_BITS
-
-  override fun write(buffer: ByteBuffer) {
-    buffer.writeDouble(ByteBuffer.alloc(size), value)
+  // NaNs are canonical, so they can't be read as a tagged value
+  override fun encode(pool: StringPool): Long {
+    return if (value.isNaN()) 0x7ff8000000000000L else value.toRawBits()
   }
 }
 
 data class IntValue(private val value: Int) : Value() {
-  override val size: Int = Int.SIZE_BITS
-
-  override fun write(buffer: ByteBuffer) {
-    buffer.writeInt(ByteBuffer.alloc(size), value)
+  override fun encode(pool: StringPool): Long {
+    return tagged(VALUE_TAG_INT, value)
   }
 }
 
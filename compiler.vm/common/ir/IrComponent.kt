@@ -6,64 +6,163 @@ import me.devgabi.kofl.frontend.TokenType
 
 @ExperimentalUnsignedTypes
 sealed class IrComponent {
+  // the type of the value left on the stack, Unit for statements
+  abstract val type: KfType
+
+  // the source line of the instructions written for the component
+  abstract val line: Int
+
   abstract fun render(context: IrContext)
 }
 
 @ExperimentalUnsignedTypes
 class IrAccessVar(
-  private val name: String,
-  private val line: Int
+  val name: String,
+  override val type: KfType,
+  override val line: Int
 ) : IrComponent() {
   override fun render(context: IrContext) {
-    context.write(OpCode.Const, context.makeConst(name), line)
-    context.write(OpCode.AGlobal, line)
+    context.write(OpCode.GetGlobalSlot, context.globalSlot(name), line)
   }
 }
 
 @ExperimentalUnsignedTypes
 class IrVar(
-  private val name: String,
-  private val value: IrComponent,
-  private val line: Int
+  val name: String,
+  val value: IrComponent,
+  override val line: Int
 ) : IrComponent() {
+  override val type: KfType get() = KfType.Unit
+
   override fun render(context: IrContext) {
-    context.write(OpCode.Const, context.makeConst(name), line)
     value.render(context)
-    context.write(OpCode.SGlobal, line)
+    context.write(OpCode.SetGlobalSlot, context.globalSlot(name), line)
   }
 }
 
 @ExperimentalUnsignedTypes
 class IrVal(
-  private val name: String,
-  private val value: IrComponent,
-  private val line: Int
+  val name: String,
+  val value: IrComponent,
+  override val line: Int
+) : IrComponent() {
+  override val type: KfType get() = KfType.Unit
+
+  override fun render(context: IrContext) {
+    value.render(context)
+    context.write(OpCode.SetGlobalSlot, context.globalSlot(name), line)
+  }
+}
+
+/**
+ * An expression statement, its result is popped
+ */
+@ExperimentalUnsignedTypes
+class IrPop(
+  val value: IrComponent,
+  override val line: Int
 ) : IrComponent() {
+  override val type: KfType get() = KfType.Unit
+
   override fun render(context: IrContext) {
-    context.write(OpCode.Const, context.makeConst(name), line)
     value.render(context)
-    context.write(OpCode.SGlobal, line)
+    context.write(OpCode.Pop, line)
   }
 }
 
 @ExperimentalUnsignedTypes
 class IrBinary(
-  private val left: IrComponent,
-  private val right: IrComponent,
-  private val op: TokenType,
-  private val line: Int,
+  val left: IrComponent,
+  val right: IrComponent,
+  val op: TokenType,
+  override val type: KfType,
+  override val line: Int,
 ) : IrComponent() {
+  /**
+   * The opcode for the types of the operands, the F64 ones need the
+   * int operands converted, see [readsDoubles]
+   */
+  fun selectOp(): OpCode {
+    val ints = left.type == KfType.Int && right.type == KfType.Int
+    val numbers = left.type.isNumber() && right.type.isNumber()
+
+    return when {
+      type == KfType.String && op == TokenType.Plus -> OpCode.Concat
+      ints && type == KfType.Int -> intOps[op]
+      ints && type == KfType.Boolean -> intComparisons[op]
+      numbers && type == KfType.Double -> doubleOps[op]
+      else -> genericOps[op]
+    } ?: TODO("Unsupported binary op $op")
+  }
+
+  fun readsDoubles(op: OpCode): Boolean = op in doubleOps.values
+
   override fun render(context: IrContext) {
-    val op = when (op) {
-      TokenType.Plus -> OpCode.Sum
-      TokenType.Minus -> OpCode.Sub
-      TokenType.Slash -> OpCode.Div
-      TokenType.Star -> OpCode.Mult
-      else -> TODO("Unsupported binary op $op")
+    val op = selectOp()
+
+    // the vm pops the right operand first
+    left.render(context)
+    if (readsDoubles(op)) left.renderToDouble(context, line)
+    right.render(context)
+    if (readsDoubles(op)) right.renderToDouble(context, line)
+
+    context.write(op, line)
+  }
+
+  private companion object {
+    val genericOps = mapOf(
+      TokenType.Plus to OpCode.Sum,
+      TokenType.Minus to OpCode.Sub,
+      TokenType.Star to OpCode.Mult,
+      TokenType.Slash to OpCode.Div,
+    )
+
+    val intOps = mapOf(
+      TokenType.Plus to OpCode.SumI32,
+      TokenType.Minus to OpCode.SubI32,
+      TokenType.Star to OpCode.MultI32,
+      TokenType.Slash to OpCode.DivI32,
+    )
+
+    val intComparisons = mapOf(
+      TokenType.Less to OpCode.LessI32,
+      TokenType.LessEqual to OpCode.LessEqualI32,
+      TokenType.Greater to OpCode.GreaterI32,
+      TokenType.GreaterEqual to OpCode.GreaterEqualI32,
+      TokenType.EqualEqual to OpCode.EqualI32,
+      TokenType.BangEqual to OpCode.NotEqualI32,
+    )
+
+    val doubleOps = mapOf(
+      TokenType.Plus to OpCode.SumF64,
+      TokenType.Minus to OpCode.SubF64,
+      TokenType.Star to OpCode.MultF64,
+      TokenType.Slash to OpCode.DivF64,
+    )
+  }
+}
+
+@ExperimentalUnsignedTypes
+class IrUnary(
+  val op: TokenType,
+  val right: IrComponent,
+  override val type: KfType,
+  override val line: Int,
+) : IrComponent() {
+  fun selectOp(): OpCode = when (op) {
+    TokenType.Bang -> OpCode.Not
+    TokenType.Minus -> when (right.type) {
+      KfType.Int -> OpCode.NegateI32
+      KfType.Double -> OpCode.NegateF64
+      else -> OpCode.Negate
     }
+    else -> TODO("Unsupported unary op $op")
+  }
+
+  override fun render(context: IrContext) {
+    val op = selectOp()
 
     right.render(context)
-    left.render(context)
 
     context.write(op, line)
   }
@@ -71,9 +170,9 @@ class IrBinary(
 
 @ExperimentalUnsignedTypes
 class IrConst(
-  private val value: Any,
-  private val type: KfType,
-  private val line: Int
+  val value: Any,
+  override val type: KfType,
+  override val line: Int
 ) : IrComponent() {
   override fun render(context: IrContext) {
     val const = when (type) {
@@ -87,3 +186,16 @@ class IrConst(
     context.write(OpCode.Const, const, line)
   }
 }
+
+private fun KfType.isNumber(): Boolean {
+  return this == KfType.Int || this == KfType.Double
+}
+
+/**
+ * Converts the int that [this] left on the stack, for the opcodes
+ * that only read doubles
+ */
+@ExperimentalUnsignedTypes
+private fun IrComponent.renderToDouble(context: IrContext, line: Int) {
+  if (type == KfType.Int) context.write(OpCode.I32ToF64, line)
+}
@@ -3,65 +3,243 @@ package me.devgabi.kofl.compiler.vm.ir
 import me.devgabi.kofl.compiler.vm.Chunk
 import me.devgabi.kofl.compiler.vm.DoubleValue
 import me.devgabi.kofl.compiler.vm.IntValue
+import me.devgabi.kofl.compiler.vm.LineRun
 import me.devgabi.kofl.compiler.vm.OpCode
+import me.devgabi.kofl.compiler.vm.Profile
+import me.devgabi.kofl.compiler.vm.RegOpCode
+import me.devgabi.kofl.compiler.vm.StringPool
 import me.devgabi.kofl.compiler.vm.StringValue
 import me.devgabi.kofl.compiler.vm.Value
 import me.devgabi.kofl.compiler.vm.ValueArray
+import me.devgabi.kofl.compiler.vm.superinstructions
 
+/**
+ * @param fuse replaces the pairs of instructions that have a
+ * superinstruction by it, as they are written
+ * @param registers the code is written with [RegOpCode]s, by an
+ * [IrRegisterAllocator]
+ * @param profile specializes the generic opcodes after the types
+ * their operands had when the program ran, see [Profile.specialize]
+ */
 @ExperimentalUnsignedTypes
-class IrContext {
+class IrContext(
+  private val fuse: Boolean = false,
+  private val registers: Boolean = false,
+  private val profile: Profile? = null
+) {
   private val code = mutableListOf<UByte>()
-  private val lines = mutableListOf<Int>()
+  private val lines = mutableListOf<LineRun>()
   private val consts = mutableListOf<Value>()
+  private val constIndexes = mutableMapOf<Value, Int>()
+  private val globals = mutableMapOf<String, Int>()
+  private val strings = StringPool()
+
+  /**
+   * Count of [makeConst] calls, the pool only grows on the
+   * values that weren't there yet
+   */
+  var constRequests: Int = 0
+    private set
+
+  // the last instruction written, that the next one may be fused with
+  private var last: Instruction? = null
+
+  // count of stack instructions written, before fusing, the index of
+  // the next one in a [Profile]
+  private var written = 0
+
+  // the index, line and constant index of each constant load
+  private val constLoads = mutableListOf<Triple<Int, Int, Int>>()
+
+  private class Instruction(val offset: Int, val op: OpCode, val operands: List<UByte>, val line: Int)
+
+  private fun write(byte: UByte, line: Int) {
+    if (lines.lastOrNull()?.line != line) {
+      lines += LineRun(code.size, line)
+    }
 
-  fun write(byte: UByte, line: Int) {
     code += byte
-    lines += line
   }
 
-  fun makeConst(value: Value): UByte {
-    consts += value
+  /**
+   * The code has no jumps yet, so every instruction can be fused
+   * with the one before it. The [generic] opcodes are written as
+   * the variant the [profile] picks for them
+   */
+  fun write(generic: OpCode, operands: List<UByte>, line: Int) {
+    val index = written++
+    val op = profile?.specialize(index, generic, line) ?: generic
+
+    if (op in constOps) {
+      val constIndex = operands.foldIndexed(0) { byte, acc, operand -> acc or (operand.toInt() shl (8 * byte)) }
+      constLoads += Triple(index, line, constIndex)
+    }
+
+    val previous = last
+    val fused = previous?.let { superinstructions[it.op to op] }
+
+    if (fuse && previous != null && fused != null && previous.operands.size <= 1 && operands.size <= 1) {
+      code.subList(previous.offset, code.size).clear()
+      lines.removeAll { it.offset >= previous.offset }
+
+      write(fused.ordinal.toUByte(), previous.line)
+      (previous.operands + operands).forEach { write(it, previous.line) }
+
+      // a superinstruction isn't fused again
+      last = null
+      return
+    }
+
+    last = Instruction(code.size, op, operands, line)
+
+    write(op.ordinal.toUByte(), line)
+    operands.forEach { write(it, line) }
+  }
+
+  /**
+   * The register instructions aren't fused
+   */
+  fun write(op: RegOpCode, operands: List<UByte>, line: Int) {
+    last = null
+
+    write(op.ordinal.toUByte(), line)
+    operands.forEach { write(it, line) }
+  }
+
+  /**
+   * Equal values share one entry, the values are data classes, so
+   * an int and a double with the same number are still two entries
+   *
+   * @return the index of [value] in the constant pool
+   */
+  fun makeConst(value: Value): Int {
+    constRequests++
 
-    return consts.size.toUByte()
+    return addConst(value)
+  }
+
+  private fun addConst(value: Value): Int {
+    return constIndexes.getOrPut(value) {
+      if (value is StringValue) strings.indexOf(value.value)
+
+      consts += value
+      consts.size - 1
+    }
+  }
+
+  /**
+   * Links the global [name] to a dense slot index, the vm stores
+   * globals in a flat array indexed by it instead of looking the
+   * name up on every access
+   */
+  fun globalSlot(name: String): Int {
+    return globals.getOrPut(name) {
+      strings.indexOf(name)
+      globals.size
+    }
+  }
+
+  /**
+   * Reserves the first indexes of the pool to [values] and the first
+   * global slots to [names], in order, so the hottest ones get the
+   * narrow operands, that can be fused into superinstructions. Must be
+   * called before anything is written
+   */
+  fun place(values: List<Value>, names: List<String>) {
+    values.forEach { addConst(it) }
+    names.forEach { globalSlot(it) }
+  }
+
+  /**
+   * The constants loaded by the instructions written so far, the ones
+   * that [profile] saw loaded the most times first
+   */
+  fun hotConsts(profile: Profile): List<Value> {
+    val loads = LongArray(consts.size)
+
+    constLoads.forEach { (index, line, constIndex) ->
+      loads[constIndex] += profile.instruction(index, OpCode.Const, line)?.count ?: 0
+    }
+
+    return consts.indices
+      .filter { loads[it] > 0 }
+      .sortedByDescending { loads[it] }
+      .map { consts[it] }
+  }
+
+  /**
+   * The globals written so far, the ones that [profile] saw accessed
+   * the most times first
+   */
+  fun hotGlobals(profile: Profile): List<String> {
+    return globals.keys
+      .filter { (profile.globals[it] ?: 0) > 0 }
+      .sortedByDescending { profile.globals[it] }
   }
 
   fun toChunk(): Chunk {
     return Chunk(
       count = code.size,
       capacity = code.size + 8,
-      lines = lines.toIntArray(),
-      code = code.map { it.toUInt() }.toUIntArray(),
+      lines = lines.toTypedArray(),
+      code = code.toUByteArray(),
       consts = ValueArray(
         count = consts.size,
         capacity = consts.size + 8,
         values = consts.toTypedArray()
-      )
+      ),
+      globals = ValueArray(
+        count = globals.size,
+        capacity = globals.size,
+        values = globals.entries
+          .sortedBy { it.value }
+          .map<Map.Entry<String, Int>, Value> { StringValue(it.key) }
+          .toTypedArray()
+      ),
+      strings = strings.strings.toTypedArray(),
+      registers = registers
     )
   }
 }
 
+private val constOps = setOf(OpCode.Const, OpCode.ConstWide16, OpCode.ConstWide24)
+
 @ExperimentalUnsignedTypes
-fun IrContext.makeConst(int: Int): UByte {
+fun IrContext.makeConst(int: Int): Int {
   return makeConst(IntValue(int))
 }
 
 @ExperimentalUnsignedTypes
-fun IrContext.makeConst(double: Double): UByte {
+fun IrContext.makeConst(double: Double): Int {
   return makeConst(DoubleValue(double))
 }
 
 @ExperimentalUnsignedTypes
-fun IrContext.makeConst(string: String): UByte {
+fun IrContext.makeConst(string: String): Int {
   return makeConst(StringValue(string))
 }
 
 @ExperimentalUnsignedTypes
 fun IrContext.write(op: OpCode, line: Int) {
-  write(op.ordinal.toUByte(), line)
+  write(op, emptyList(), line)
 }
 
+/**
+ * Writes [op] with the [index] operand, as its Wide16 or Wide24
+ * variant when the index doesn't fit a byte
+ */
 @ExperimentalUnsignedTypes
-fun IrContext.write(op: OpCode, const: UByte, line: Int) {
-  write(op, line)
-  write(const, line)
+fun IrContext.write(op: OpCode, index: Int, line: Int) {
+  val width = when {
+    index <= 0xff -> 1
+    index <= 0xffff -> 2
+    index <= 0xffffff -> 3
+    else -> error("The index $index doesn't fit in 24 bits")
+  }
+
+  val operands = List(width) { byte ->
+    (index ushr (8 * byte)).toUByte()
+  }
+
+  write(OpCode.values()[op.ordinal + width - 1], operands, line)
 }
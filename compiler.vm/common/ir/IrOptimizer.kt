@@ -0,0 +1,178 @@
+package me.devgabi.kofl.compiler.vm.ir
+
+import me.devgabi.kofl.compiler.common.typing.KfType
+import me.devgabi.kofl.frontend.TokenType
+
+/**
+ * Rewrites the components of a program before they are rendered:
+ *   - level 1 folds the operators and the int comparisons over
+ *   constants, and drops the expression statements that can't fail
+ *   at runtime, see [canTrap], the other ones are kept and their
+ *   results popped;
+ *   - level 2 also replaces the accesses to a `val` bound to a
+ *   constant by the constant, and drops its global store.
+ *
+ * Level 0 keeps the components as they are
+ */
+@ExperimentalUnsignedTypes
+class IrOptimizer(private val level: Int) {
+  private val arithmetic = setOf(TokenType.Plus, TokenType.Minus, TokenType.Star)
+
+  private val constants = mutableMapOf<String, IrConst>()
+
+  // the globals stored by the statements optimized so far
+  private val defined = mutableSetOf<String>()
+
+  fun optimize(components: List<IrComponent>): List<IrComponent> {
+    if (level <= 0) return components
+
+    return components.mapNotNull { component ->
+      when (component) {
+        is IrVal -> optimizeVal(component)
+        is IrVar -> {
+          constants.remove(component.name)
+          defined.add(component.name)
+          IrVar(component.name, fold(component.value), component.line)
+        }
+        else -> {
+          val value = fold(component)
+
+          if (canTrap(value)) IrPop(value, component.line) else null
+        }
+      }
+    }
+  }
+
+  private fun optimizeVal(component: IrVal): IrComponent? {
+    val value = fold(component.value)
+
+    if (level >= 2 && value is IrConst) {
+      constants[component.name] = value
+      return null
+    }
+
+    constants.remove(component.name)
+    defined.add(component.name)
+
+    return IrVal(component.name, value, component.line)
+  }
+
+  /**
+   * Whether the vm can fail running [component]: a division can be
+   * by zero, a global can be read before it's defined, and the types
+   * of the operands of the other operators are checked at runtime.
+   * The concatenations are kept too, they allocate
+   */
+  private fun canTrap(component: IrComponent): Boolean = when (component) {
+    is IrConst -> false
+    is IrAccessVar -> component.name !in defined
+    is IrUnary -> canTrap(component.right) || when (component.op) {
+      TokenType.Bang -> component.right.type != KfType.Boolean
+      else -> !component.right.type.isNumber()
+    }
+    is IrBinary -> canTrap(component.left) || canTrap(component.right) ||
+      !component.left.type.isNumber() || !component.right.type.isNumber() ||
+      when (component.type) {
+        KfType.Int, KfType.Double -> component.op !in arithmetic
+        KfType.Boolean -> component.left.type != KfType.Int || component.right.type != KfType.Int
+        else -> true
+      }
+    else -> true
+  }
+
+  private fun fold(component: IrComponent): IrComponent {
+    return when (component) {
+      is IrAccessVar -> constants[component.name]
+        ?.let { IrConst(it.value, it.type, component.line) }
+        ?: component
+      is IrUnary -> foldUnary(component)
+      is IrBinary -> foldBinary(component)
+      else -> component
+    }
+  }
+
+  private fun foldUnary(component: IrUnary): IrComponent {
+    val right = fold(component.right)
+    val unfolded = IrUnary(component.op, right, component.type, component.line)
+
+    if (right !is IrConst) return unfolded
+
+    return when {
+      component.op == TokenType.Bang && right.type == KfType.Boolean ->
+        IrConst(right.value != true, KfType.Boolean, component.line)
+      component.op == TokenType.Minus && right.type == KfType.Int ->
+        IrConst(-right.intValue(), KfType.Int, component.line)
+      component.op == TokenType.Minus && right.type == KfType.Double ->
+        IrConst(-right.doubleValue(), KfType.Double, component.line)
+      else -> unfolded
+    }
+  }
+
+  private fun foldBinary(component: IrBinary): IrComponent {
+    val left = fold(component.left)
+    val right = fold(component.right)
+    val unfolded = IrBinary(left, right, component.op, component.type, component.line)
+
+    if (left !is IrConst || right !is IrConst) return unfolded
+
+    val line = component.line
+
+    return when (component.type) {
+      // OP_CONCAT fails on the other types
+      KfType.String -> when {
+        component.op != TokenType.Plus -> unfolded
+        left.type != KfType.String || right.type != KfType.String -> unfolded
+        else -> IrConst(left.value.toString() + right.value.toString(), KfType.String, line)
+      }
+      KfType.Int -> when {
+        left.type != KfType.Int || right.type != KfType.Int -> unfolded
+        else -> foldInt(component.op, left.intValue(), right.intValue())
+          ?.let { IrConst(it, KfType.Int, line) }
+          ?: unfolded
+      }
+      KfType.Double -> foldDouble(component.op, left.doubleValue(), right.doubleValue())
+        ?.let { IrConst(it, KfType.Double, line) }
+        ?: unfolded
+      KfType.Boolean -> when {
+        left.type != KfType.Int || right.type != KfType.Int -> unfolded
+        else -> compareInt(component.op, left.intValue(), right.intValue())
+          ?.let { IrConst(it, KfType.Boolean, line) }
+          ?: unfolded
+      }
+      else -> unfolded
+    }
+  }
+
+  private fun compareInt(op: TokenType, left: Int, right: Int): Boolean? = when (op) {
+    TokenType.Less -> left < right
+    TokenType.LessEqual -> left <= right
+    TokenType.Greater -> left > right
+    TokenType.GreaterEqual -> left >= right
+    TokenType.EqualEqual -> left == right
+    TokenType.BangEqual -> left != right
+    else -> null
+  }
+
+  // the division by zero is left to the runtime
+  private fun foldInt(op: TokenType, left: Int, right: Int): Int? = when (op) {
+    TokenType.Plus -> left + right
+    TokenType.Minus -> left - right
+    TokenType.Star -> left * right
+    TokenType.Slash -> if (right == 0) null else left / right
+    else -> null
+  }
+
+  private fun foldDouble(op: TokenType, left: Double, right: Double): Double? = when (op) {
+    TokenType.Plus -> left + right
+    TokenType.Minus -> left - right
+    TokenType.Star -> left * right
+    TokenType.Slash -> left / right
+    else -> null
+  }
+
+  private fun KfType.isNumber(): Boolean = this == KfType.Int || this == KfType.Double
+
+  private fun IrConst.intValue(): Int = value.toString().toInt()
+
+  private fun IrConst.doubleValue(): Double = value.toString().toDouble()
+}
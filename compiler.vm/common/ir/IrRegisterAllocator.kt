@@ -0,0 +1,167 @@
+package me.devgabi.kofl.compiler.vm.ir
+
+import me.devgabi.kofl.compiler.common.typing.KfType
+import me.devgabi.kofl.compiler.vm.OpCode
+import me.devgabi.kofl.compiler.vm.RegOpCode
+
+/**
+ * Writes the components with the register instruction set of the
+ * vm, instead of rendering them to the stack one: every expression
+ * is computed into a register, and the constants with a small index
+ * are read in place, as operands with [CONST_BIT] set.
+ *
+ * The registers of an expression are allocated in a stack: the ones
+ * of its operands are freed once the instruction reads them, so the
+ * result reuses the first of them, and a statement frees them all
+ */
+@ExperimentalUnsignedTypes
+class IrRegisterAllocator(private val context: IrContext) {
+  // the first free register
+  private var top = 0
+
+  /**
+   * The registers used by the largest expression
+   */
+  var registerCount: Int = 0
+    private set
+
+  fun allocate(components: List<IrComponent>) {
+    components.forEach { component ->
+      statement(component)
+      top = 0
+    }
+  }
+
+  private fun statement(component: IrComponent) {
+    when (component) {
+      is IrVal -> store(component.name, component.value, component.line)
+      is IrVar -> store(component.name, component.value, component.line)
+      // the register of the result is freed with the statement
+      is IrPop -> operand(component.value)
+      else -> operand(component)
+    }
+  }
+
+  private fun store(name: String, value: IrComponent, line: Int) {
+    val operand = operand(value)
+
+    context.write(RegOpCode.SetGlobalSlot, slotOperands(context.globalSlot(name)) + operand, line)
+  }
+
+  /**
+   * Writes the instructions that compute [component]
+   *
+   * @return the register or constant operand that holds it
+   */
+  private fun operand(component: IrComponent): UByte {
+    return when (component) {
+      is IrConst -> const(component)
+      is IrAccessVar -> {
+        val target = push()
+        context.write(RegOpCode.GetGlobalSlot, listOf(target) + slotOperands(context.globalSlot(component.name)), component.line)
+        target
+      }
+      is IrUnary -> {
+        val mark = top
+        val right = operand(component.right)
+
+        top = mark
+        val target = push()
+        context.write(registerOps.getValue(component.selectOp()), listOf(target, right), component.line)
+        target
+      }
+      is IrBinary -> {
+        val op = component.selectOp()
+        val mark = top
+        val left = operand(component.left).toDouble(component.left, component.readsDoubles(op), component.line)
+        val right = operand(component.right).toDouble(component.right, component.readsDoubles(op), component.line)
+
+        top = mark
+        val target = push()
+        context.write(registerOps.getValue(op), listOf(target, left, right), component.line)
+        target
+      }
+      else -> TODO("Unsupported component $component")
+    }
+  }
+
+  private fun const(component: IrConst): UByte {
+    val index = when (component.type) {
+      KfType.Boolean -> {
+        val target = push()
+        context.write(if (component.value == true) RegOpCode.True else RegOpCode.False, listOf(target), component.line)
+        return target
+      }
+      KfType.String -> context.makeConst(component.value.toString())
+      KfType.Int -> context.makeConst(component.value.toString().toInt())
+      KfType.Double -> context.makeConst(component.value.toString().toDouble())
+      else -> TODO("Unsupported type ${component.type}")
+    }
+
+    if (index < CONST_BIT) return (index or CONST_BIT).toUByte()
+
+    val target = push()
+    context.write(RegOpCode.LoadConst, listOf(target) + slotOperands(index), component.line)
+    return target
+  }
+
+  /**
+   * Converts the int [component] held by [this], for the opcodes
+   * that only read doubles
+   */
+  private fun UByte.toDouble(component: IrComponent, readsDoubles: Boolean, line: Int): UByte {
+    if (!readsDoubles || component.type != KfType.Int) return this
+
+    val target = push()
+    context.write(RegOpCode.I32ToF64, listOf(target, this), line)
+    return target
+  }
+
+  private fun push(): UByte {
+    if (top >= CONST_BIT) error("The expression needs more than $CONST_BIT registers")
+
+    val register = top++
+    if (top > registerCount) registerCount = top
+
+    return register.toUByte()
+  }
+
+  // the 3 bytes little endian operand of a constant or global slot
+  private fun slotOperands(index: Int): List<UByte> {
+    if (index > 0xffffff) error("The index $index doesn't fit in 24 bits")
+
+    return List(3) { byte ->
+      (index ushr (8 * byte)).toUByte()
+    }
+  }
+
+  private companion object {
+    const val CONST_BIT = 0x80
+
+    val registerOps = mapOf(
+      OpCode.Negate to RegOpCode.Negate,
+      OpCode.Not to RegOpCode.Not,
+      OpCode.Sum to RegOpCode.Sum,
+      OpCode.Sub to RegOpCode.Sub,
+      OpCode.Mult to RegOpCode.Mult,
+      OpCode.Div to RegOpCode.Div,
+      OpCode.Concat to RegOpCode.Concat,
+      OpCode.SumI32 to RegOpCode.SumI32,
+      OpCode.SubI32 to RegOpCode.SubI32,
+      OpCode.MultI32 to RegOpCode.MultI32,
+      OpCode.DivI32 to RegOpCode.DivI32,
+      OpCode.NegateI32 to RegOpCode.NegateI32,
+      OpCode.LessI32 to RegOpCode.LessI32,
+      OpCode.LessEqualI32 to RegOpCode.LessEqualI32,
+      OpCode.GreaterI32 to RegOpCode.GreaterI32,
+      OpCode.GreaterEqualI32 to RegOpCode.GreaterEqualI32,
+      OpCode.EqualI32 to RegOpCode.EqualI32,
+      OpCode.NotEqualI32 to RegOpCode.NotEqualI32,
+      OpCode.SumF64 to RegOpCode.SumF64,
+      OpCode.SubF64 to RegOpCode.SubF64,
+      OpCode.MultF64 to RegOpCode.MultF64,
+      OpCode.DivF64 to RegOpCode.DivF64,
+      OpCode.NegateF64 to RegOpCode.NegateF64,
+    )
+  }
+}